@@ -10,6 +10,19 @@
 #include "protocol/stdser.h"
 #include "protocol/ecbm.h"
 #include "protocol/xserial.hpp"
+#include "protocol/EcbmReport.hpp"
+#include "protocol/WireCapture.hpp"
+#include "protocol/EcbmEmu.hpp"
+#include "protocol/lzss.h"
+#include "protocol/UploadJournal.hpp"
+#include "protocol/FirmwareContainer.hpp"
+#include "protocol/FileIo.hpp"
+#include "protocol/Json.hpp"
+#include "protocol/ChunkPipeline.hpp"
+#include "protocol/EncCache.hpp"
+#include "protocol/sha256.h"
+#include "protocol/LocalSocket.hpp"
+#include "protocol/RunCheckpoint.hpp"
 
 #include <fstream>
 #include <iterator>
@@ -18,13 +31,27 @@
 #include <random>
 #include <cstring>
 #include <thread>
+#include <memory>
+#include <atomic>
+#include <filesystem>
+#include <set>
+#include <functional>
+#include <sstream>
+#include <mutex>
+#include <csignal>
 
 #define DEF_ADDR		1
+#define DEF_BAUD		115200
+#define ENCRYPT_CHUNK	(1024 * 1024)		// multiple of BOOTPROT_BLOCK_SIZE
+#define SERVE_EMU_FLASH	(16 * 1024 * 1024)
 #define DEBUG_EN		1
 #define DEBUG_IOECBM_EN	0
 
 using namespace std;
 
+// Rates tried by baud negotiation, all supported by xserial
+const uint32_t UART_BAUDS[] = { 115200, 230400, 460800, 921600, 1000000, 2000000, 3000000, 4000000 };
+
 struct Arguments {
 	struct Ports : structopt::sub_command {
 		optional<bool> verbose = false;
@@ -37,23 +64,90 @@ struct Arguments {
 		string key;
 		string test_phrase;
 		optional<int> filler = 1;
+		optional<bool> compress = false;
+		optional<int> enc_version = 1;		// .enc container: 1 - msgpack blob, 2 - indexed
+		optional<string> cache_dir;
+		optional<int> cache_max_mb = 1024;
+		optional<string> keys;				// key list, one output per key
+	};
+
+	struct EncryptBatch : structopt::sub_command {
+		string manifest;
+		optional<int> jobs = 0;				// worker threads, 0 - one per core
+		optional<string> cache_dir;
+		optional<int> cache_max_mb = 1024;
+	};
+
+	struct Verify : structopt::sub_command {
+		vector<string> files;
+		optional<string> key;
+		optional<int> jobs = 0;				// worker threads, 0 - one per core
 	};
 
 	struct Upload : structopt::sub_command {
 		string file;
 		int pincode = 0;
 		optional<int> port;
+		optional<int> retries = 5;
+		optional<int> backoff_ms = 20;
+		optional<int> max_backoff = 1000;
+		optional<bool> stats = false;
+		optional<string> json_stats;
+		optional<string> capture;
+		optional<bool> emulate = false;
+		optional<string> fw_key;
+		optional<int> uart_baud;
+		optional<int> downshift = 3;
+		optional<bool> no_delta = false;
+		optional<bool> resume = false;
+		optional<string> journal;			// used with resume only
+		optional<string> server;			// serve socket, FWU_SERVER by default
+		optional<int> ready_ms = 3000;		// limit of bootloader start after reset
+		optional<int> block_size = 0;		// 0 - tuned by goodput
+		optional<int> max_block = BOOTPROT_BLOCK_SIZE;	// tuned size limit, not above device buffer: oversized blocks are dropped
+		optional<bool> sparse = false;		// leave filler regions to the erase, the bootloader must take sparse flag
+		optional<bool> force_reset = false;	// reset also device that answers as bootloader
 	};
 
 	struct GetInfo : structopt::sub_command {
 		int pincode = 0;
 		optional<int> port;
+		optional<bool> stats = false;
+		optional<string> json_stats;
+		optional<string> capture;
+		optional<bool> emulate = false;
+		optional<string> server;
+		optional<int> ready_ms = 3000;
+		optional<bool> force_reset = false;
 	};
 
 	struct SetPin : structopt::sub_command {
 		int pincode = 0;
 		optional<int> port;
 		int new_pincode = 0;
+		optional<bool> stats = false;
+		optional<string> json_stats;
+		optional<string> capture;
+		optional<string> server;
+		optional<int> ready_ms = 3000;
+		optional<bool> force_reset = false;
+	};
+
+	struct Emulate : structopt::sub_command {
+		int pincode = 0;
+		optional<vector<int>> addr;
+		optional<string> key;
+		optional<int> erase_us = 0;
+		optional<int> program_us = 0;
+		optional<int> boot_ms = 0;			// deaf time after reset
+		optional<bool> start_app = false;	// app runs after upload until reset
+		optional<int> max_frame = ECBM_MAX_FRAME;
+		optional<bool> verbose = false;
+	};
+
+	struct Replay : structopt::sub_command {
+		string file;
+		optional<int> pincode;
 	};
 
 	struct PinToKey : structopt::sub_command {
@@ -78,46 +172,149 @@ struct Arguments {
 		};
 
 		optional<int> port;
+		optional<bool> stats = false;
+		optional<string> json_stats;
+		optional<string> capture;
+		optional<string> server;
 
 		Wu16 wu16;
 	};
 
+	// Daemon keeping ports and bootloader sessions open for jobs of thin clients
+	struct Serve : structopt::sub_command {
+		optional<string> socket;			// FWU_SERVER, then $XDG_RUNTIME_DIR/fwu/serve.sock
+		optional<int> session_ttl_s = 60;
+		optional<bool> emulate = false;		// emulated device behind every port
+		optional<int> pincode = 0;			// of emulated devices
+		optional<string> fw_key;
+		optional<int> boot_ms = 0;
+		optional<bool> status = false;		// ask running server instead
+		optional<bool> stop = false;
+	};
+
+	struct Run : structopt::sub_command {
+		string jobs;
+		optional<int> parallel = 0;			// ports at once, 0 - all
+		optional<string> report;			// JSON results
+		optional<string> checkpoint;		// state log, jobs file + ".ckpt" by default
+		optional<bool> resume = false;		// skip jobs verified by checkpoint log
+		optional<bool> emulate = false;		// emulated devices at addresses of jobs
+		optional<int> pincode = 0;			// of emulated devices
+		optional<string> fw_key;
+		optional<int> boot_ms = 0;
+	};
+
 	Ports ports;
 	Encrypt encrypt;
+	EncryptBatch encrypt_batch;
+	Verify verify;
 	Upload upload;
 	GetInfo info;
 	SetPin set_pincode;
 	PinToKey pintokey;
 	GenKey genkey;
 	EcbmCmd ecbm;
+	Replay replay;
+	Emulate emulate;
+	Serve serve;
+	Run run;
 };
 
+/* Short flag is the first letter of field name and structopt does not check it is unique.
+ * The first field of the list takes a shared letter, yet a later one may claim it too at the end
+ * of command line, so options sharing the letter are documented as long only (README):
+ * upload: -r retries/resume/ready_ms, -b backoff_ms/block_size, -m max_backoff/max_block,
+ *		-j json_stats/journal, -s stats/server/sparse, -f fw_key/force_reset; info, set_pincode, ecbm: -s stats/server;
+ * encrypt: -c compress/cache_dir/cache_max_mb; encrypt_batch: -c cache_dir/cache_max_mb;
+ * serve: -s socket/session_ttl_s/status/stop; run: -p parallel/pincode, -r report/resume
+ */
 STRUCTOPT(Arguments::Ports, verbose);
-STRUCTOPT(Arguments::Encrypt, file, firmware_name, firmware_version, key, test_phrase, filler);
-STRUCTOPT(Arguments::Upload, file, pincode, port);
-STRUCTOPT(Arguments::GetInfo, pincode, port);
-STRUCTOPT(Arguments::SetPin, pincode, port, new_pincode);
+STRUCTOPT(Arguments::Encrypt, file, firmware_name, firmware_version, key, test_phrase, filler, compress, enc_version, cache_dir, cache_max_mb, keys);
+STRUCTOPT(Arguments::Upload, file, pincode, port, retries, backoff_ms, max_backoff, stats, json_stats, capture, emulate, fw_key, uart_baud, downshift, no_delta, resume, journal, server, ready_ms, block_size, max_block, sparse, force_reset);
+STRUCTOPT(Arguments::GetInfo, pincode, port, stats, json_stats, capture, emulate, server, ready_ms, force_reset);
+STRUCTOPT(Arguments::SetPin, pincode, port, new_pincode, stats, json_stats, capture, server, ready_ms, force_reset);
+STRUCTOPT(Arguments::Replay, file, pincode);
+STRUCTOPT(Arguments::Emulate, pincode, addr, key, erase_us, program_us, boot_ms, start_app, max_frame, verbose);
 STRUCTOPT(Arguments::PinToKey, pincode);
 STRUCTOPT(Arguments::GenKey, fmt);
 
 STRUCTOPT(Arguments::EcbmCmd::Wu16, pin, addr, sig, data);
-STRUCTOPT(Arguments::EcbmCmd, port, wu16);
+STRUCTOPT(Arguments::EcbmCmd, port, stats, json_stats, capture, server, wu16);
 
-STRUCTOPT(Arguments, ports, encrypt, upload, info, set_pincode, pintokey, genkey, ecbm);
+STRUCTOPT(Arguments::EncryptBatch, manifest, jobs, cache_dir, cache_max_mb);
+STRUCTOPT(Arguments::Verify, files, key, jobs);
+STRUCTOPT(Arguments::Serve, socket, session_ttl_s, emulate, pincode, fw_key, boot_ms, status, stop);
+STRUCTOPT(Arguments::Run, jobs, parallel, report, checkpoint, resume, emulate, pincode, fw_key, boot_ms);
+STRUCTOPT(Arguments, ports, encrypt, encrypt_batch, verify, upload, info, set_pincode, pintokey, genkey, ecbm, replay, emulate, serve, run);
 
-struct FirmwareFile {
-	string name;
-	vector<uint8_t> version;
-	uint32_t checksum;
-	vector<uint8_t> test_phrase;
-	vector<uint8_t> data;
+/* Checksum, block crcs and filler runs of padded image,
+ * fed in order by chunks which are multiple of BOOTPROT_BLOCK_SIZE except last one
+ */
+struct ImageScan {
+	uint8_t filler;
+	uint32_t crc = 0;
+	size_t size = 0;
+	size_t nfiller = 0;
+	vector<uint32_t> block_crcs;
+	vector<uint32_t> sparse_map;		// offset, length pairs
+
+	explicit ImageScan(uint8_t filler) : filler(filler) {}
+
+	void feed(span<const uint8_t> chunk) {
+		crc = crc32_update(crc, chunk.data(), chunk.size());
+		for (size_t i = 0; i < chunk.size(); i += BOOTPROT_BLOCK_SIZE) {
+			block_crcs.push_back(crc32(&chunk[i], min<size_t>(BOOTPROT_BLOCK_SIZE, chunk.size() - i)));
+		}
+		for (size_t i = 0; i < chunk.size(); i += 8) {
+			bool is_filler = all_of(&chunk[i], &chunk[i] + 8, [this](uint8_t v) { return v == filler; });
+			if (is_filler && !_run_begin.has_value()) {
+				_run_begin = size + i;
+			}
+			else if (!is_filler && _run_begin.has_value()) {
+				add_filler_run(_run_begin.value(), size + i);
+				_run_begin.reset();
+			}
+		}
+		size += chunk.size();
+	}
+
+	void finish() {
+		if (_run_begin.has_value()) {
+			add_filler_run(_run_begin.value(), size);
+			_run_begin.reset();
+		}
+	}
+
+private:
+	optional<size_t> _run_begin;
 
-	template<class T>
-	void pack(T& pack) {
-		pack(name, version, checksum, test_phrase, data);
+	void add_filler_run(size_t begin, size_t end) {
+		if (end - begin >= BOOTPROT_SPARSE_MIN) {
+			sparse_map.push_back((uint32_t)begin);
+			sparse_map.push_back((uint32_t)(end - begin));
+			nfiller += end - begin;
+		}
 	}
 };
 
+void pad_to_block(vector<uint8_t>& data, uint8_t filler) {
+	while (data.size() % 8 != 0) {
+		data.push_back(filler);
+	}
+}
+
+// Chunk number index of image padded to cipher block, false after last one
+bool read_image_chunk(span<const uint8_t> image, size_t index, vector<uint8_t>& chunk, uint8_t filler, size_t chunk_size = ENCRYPT_CHUNK) {
+	size_t offset = index * chunk_size;
+	if (offset >= image.size()) {
+		return false;
+	}
+	auto part = image.subspan(offset, min<size_t>(chunk_size, image.size() - offset));
+	chunk.assign(part.begin(), part.end());
+	pad_to_block(chunk, filler);
+	return true;
+}
+
 array<uint8_t, 16> pin_to_key(int pin) {
 	array<uint8_t, 16> key;
 	array<uint8_t, 3> digits;
@@ -134,67 +331,678 @@ array<uint8_t, 16> pin_to_key(int pin) {
 	return key;
 }
 
-xserial::ComPort* _com;
+array<uint8_t, 16> parse_key(const string& hex) {
+	if (hex.length() != 32) {
+		throw runtime_error("key must be written as 32 HEX symbols, example - '00112233445566778899AABBCCDDEEFF'");
+	}
+	array<uint8_t, 16> key;
+	char buf[3] = {0};
+	for (size_t i = 0; i < 16; i++) {
+		memcpy(buf, &hex.c_str()[i*2], 2);
+		key[i] = (uint8_t)std::strtoul(buf, NULL, 16);
+	}
+	return key;
+}
 
-static int _write(size_t id, const uint8_t* data, size_t ndata) {
-#if DEBUG_IOECBM_EN
-	cout << "[ECBM] write " << ndata << " bytes: " << endl;
-	cout << "\t";
-	for (auto i = 0; i < ndata; i++) {
-		printf("%02X ", data[i]);
+vector<uint8_t> parse_version(const string& text) {
+	int ver_buf[3];
+	#if defined(__MINGW32__) || defined(_WIN32)
+	if (sscanf_s(text.c_str(), "%i.%i.%i", &ver_buf[0], &ver_buf[1], &ver_buf[2]) != 3) {
+		throw runtime_error("version must be as three numbers between 0..255 delemited by dot, example - '0.5.12'");
 	}
-	cout << endl;
-#endif
-	if (_com->write((char*)data, (unsigned long)ndata)) {
-		return 0;
+	#else
+	if (sscanf(text.c_str(), "%i.%i.%i", &ver_buf[0], &ver_buf[1], &ver_buf[2]) != 3) {
+		throw runtime_error("version must be as three numbers between 0..255 delemited by dot, example - '0.5.12'");
 	}
-	else {
-		return -1;
+	#endif
+	vector<uint8_t> version;
+	for (size_t i = 0; i < 3; i++) {
+		if (ver_buf[i] > 255 || ver_buf[i] < 0) {
+			version.push_back(255);
+		}
+		else {
+			version.push_back((uint8_t)ver_buf[i]);
+		}
 	}
+	return version;
 }
 
-static int _read(size_t id, uint8_t* buf, size_t bufsize) {
-	if (_com->bytesToRead() > 0) {
-		return _com->read((char*)buf, (unsigned long)bufsize);
+struct EncryptJob {
+	string file;
+	string out;
+	string name;
+	vector<uint8_t> version;
+	array<uint8_t, 16> key;
+	string test_phrase;
+	uint8_t filler = 0xFF;
+	bool compress = false;
+	int enc_version = 1;
+	size_t nworkers = 1;			// cipher threads
+	EncCache* cache = nullptr;
+};
+
+struct EncryptResult {
+	size_t input_size = 0;
+	size_t raw_size = 0;		// padded plaintext
+	size_t fw_size = 0;			// encrypted payload
+	size_t out_size = 0;
+	uint32_t checksum = 0;
+	FirmwareCodec codec = FirmwareCodec::None;
+	size_t nregions = 0;
+	size_t nfiller = 0;
+	bool cached = false;
+};
+
+// Output of encrypt_firmware_keys() under its own key
+struct EncryptTarget {
+	string out;
+	array<uint8_t, 16> key;
+};
+
+array<uint8_t, SHA256_SIZE> image_digest(span<const uint8_t> image) {
+	Sha256 ctx;
+	array<uint8_t, SHA256_SIZE> digest;
+	sha256_init(&ctx);
+	sha256_update(&ctx, image.data(), image.size());
+	sha256_final(&ctx, digest.data());
+	return digest;
+}
+
+// Cache key over everything that affects .enc bytes, image is hashed once for all keys
+string artifact_hash(const EncryptJob& job, const array<uint8_t, 16>& key, const array<uint8_t, SHA256_SIZE>& image) {
+	Sha256 ctx;
+	uint8_t digest[SHA256_SIZE];
+	auto add = [&ctx](const void* data, size_t ndata) {
+		sha256_update(&ctx, (const uint8_t*)data, ndata);
+	};
+	auto add_str = [&add](const string& str) {
+		uint8_t len[4];
+		stdser_s32((uint32_t)str.size(), len);
+		add(len, 4);
+		add(str.data(), str.size());
+	};
+	uint8_t flags[3] = { job.filler, (uint8_t)job.compress, (uint8_t)job.enc_version };
+	sha256_init(&ctx);
+	add_str("fwu-enc-cache/2");
+	add_str(job.name);
+	add_str(string(job.version.begin(), job.version.end()));
+	add_str(job.test_phrase);
+	add(key.data(), key.size());
+	add(flags, sizeof(flags));
+	add(image.data(), image.size());
+	sha256_final(&ctx, digest);
+	string hex;
+	char buf[3];
+	for (auto b : digest) {
+		snprintf(buf, sizeof(buf), "%02x", b);
+		hex += buf;
+	}
+	return hex;
+}
+
+// Figures of artifact fetched from cache
+EncryptResult cached_result(const string& path, size_t input_size) {
+	MappedFile file(path);
+	auto fw = read_firmware(file.data(), false);
+	EncryptResult result = {
+		.input_size = input_size,
+		.raw_size = fw.codec == (uint8_t)FirmwareCodec::Lzss ? fw.raw_size : fw.data.size(),
+		.fw_size = fw.data.size(),
+		.out_size = file.size(),
+		.checksum = fw.checksum,
+		.codec = (FirmwareCodec)fw.codec,
+		.nregions = fw.sparse_map.size() / 2,
+		.cached = true
+	};
+	for (size_t i = 1; i < fw.sparse_map.size(); i += 2) {
+		result.nfiller += fw.sparse_map[i];
+	}
+	return result;
+}
+
+/* Encrypt command for several keys at once, job.out and job.key are not used.
+ * Image is read, scanned and compressed once, then every payload chunk
+ * goes through raiden_encode_lanes() for all keys and out to every target.
+ */
+vector<EncryptResult> encrypt_firmware_keys(const EncryptJob& job, const vector<EncryptTarget>& targets) {
+	if (job.test_phrase.length() != 16) {
+		throw runtime_error("test_phrase must be written as 16 ASCII symbols");
+	}
+	MappedFile fw_file(job.file);
+	auto image = fw_file.data();
+	vector<EncryptResult> results(targets.size());
+	vector<size_t> pending;
+	vector<string> cache_keys(targets.size());
+	if (job.cache != nullptr) {
+		auto digest = image_digest(image);
+		for (size_t i = 0; i < targets.size(); i++) {
+			cache_keys[i] = artifact_hash(job, targets[i].key, digest);
+			if (job.cache->fetch(cache_keys[i], targets[i].out)) {
+				results[i] = cached_result(targets[i].out, image.size());
+			}
+			else {
+				pending.push_back(i);
+			}
+		}
 	}
 	else {
-		return 0;
+		for (size_t i = 0; i < targets.size(); i++) {
+			pending.push_back(i);
+		}
+	}
+	if (pending.empty()) {
+		return results;
+	}
+	/* Without compression image is passed twice by chunks, header needs checksum before payload:
+	 * read -> scan, then read -> encrypt on workers -> write in order.
+	 * Reader thread copies chunks out of mapping, so file I/O overlaps crc and cipher.
+	 * Compressed payload is encrypted from memory the same way.
+	 */
+	bool streamed = !job.compress;
+	size_t depth = job.nworkers * 2 + 2;
+	ImageScan scan(job.filler);
+	vector<uint8_t> data;
+	if (streamed) {
+		ChunkPipeline(0, depth).run([&](size_t index, vector<uint8_t>& chunk) {
+			return read_image_chunk(image, index, chunk, job.filler);
+		}, nullptr, [&](size_t, vector<uint8_t>& chunk) {
+			scan.feed(chunk);
+		});
+	}
+	else {
+		data.assign(image.begin(), image.end());
+		pad_to_block(data, job.filler);
+		scan.feed(data);
+	}
+	scan.finish();
+	EncryptResult common;
+	common.input_size = image.size();
+	common.raw_size = scan.size;
+	common.checksum = scan.crc;
+	if (job.compress) {
+		vector<uint8_t> packed(lzss_bound(data.size()));
+		int rc = lzss_encode(data.data(), data.size(), packed.data(), packed.size());
+		if (rc < 0) {
+			throw runtime_error("fail to compress firmware: " + to_string(rc));
+		}
+		packed.resize(rc);
+		vector<uint8_t> check(data.size());
+		if (lzss_decode(packed.data(), packed.size(), check.data(), check.size()) != (int)data.size() || check != data) {
+			throw runtime_error("compressed firmware does not match original");
+		}
+		while (packed.size() % 8 != 0) {
+			packed.push_back(0);
+		}
+		if (packed.size() < data.size()) {
+			data = move(packed);
+			common.codec = FirmwareCodec::Lzss;
+		}
+	}
+	FirmwareFile fw = {
+		.name = job.name,
+		.version = job.version,
+		.checksum = scan.crc,
+		.codec = (uint8_t)common.codec,
+		.raw_size = common.codec == FirmwareCodec::None ? 0 : (uint32_t)scan.size
+	};
+	if (common.codec == FirmwareCodec::None) {
+		fw.crc_block = BOOTPROT_BLOCK_SIZE;
+		fw.block_crcs = move(scan.block_crcs);
+		fw.filler = job.filler;
+		fw.sparse_map = move(scan.sparse_map);
+		common.nregions = fw.sparse_map.size() / 2;
+		common.nfiller = scan.nfiller;
+	}
+	span<const uint8_t> payload = streamed ? image : span<const uint8_t>(data);
+	common.fw_size = streamed ? scan.size : data.size();
+
+	struct Output {
+		OutputFile file;
+		ostream stream;
+		FirmwareContainerWriter writer;
+
+		Output(const string& path, const FirmwareFile& meta, size_t payload_size, int version) :
+			file(path), stream(&file), writer(stream, meta, payload_size, version) {}
+	};
+	size_t nkeys = pending.size();
+	vector<uint8_t> keys(nkeys * 16);
+	vector<unique_ptr<Output>> outputs;
+	for (size_t k = 0; k < nkeys; k++) {
+		auto& target = targets[pending[k]];
+		memcpy(&keys[k * 16], target.key.data(), 16);
+		fw.test_phrase.resize(16);
+		raiden_encode(target.key.data(), (const uint8_t*)job.test_phrase.c_str(), fw.test_phrase.data(), 16);
+		outputs.push_back(make_unique<Output>(target.out, fw, common.fw_size, job.enc_version));
+	}
+	// Chunk per key shrinks with key count, so pipeline still holds about depth * ENCRYPT_CHUNK
+	size_t chunk_size = max<size_t>(ENCRYPT_CHUNK / nkeys / BOOTPROT_BLOCK_SIZE * BOOTPROT_BLOCK_SIZE, FWC_CHUNK_SIZE);
+	ChunkPipeline(job.nworkers, depth).run([&](size_t index, vector<uint8_t>& chunk) {
+		return read_image_chunk(payload, index, chunk, job.filler, chunk_size);
+	}, [&](size_t, vector<uint8_t>& chunk) {
+		if (nkeys == 1) {
+			raiden_encode_buf(keys.data(), chunk.data(), chunk.size());
+			return;
+		}
+		vector<uint8_t> lanes(chunk.size() * nkeys);
+		raiden_encode_lanes(keys.data(), nkeys, chunk.data(), lanes.data(), chunk.size());
+		chunk.swap(lanes);
+	}, [&](size_t, vector<uint8_t>& chunk) {
+		size_t n = chunk.size() / nkeys;
+		for (size_t k = 0; k < nkeys; k++) {
+			outputs[k]->writer.write(span<const uint8_t>(chunk).subspan(k * n, n));
+		}
+	});
+	// Scan and payload passes must have seen the same image
+	if (fw_file.changed()) {
+		throw runtime_error("firmware file changed while encrypting");
+	}
+	for (size_t k = 0; k < nkeys; k++) {
+		auto& output = *outputs[k];
+		output.writer.finish();
+		output.file.close();
+		auto& result = results[pending[k]];
+		result = common;
+		result.out_size = output.writer.size();
+		if (job.cache != nullptr) {
+			job.cache->store(cache_keys[pending[k]], targets[pending[k]].out);
+		}
+	}
+	return results;
+}
+
+// Whole encrypt command without output, safe to run in parallel for different outputs
+EncryptResult encrypt_firmware(const EncryptJob& job) {
+	return encrypt_firmware_keys(job, { { job.out, job.key } })[0];
+}
+
+/* Key list for encrypt --keys: "<key>" or "<label> <key>" per line, blank lines
+ * and lines starting with '#' are skipped. Output of each key is
+ * "<file>.<label>.enc", label defaults to line number.
+ */
+vector<EncryptTarget> read_key_list(const string& path, const string& file) {
+	ifstream in(path);
+	if (!in.is_open()) {
+		throw runtime_error("fail to open key list: " + path);
+	}
+	vector<EncryptTarget> targets;
+	set<string> labels;
+	string line;
+	for (size_t nline = 1; getline(in, line); nline++) {
+		istringstream fields(line);
+		string first, second, extra;
+		fields >> first >> second >> extra;
+		if (first.empty() || first[0] == '#') {
+			continue;
+		}
+		if (!extra.empty()) {
+			throw runtime_error(path + ":" + to_string(nline) + ": expected '[label] key'");
+		}
+		string label = second.empty() ? to_string(nline) : first;
+		string key = second.empty() ? first : second;
+		bool label_ok = all_of(label.begin(), label.end(), [](char c) { return isalnum((uint8_t)c) || c == '-' || c == '_' || c == '.'; });
+		if (!label_ok) {
+			throw runtime_error(path + ":" + to_string(nline) + ": label may have letters, digits, '-', '_' and '.' only");
+		}
+		if (!labels.insert(label).second) {
+			throw runtime_error(path + ":" + to_string(nline) + ": duplicate label '" + label + "'");
+		}
+		try {
+			targets.push_back({ file + "." + label + ".enc", parse_key(key) });
+		}
+		catch (const exception& e) {
+			throw runtime_error(path + ":" + to_string(nline) + ": " + e.what());
+		}
+	}
+	return targets;
+}
+
+// Runs task for 0..ntasks-1 on nthreads threads (0 - one per core), returns count of threads
+size_t run_parallel(size_t ntasks, size_t nthreads, const function<void(size_t)>& task) {
+	if (nthreads == 0) {
+		nthreads = max(thread::hardware_concurrency(), 1u);
+	}
+	nthreads = min(nthreads, max<size_t>(ntasks, 1));
+	atomic<size_t> next = 0;
+	vector<thread> workers;
+	for (size_t t = 0; t < nthreads; t++) {
+		workers.emplace_back([&]() {
+			for (size_t i = next++; i < ntasks; i = next++) {
+				task(i);
+			}
+		});
+	}
+	for (auto& w : workers) {
+		w.join();
 	}
+	return nthreads;
+}
+
+/* Manifest is array of entries or object with "entries" and optional "defaults",
+ * entry fields: file, out, name, version, key, test_phrase, filler, compress, enc_version.
+ * Relative paths are taken from manifest directory, out defaults to file + ".enc".
+ * Entries run on worker threads with one cipher thread each, so each holds
+ * a few image chunks (whole image with compress).
+ */
+void encrypt_batch(const string& manifest_path, int njobs, EncCache* cache) {
+	auto manifest = Json::parse_file(manifest_path);
+	auto base = filesystem::path(manifest_path).parent_path();
+	const Json& entries = manifest.is_array() ? manifest : manifest["entries"];
+	const Json& defaults = manifest["defaults"];
+	auto resolve = [&base](const string& path) {
+		auto p = filesystem::path(path);
+		return (p.is_relative() ? base / p : p).string();
+	};
+	vector<EncryptJob> jobs;
+	set<string> outs;
+	for (auto& entry : entries.items()) {
+		auto field = [&](const string& key) -> const Json& {
+			return entry.has(key) ? entry[key] : defaults[key];
+		};
+		auto text = [&](const string& key) {
+			if (field(key).is_null()) {
+				throw runtime_error("manifest entry " + to_string(jobs.size()) + ": '" + key + "' is missing");
+			}
+			return field(key).str();
+		};
+		EncryptJob job = {
+			.file = resolve(text("file")),
+			.name = text("name"),
+			.version = parse_version(text("version")),
+			.key = parse_key(text("key")),
+			.test_phrase = text("test_phrase"),
+			.filler = (uint8_t)(field("filler").is_null() || field("filler").number() != 0 ? 0xFF : 0),
+			.compress = !field("compress").is_null() && field("compress").boolean(),
+			.enc_version = field("enc_version").is_null() ? 1 : (int)field("enc_version").number()
+		};
+		job.out = field("out").is_null() ? job.file + ".enc" : resolve(field("out").str());
+		job.cache = cache;
+		// Spellings of one path, "a/../x.enc" and "x.enc" or a link, are one output
+		if (!outs.insert(filesystem::weakly_canonical(filesystem::absolute(job.out)).string()).second) {
+			throw runtime_error("manifest entry " + to_string(jobs.size()) + ": output '" + job.out + "' is used twice");
+		}
+		jobs.push_back(move(job));
+	}
+
+	vector<optional<EncryptResult>> results(jobs.size());
+	vector<string> errors(jobs.size());
+	auto started = chrono::steady_clock::now();
+	size_t nthreads = run_parallel(jobs.size(), (size_t)max(njobs, 0), [&](size_t i) {
+		try {
+			results[i] = encrypt_firmware(jobs[i]);
+		}
+		catch (const exception& e) {
+			errors[i] = e.what();
+		}
+	});
+	auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started);
+
+	size_t nfailed = 0;
+	size_t ncached = 0;
+	printf("%-4s %-16s %-10s %-10s %12s %12s  %s\n", "#", "name", "version", "checksum", "size", "enc size", "output");
+	for (size_t i = 0; i < jobs.size(); i++) {
+		auto& job = jobs[i];
+		auto version = to_string(job.version[0]) + "." + to_string(job.version[1]) + "." + to_string(job.version[2]);
+		if (results[i].has_value()) {
+			auto& r = results[i].value();
+			printf("%-4zu %-16s %-10s %08X   %12zu %12zu  %s%s\n", i, job.name.c_str(), version.c_str(), r.checksum, r.input_size, r.out_size, job.out.c_str(), r.cached ? " (cached)" : "");
+			ncached += r.cached ? 1 : 0;
+		}
+		else {
+			nfailed++;
+			printf("%-4zu %-16s %-10s %-10s %12s %12s  %s: %s\n", i, job.name.c_str(), version.c_str(), "-", "-", "-", job.file.c_str(), errors[i].c_str());
+		}
+	}
+	cout << jobs.size() - nfailed << " of " << jobs.size() << " encrypted in " << elapsed.count() << " ms, " << nthreads << " threads";
+	if (cache != nullptr) {
+		cout << ", " << ncached << " from cache";
+	}
+	cout << endl;
+	if (nfailed > 0) {
+		throw runtime_error(to_string(nfailed) + " entries failed");
+	}
+}
 
+struct VerifyResult {
+	string name;
+	string version;
+	uint32_t checksum = 0;
+	string test_phrase;
+	size_t size = 0;
+	string error;
+};
+
+/* Decrypts payload by chunks and checks plaintext against checksum and block crcs,
+ * compressed payload is checked after decoding. Test phrase must decrypt to printable ASCII.
+ */
+VerifyResult verify_firmware(const string& path, const array<uint8_t, 16>& key) {
+	VerifyResult result;
+	MappedFile file(path);
+	auto fw = read_firmware(file.data(), true, 1);
+	result.name = fw.name;
+	if (fw.version.size() == 3) {
+		result.version = to_string(fw.version[0]) + "." + to_string(fw.version[1]) + "." + to_string(fw.version[2]);
+	}
+	result.checksum = fw.checksum;
+	result.size = fw.data.size();
+	if (fw.test_phrase.size() != 16 || fw.data.size() % 8 != 0) {
+		throw runtime_error("malformed firmware file");
+	}
+	char phrase[17] = { 0 };
+	raiden_decode(key.data(), fw.test_phrase.data(), (uint8_t*)phrase, 16);
+	if (!all_of(phrase, phrase + 16, [](char c) { return c >= 0x20 && c <= 0x7E; })) {
+		throw runtime_error("test phrase is not ASCII, wrong key");
+	}
+	result.test_phrase = phrase;
+
+	bool compressed = fw.codec == (uint8_t)FirmwareCodec::Lzss;
+	bool check_blocks = !compressed && fw.crc_block > 0 && ENCRYPT_CHUNK % fw.crc_block == 0;
+	unique_ptr<LzssDecoder> lz;
+	vector<uint8_t> raw;
+	if (compressed) {
+		lz = make_unique<LzssDecoder>();
+		lzss_decoder_init(lz.get());
+	}
+	uint32_t crc = 0;
+	size_t nraw = 0;
+	vector<uint8_t> chunk;
+	for (size_t offset = 0; offset < fw.data.size(); offset += ENCRYPT_CHUNK) {
+		auto part = fw.data.subspan(offset, min<size_t>(ENCRYPT_CHUNK, fw.data.size() - offset));
+		chunk.assign(part.begin(), part.end());
+		raiden_decode_buf(key.data(), chunk.data(), chunk.size());
+		if (!compressed) {
+			crc = crc32_update(crc, chunk.data(), chunk.size());
+			for (size_t i = 0; check_blocks && i < chunk.size(); i += fw.crc_block) {
+				size_t block = (offset + i) / fw.crc_block;
+				size_t n = min<size_t>(fw.crc_block, chunk.size() - i);
+				if (block >= fw.block_crcs.size() || crc32(&chunk[i], n) != fw.block_crcs[block]) {
+					throw runtime_error("block " + to_string(block) + " crc mismatch");
+				}
+			}
+			nraw += chunk.size();
+			continue;
+		}
+		// Small input pieces bound decoder output, a reference expands 2 bytes up to LZSS_MAX_LEN
+		const size_t piece = 4096;
+		raw.resize(piece / 2 * LZSS_MAX_LEN + LZSS_MAX_LEN);
+		for (size_t i = 0; i < chunk.size() && nraw < fw.raw_size; i += piece) {
+			int n = lzss_decode_push(lz.get(), &chunk[i], min(piece, chunk.size() - i), raw.data(), min(raw.size(), fw.raw_size - nraw));
+			if (n < 0) {
+				throw runtime_error("compressed payload is corrupted");
+			}
+			crc = crc32_update(crc, raw.data(), (size_t)n);
+			nraw += (size_t)n;
+		}
+	}
+	if (compressed && nraw != fw.raw_size) {
+		throw runtime_error("compressed payload is truncated");
+	}
+	if (crc != fw.checksum) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "checksum mismatch: file %08X, payload %08X", fw.checksum, crc);
+		throw runtime_error(buf);
+	}
+	return result;
 }
 
 static void _sleep_ms(uint32_t ms) {
 	this_thread::sleep_for(chrono::milliseconds(ms));
 }
 
+static uint32_t _clock_us() {
+	return (uint32_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int _write(size_t id, const uint8_t* data, size_t ndata);
+static int _read(size_t id, uint8_t* buf, size_t bufsize);
+static int _set_baud(size_t id, uint32_t baud);
+
+// Ecbm over one serial port or emulator, ecbm id points back to the instance
 class IoEcbm {
 public:
 
 
-	IoEcbm(optional<int> numport) {
+	IoEcbm(optional<int> numport, optional<EcbmEmuConfig> emu = nullopt) {
+		if (emu.has_value()) {
+			_emu = make_unique<EcbmEmu>(emu.value());
+			_emu->attach(&_ecbm);
+			return;
+		}
 		if (numport.has_value()) {
-			_com = new xserial::ComPort(numport.value(), 115200, xserial::ComPort::COM_PORT_NOPARITY, 8, xserial::ComPort::COM_PORT_ONESTOPBIT);
+			_com = make_unique<xserial::ComPort>(numport.value(), DEF_BAUD, xserial::ComPort::COM_PORT_NOPARITY, 8, xserial::ComPort::COM_PORT_ONESTOPBIT);
 		}
 		else {
-			_com = new xserial::ComPort(115200, xserial::ComPort::COM_PORT_NOPARITY, 8, xserial::ComPort::COM_PORT_ONESTOPBIT);
+			_com = make_unique<xserial::ComPort>(DEF_BAUD, xserial::ComPort::COM_PORT_NOPARITY, 8, xserial::ComPort::COM_PORT_ONESTOPBIT);
 		}
 		if (!_com->getStateComPort()) {
 			throw runtime_error("fail to open com port");
 		}
-		ecbm_init(&_ecbm, 1, _write, _read, _sleep_ms);
+		ecbm_init(&_ecbm, (size_t)this, _write, _read, _sleep_ms);
+		ecbm_set_clock(&_ecbm, _clock_us);
+		ecbm_set_baud_cb(&_ecbm, _set_baud, DEF_BAUD);
 	};
 
+	IoEcbm(const IoEcbm&) = delete;
+	IoEcbm& operator=(const IoEcbm&) = delete;
+
 	Ecbm* instance() {
 		return &_ecbm;
 	}
 
-	~IoEcbm() {
+	string port_id() {
+		if (_emu) {
+			return "emu";
+		}
+		return to_string(_com->getNumComPort());
+	}
+
+	// Stats are reported on destruction, so failed commands report them too
+	void report_stats(optional<bool> print, optional<string> json_path) {
+		_print_stats = print.value_or(false);
+		_json_stats = json_path;
+	}
+
+	void capture(optional<string> path) {
+		if (path.has_value()) {
+			_capture = make_unique<WireCapture>(path.value());
+		}
+	}
+
+	int port_write(const uint8_t* data, size_t ndata) {
+#if DEBUG_IOECBM_EN
+		cout << "[ECBM] write " << ndata << " bytes: " << endl;
+		cout << "\t";
+		for (auto i = 0; i < ndata; i++) {
+			printf("%02X ", data[i]);
+		}
+		cout << endl;
+#endif
+		if (_capture) {
+			_capture->record(WireCapture::Tx, data, ndata);
+		}
+		if (_com->write((char*)data, (unsigned long)ndata)) {
+			return 0;
+		}
+		else {
+			return -1;
+		}
+	}
+
+	int port_read(uint8_t* buf, size_t bufsize) {
+		if (_com->bytesToRead() > 0) {
+			auto rc = _com->read((char*)buf, (unsigned long)bufsize);
+			if (_capture) {
+				_capture->record(WireCapture::Rx, buf, rc);
+			}
+			return rc;
+		}
+		else {
+			return 0;
+		}
+	}
 
+	int port_set_baud(uint32_t baud) {
+		_com->close();
+		if (_com->open(_com->getNumComPort(), baud, xserial::ComPort::COM_PORT_NOPARITY, 8, xserial::ComPort::COM_PORT_ONESTOPBIT)) {
+			return 0;
+		}
+		else {
+			return -1;
+		}
+	}
+
+	~IoEcbm() {
+		_capture.reset();
+		if (_print_stats) {
+			cout << "ecbm stats:" << endl;
+			print_ecbm_stats(cout, &_ecbm);
+		}
+		if (_json_stats.has_value()) {
+			ofstream out(_json_stats.value(), ios_base::trunc);
+			write_ecbm_stats_json(out, &_ecbm);
+		}
 	}
 private:
 	Ecbm _ecbm;
+	bool _print_stats = false;
+	optional<string> _json_stats;
+	unique_ptr<xserial::ComPort> _com;
+	unique_ptr<WireCapture> _capture;
+	unique_ptr<EcbmEmu> _emu;
 };
 
+static int _write(size_t id, const uint8_t* data, size_t ndata) {
+	return ((IoEcbm*)id)->port_write(data, ndata);
+}
+
+static int _read(size_t id, uint8_t* buf, size_t bufsize) {
+	return ((IoEcbm*)id)->port_read(buf, bufsize);
+}
+
+static int _set_baud(size_t id, uint32_t baud) {
+	return ((IoEcbm*)id)->port_set_baud(baud);
+}
+
+string default_journal_path() {
+	const char* home = getenv("HOME");
+	if (home == nullptr) {
+		home = getenv("USERPROFILE");
+	}
+	if (home == nullptr) {
+		return ".fwu_journal";
+	}
+	return string(home) + "/.fwu_journal";
+}
+
+EcbmEmuConfig emu_config(int pincode, optional<string> fw_key) {
+	EcbmEmuConfig config;
+	config.addrs = { DEF_ADDR };
+	config.auth_key = pin_to_key(pincode);
+	if (fw_key.has_value()) {
+		config.fw_key = parse_key(fw_key.value());
+	}
+	return config;
+}
+
 void print_fw_info(FirmwareInfo& info) {
 	if (info.checksum == 0) {
 		cout << "no app" << endl;
@@ -206,6 +1014,28 @@ void print_fw_info(FirmwareInfo& info) {
 	}
 }
 
+void print_upload_report(const UploadReport& report) {
+	cout << "blocks: " << report.blocks << ", bytes: " << report.bytes << ", skipped: " << report.skipped << endl;
+	cout << "baud: " << report.baud << ", downshifts: " << report.downshifts << endl;
+	if (report.block_size > 0) {
+		cout << "block size: " << report.block_size << (report.block_curve.empty() ? "" : " (tuned)") << endl;
+	}
+	for (const auto& s : report.block_curve) {
+		cout << "\t" << s.size << " B: " << (size_t)(s.goodput() / 1024) << " KiB/s over " << s.blocks << " blocks, " << s.errors << " link errors" << endl;
+	}
+	if (report.resumed_from > 0) {
+		cout << "resumed from: " << report.resumed_from << endl;
+	}
+	cout << "retries: " << report.retries.size() << " (resend: " << report.resends << ", backoff: " << report.backoffs << ")" << endl;
+	for (const auto& r : report.retries) {
+		cout << "\toffset " << r.offset << ", attempt " << r.attempt << ", rc " << r.rc << ": " << RetryPolicy::action_name(r.decision.action);
+		if (r.decision.action == RetryAction::Backoff) {
+			cout << " " << r.decision.delay_ms << " ms";
+		}
+		cout << endl;
+	}
+}
+
 void print_key(const uint8_t* key) {
 	cout << "[";
 	for (auto i = 0; i < 16; i++) {
@@ -221,6 +1051,760 @@ void print_test_phrase(const array<uint8_t, 16>& phrase) {
 	cout << endl;
 }
 
+FirmwareInfo firmware_info(const FirmwareFile& fw) {
+	FirmwareInfo info = {
+		.name = fw.name,
+		.version = {fw.version[0], fw.version[1], fw.version[2]},
+		.checksum = fw.checksum,
+		.codec = (FirmwareCodec)fw.codec,
+		.raw_size = fw.raw_size,
+		.block_crcs = fw.block_crcs,
+		.crc_block = fw.crc_block,
+		.filler = fw.filler
+	};
+	for (size_t i = 0; i + 1 < fw.sparse_map.size(); i += 2) {
+		info.filler_regions.emplace_back(fw.sparse_map[i], fw.sparse_map[i + 1]);
+	}
+	return info;
+}
+
+// Upload options of upload command, also taken by serve jobs
+struct UploadSettings {
+	int retries = 5;
+	int backoff_ms = 20;
+	int max_backoff = 1000;
+	bool delta = true;
+	bool sparse = false;
+	bool resume = false;
+	string journal;
+	optional<int> uart_baud;
+	int downshift = 3;
+	int block_size = 0;
+	int max_block = BOOTPROT_BLOCK_SIZE;
+};
+
+// Upload errors are printed with report, not thrown; report tells if upload is complete
+UploadReport upload_with(BootProt& dev, const string& port_id, uint8_t addr, const FirmwareFile& fw, const UploadSettings& settings) {
+	dev.set_retry_policy(RetryPolicy(RetryConfig{
+		.max_retries = settings.retries,
+		.backoff_base_ms = (uint32_t)settings.backoff_ms,
+		.backoff_max_ms = (uint32_t)settings.max_backoff
+	}));
+	dev.set_delta(settings.delta);
+	dev.set_sparse(settings.sparse);
+	// Journal is kept for --resume only
+	optional<UploadJournal> journal;
+	if (settings.resume) {
+		journal.emplace(settings.journal);
+		dev.set_journal(&journal.value(), UploadJournal::make_key(port_id, addr, crc32(fw.data.data(), fw.data.size())));
+	}
+	else {
+		dev.set_journal(nullptr, "");
+	}
+	dev.set_resume(settings.resume);
+	if (settings.block_size > 0) {
+		dev.set_block_tuning(nullopt);
+	}
+	else {
+		dev.set_block_tuning(BlockTunerConfig{ .max = (size_t)settings.max_block });
+	}
+	array<uint8_t, 16> test_phrase;
+	memcpy(test_phrase.data(), fw.test_phrase.data(), 16);
+	try {
+		if (settings.uart_baud.has_value()) {
+			BaudConfig baud_config;
+			for (auto b : UART_BAUDS) {
+				if (b <= (uint32_t)settings.uart_baud.value()) {
+					baud_config.bauds.push_back(b);
+				}
+			}
+			baud_config.downshift_errs = settings.downshift;
+			dev.negotiate_baud(baud_config);
+		}
+		dev.upload_firmware(firmware_info(fw), test_phrase, fw.data, settings.block_size > 0 ? (size_t)settings.block_size : BOOTPROT_BLOCK_SIZE);
+		cout << "complete." << endl;
+	}
+	catch (const std::exception& e) {
+		cout << e.what() << endl;
+	}
+	// Started app talks at default rate, a failed device may still be at the negotiated one;
+	// port of a warm session must be back at default for next jobs on the bus either way
+	if (settings.uart_baud.has_value()) {
+		dev.restore_baud(!dev.last_upload_report().complete);
+	}
+	print_upload_report(dev.last_upload_report());
+	return dev.last_upload_report();
+}
+
+string default_socket_path() {
+	// Directory of its own, server creates it with mode 0700
+	const char* dir = getenv("XDG_RUNTIME_DIR");
+	if (dir != nullptr) {
+		return string(dir) + "/fwu/serve.sock";
+	}
+	const char* home = getenv("HOME");
+	if (home == nullptr) {
+		return ".fwu/serve.sock";
+	}
+	return string(home) + "/.fwu/serve.sock";
+}
+
+// Socket of serve for thin client mode: option, then FWU_SERVER
+optional<string> server_path(const optional<string>& option) {
+	if (option.has_value()) {
+		return option;
+	}
+	const char* env = getenv("FWU_SERVER");
+	if (env != nullptr && *env != 0) {
+		return string(env);
+	}
+	return nullopt;
+}
+
+// One line JSON object, values are JSON already
+string json_object(const vector<pair<string, string>>& members) {
+	string out = "{";
+	for (const auto& [key, value] : members) {
+		if (out.size() > 1) {
+			out += ",";
+		}
+		out += Json::quote(key) + ":" + value;
+	}
+	return out + "}";
+}
+
+/* Serve protocol: client sends one JSON job line, server answers with
+ * output lines "| <text>" and ends with "= ok" or "= error <message>".
+ */
+void serve_request(const string& path, const string& job) {
+	auto sock = LocalSocket::connect(path);
+	if (!sock->write(job + "\n")) {
+		throw runtime_error("fail to send job to '" + path + "'");
+	}
+	string line;
+	while (sock->read_line(line)) {
+		if (line.rfind("| ", 0) == 0) {
+			cout << line.substr(2) << endl;
+		}
+		else if (line == "= ok") {
+			return;
+		}
+		else if (line.rfind("= error ", 0) == 0) {
+			throw runtime_error(line.substr(8));
+		}
+	}
+	throw runtime_error("server closed connection before job end");
+}
+
+// Client side cout of a serve job, see serve_request()
+class ClientOutput : public streambuf
+{
+public:
+	explicit ClientOutput(LocalSocket& sock) : _sock(sock) {}
+
+	void finish(const optional<string>& error) {
+		if (!_line.empty()) {
+			put('\n');
+		}
+		_sock.write(error.has_value() ? "= error " + error.value() + "\n" : "= ok\n");
+	}
+
+protected:
+	int_type overflow(int_type c) override {
+		if (c != traits_type::eof()) {
+			put((char)c);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	streamsize xsputn(const char* data, streamsize ndata) override {
+		for (streamsize i = 0; i < ndata; i++) {
+			put(data[i]);
+		}
+		return ndata;
+	}
+
+private:
+	LocalSocket& _sock;
+	string _line;
+
+	void put(char c) {
+		if (c == '\n') {
+			// Client may be gone, job goes on
+			_sock.write("| " + _line + "\n");
+			_line.clear();
+		}
+		else {
+			_line += c;
+		}
+	}
+};
+
+// cout of serve: connection threads write to their clients, other threads to stdout
+class RoutedOutput : public streambuf
+{
+public:
+	static inline thread_local streambuf* route = nullptr;
+
+	explicit RoutedOutput(streambuf* fallback) : _fallback(fallback) {}
+
+protected:
+	int_type overflow(int_type c) override {
+		if (c == traits_type::eof()) {
+			return traits_type::not_eof(c);
+		}
+		return target()->sputc((char)c);
+	}
+
+	streamsize xsputn(const char* data, streamsize ndata) override {
+		return target()->sputn(data, ndata);
+	}
+
+	int sync() override {
+		return target()->pubsync();
+	}
+
+private:
+	streambuf* _fallback;
+
+	streambuf* target() {
+		return route != nullptr ? route : _fallback;
+	}
+};
+
+/* Warm state of serve: open ports and bootloader sessions on them. Port -1 is
+ * the default one. Jobs on a port are serialized by its lock, ports run in parallel.
+ * A session is reused while it is younger than ttl and the device still answers in it.
+ */
+class DeviceHub
+{
+public:
+	struct Session {
+		array<uint8_t, 16> key;
+		unique_ptr<BootProt> dev;
+		chrono::steady_clock::time_point used;
+	};
+
+	struct Port {
+		mutex lock;
+		unique_ptr<IoEcbm> io;
+		map<uint8_t, Session> sessions;
+	};
+
+	DeviceHub(optional<EcbmEmuConfig> emu, chrono::seconds ttl) : _emu(emu), _ttl(ttl) {}
+
+	void with_port(optional<int> number, const function<void(Port&)>& job) {
+		int id = number.value_or(-1);
+		Port* port;
+		{
+			lock_guard<mutex> guard(_lock);
+			auto& slot = _ports[id];
+			if (!slot) {
+				slot = make_unique<Port>();
+			}
+			port = slot.get();
+		}
+		lock_guard<mutex> guard(port->lock);
+		if (!port->io) {
+			port->io = make_unique<IoEcbm>(number, _emu);
+		}
+		job(*port);
+	}
+
+	BootProt& session(Port& port, uint8_t addr, const array<uint8_t, 16>& key, const BootEntryConfig& entry = BootEntryConfig()) {
+		auto now = chrono::steady_clock::now();
+		auto it = port.sessions.find(addr);
+		if (it != port.sessions.end() && it->second.key == key && now - it->second.used < _ttl) {
+			EcbmDeviceInfo info = { 0 };
+			if (ecbm_read_info(port.io->instance(), addr, &info) >= 0) {
+				it->second.used = now;
+				cout << "warm session, addr " << (int)addr << endl;
+				return *it->second.dev;
+			}
+			cout << "session of addr " << (int)addr << " is lost, reopen" << endl;
+		}
+		port.sessions.erase(addr);
+		auto dev = make_unique<BootProt>(port.io->instance(), addr, key, entry);
+		auto& session = port.sessions[addr];
+		session = { key, move(dev), now };
+		return *session.dev;
+	}
+
+	// Device left bootloader or changed key
+	void drop(Port& port, uint8_t addr) {
+		port.sessions.erase(addr);
+	}
+
+	void status() {
+		lock_guard<mutex> guard(_lock);
+		auto now = chrono::steady_clock::now();
+		for (auto& [id, port] : _ports) {
+			// Busy port is reported without details instead of waiting for its job
+			unique_lock<mutex> port_guard(port->lock, try_to_lock);
+			cout << "port " << (id < 0 ? string("default") : to_string(id));
+			if (!port_guard.owns_lock()) {
+				cout << ": busy" << endl;
+				continue;
+			}
+			cout << (port->io ? ": open" : ": closed") << ", sessions:";
+			for (const auto& [addr, session] : port->sessions) {
+				cout << " " << (int)addr << " (idle " << chrono::duration_cast<chrono::seconds>(now - session.used).count() << " s)";
+			}
+			cout << endl;
+		}
+	}
+
+private:
+	optional<EcbmEmuConfig> _emu;
+	chrono::seconds _ttl;
+	mutex _lock;
+	map<int, unique_ptr<Port>> _ports;
+};
+
+static atomic<bool> _serve_stop = false;
+
+static void _serve_signal(int) {
+	_serve_stop = true;
+}
+
+const set<string> DEVICE_JOBS = { "info", "upload", "set_pincode", "ecbm_wu16" };
+
+enum class JobOutcome {
+	Done,
+	Skipped
+};
+
+/* Device job of serve and run: cmd (info, upload, set_pincode, ecbm_wu16), port, addr,
+ * pincode, ready_ms, skip_reset and members of the command; stats prints port counters after job.
+ * Upload with skip_same is skipped when device app has the same checksum and version.
+ * Relative file is taken from base.
+ */
+JobOutcome run_job(DeviceHub& hub, const Json& job, const filesystem::path& base = {}) {
+	auto cmd = job.get("cmd", "");
+	if (DEVICE_JOBS.count(cmd) == 0) {
+		throw runtime_error("unknown job '" + cmd + "'");
+	}
+	optional<int> port;
+	if (job.has("port")) {
+		port = job.get("port", 0);
+	}
+	auto addr = (uint8_t)job.get("addr", DEF_ADDR);
+	auto key = pin_to_key(job.get("pincode", 0));
+	BootEntryConfig entry = { .ready_ms = (uint32_t)job.get("ready_ms", 3000), .skip_reset = job.get("skip_reset", true) };
+	auto outcome = JobOutcome::Done;
+	hub.with_port(port, [&](DeviceHub::Port& p) {
+		if (cmd == "info") {
+			auto info = hub.session(p, addr, key, entry).get_firmware_info();
+			cout << "app info:" << endl;
+			print_fw_info(info);
+		}
+		else if (cmd == "upload") {
+			MappedFile fw_file((base / job.get("file", "")).string());
+			auto fw = read_firmware(fw_file.data());
+			UploadSettings settings = {
+				.retries = job.get("retries", 5),
+				.backoff_ms = job.get("backoff_ms", 20),
+				.max_backoff = job.get("max_backoff", 1000),
+				.delta = !job.get("no_delta", false),
+				.sparse = job.get("sparse", false),
+				.resume = job.get("resume", false),
+				.journal = job.get("journal", default_journal_path()),
+				.downshift = job.get("downshift", 3),
+				.block_size = job.get("block_size", 0),
+				.max_block = job.get("max_block", BOOTPROT_BLOCK_SIZE)
+			};
+			if (job.has("uart_baud")) {
+				settings.uart_baud = job.get("uart_baud", 0);
+			}
+			auto& dev = hub.session(p, addr, key, entry);
+			if (job.get("skip_same", false)) {
+				auto info = dev.get_firmware_info();
+				if (info.checksum == fw.checksum && fw.version.size() == 3 && equal(info.version.begin(), info.version.end(), fw.version.begin())) {
+					cout << "device already runs this firmware, skipped" << endl;
+					outcome = JobOutcome::Skipped;
+					return;
+				}
+			}
+			// Device runs the new app or is left mid upload, either way session is over
+			auto report = upload_with(dev, p.io->port_id(), addr, fw, settings);
+			hub.drop(p, addr);
+			if (!report.complete) {
+				throw runtime_error("upload is not complete");
+			}
+		}
+		else if (cmd == "set_pincode") {
+			hub.session(p, addr, key, entry).set_new_auth_key(pin_to_key(job.get("new_pincode", 0)));
+			hub.drop(p, addr);
+		}
+		else if (cmd == "ecbm_wu16") {
+			// Raw access replaces encrypted session of addr
+			hub.drop(p, addr);
+			if (job.has("pin")) {
+				auto pin_key = pin_to_key(job.get("pin", 0));
+				int rc = ecbm_begin_enc_session(p.io->instance(), addr, pin_key.data());
+				if (rc != ECBM_OK) {
+					throw runtime_error("fail to begin enc session: " + to_string(rc));
+				}
+			}
+			uint8_t buf[2];
+			stdser_s16((uint16_t)job.get("data", 0), buf);
+			int rc = ecbm_write(p.io->instance(), addr, (uint16_t)job.get("sig", 0), buf, 2);
+			if (rc != ECBM_OK) {
+				throw runtime_error("fail to write: " + to_string(rc));
+			}
+		}
+		if (job.get("stats", false)) {
+			cout << "ecbm stats:" << endl;
+			print_ecbm_stats(cout, p.io->instance());
+		}
+	});
+	return outcome;
+}
+
+// Device jobs and server control: status, shutdown
+void serve_job(DeviceHub& hub, const Json& job) {
+	auto cmd = job.get("cmd", "");
+	if (cmd == "status") {
+		hub.status();
+	}
+	else if (cmd == "shutdown") {
+		_serve_stop = true;
+		cout << "server stops after running jobs" << endl;
+	}
+	else {
+		run_job(hub, job);
+	}
+}
+
+void serve_client(DeviceHub& hub, LocalSocket& sock) {
+	string line;
+	if (!sock.read_line(line)) {
+		return;
+	}
+	auto begin = chrono::steady_clock::now();
+	ClientOutput out(sock);
+	optional<string> error;
+	string cmd = "?";
+	RoutedOutput::route = &out;
+	try {
+		auto job = Json::parse(line);
+		cmd = job.get("cmd", "?");
+		serve_job(hub, job);
+	}
+	catch (const std::exception& e) {
+		error = e.what();
+	}
+	RoutedOutput::route = nullptr;
+	out.finish(error);
+	auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - begin);
+	cout << cmd << ": " << (error.has_value() ? error.value() : "ok") << ", " << elapsed.count() << " ms" << endl;
+}
+
+/* Keeps ports and bootloader sessions open between jobs, one job per connection.
+ * Runs until shutdown job, SIGINT or SIGTERM, running jobs are finished first.
+ */
+void serve(const string& path, optional<EcbmEmuConfig> emu, chrono::seconds ttl) {
+	LocalServer server(path);
+	DeviceHub hub(emu, ttl);
+	RoutedOutput routed(cout.rdbuf());
+	auto stdout_buf = cout.rdbuf(&routed);
+	_serve_stop = false;
+	signal(SIGINT, _serve_signal);
+	signal(SIGTERM, _serve_signal);
+	cout << "serving at '" << path << "'" << (emu.has_value() ? ", emulated devices" : "") << endl;
+	atomic<size_t> nactive = 0;
+	while (!_serve_stop) {
+		auto sock = server.accept(200);
+		if (!sock) {
+			continue;
+		}
+		nactive++;
+		thread([&hub, &nactive, sock = move(sock)]() {
+			serve_client(hub, *sock);
+			nactive--;
+		}).detach();
+	}
+	while (nactive > 0) {
+		this_thread::sleep_for(chrono::milliseconds(20));
+	}
+	cout.rdbuf(stdout_buf);
+	cout << "server stopped" << endl;
+}
+
+// Outcome of one job of run, status is ok, skipped, resumed (done by previous run) or failed
+struct RunResult {
+	string status;
+	string error;
+	int64_t ms = 0;
+	string log;
+};
+
+string run_job_label(const Json& job) {
+	string label = "port " + (job.has("port") ? to_string(job.get("port", 0)) : string("default"));
+	label += " addr " + to_string(job.get("addr", DEF_ADDR)) + " " + job.get("cmd", "");
+	if (job.has("file")) {
+		label += " " + job.get("file", "");
+	}
+	return label;
+}
+
+// Canonical text of job parameters for its checkpoint key, members in key order
+string job_params(const Json& value) {
+	switch (value.type()) {
+	case Json::Type::Bool:
+		return value.boolean() ? "true" : "false";
+	case Json::Type::Number: {
+		ostringstream out;
+		out << value.number();
+		return out.str();
+	}
+	case Json::Type::String:
+		return Json::quote(value.str());
+	case Json::Type::Array: {
+		string text = "[";
+		for (const auto& item : value.items()) {
+			text += job_params(item) + ",";
+		}
+		return text + "]";
+	}
+	case Json::Type::Object: {
+		string text = "{";
+		for (const auto& [key, member] : value.members()) {
+			// Order of jobs does not change what a job does
+			if (key != "priority") {
+				text += Json::quote(key) + ":" + job_params(member) + ",";
+			}
+		}
+		return text + "}";
+	}
+	default:
+		return "null";
+	}
+}
+
+void write_run_report(ostream& out, const vector<Json>& jobs, const vector<RunResult>& results, int64_t elapsed_ms) {
+	map<string, size_t> counts = { { "ok", 0 }, { "skipped", 0 }, { "resumed", 0 }, { "failed", 0 } };
+	out << "{" << endl << "\t\"jobs\": [" << endl;
+	for (size_t i = 0; i < jobs.size(); i++) {
+		const auto& job = jobs[i];
+		const auto& result = results[i];
+		counts[result.status]++;
+		out << "\t\t{ \"index\": " << i;
+		out << ", \"port\": " << (job.has("port") ? to_string(job.get("port", 0)) : string("null"));
+		out << ", \"addr\": " << job.get("addr", DEF_ADDR);
+		out << ", \"cmd\": " << Json::quote(job.get("cmd", ""));
+		if (job.has("file")) {
+			out << ", \"file\": " << Json::quote(job.get("file", ""));
+		}
+		out << ", \"status\": " << Json::quote(result.status);
+		out << ", \"error\": " << Json::quote(result.error);
+		out << ", \"ms\": " << result.ms;
+		out << ", \"log\": " << Json::quote(result.log) << " }";
+		out << (i + 1 < jobs.size() ? "," : "") << endl;
+	}
+	out << "\t]," << endl;
+	out << "\t\"ok\": " << counts["ok"] << ", \"skipped\": " << counts["skipped"] << ", \"resumed\": " << counts["resumed"] << ", \"failed\": " << counts["failed"] << "," << endl;
+	out << "\t\"elapsed_ms\": " << elapsed_ms << endl << "}" << endl;
+}
+
+/* Job file is array of jobs or object with "jobs" and optional "defaults". Jobs are
+ * device jobs of serve plus priority (higher first, default 0); relative files are
+ * taken from job file directory, uploads skip devices already on the image unless
+ * skip_same is false. Every port has its queue in priority then file order and runs
+ * it job by job, up to nports ports at once (0 - all). Images are checked before
+ * any device is touched. Job output goes to the report, console gets a line per job.
+ * State of every job goes to checkpoint log; resume skips jobs it has verified
+ * (uploads only while the image checksum is the same) and runs the rest.
+ */
+void run_fleet(const string& path, size_t nports, optional<EcbmEmuConfig> emu, const optional<string>& report_path, const string& checkpoint_path, bool resume) {
+	auto doc = Json::parse_file(path);
+	auto base = filesystem::path(path).parent_path();
+	const Json& list = doc.is_array() ? doc : doc["jobs"];
+	if (!list.is_array()) {
+		throw runtime_error("job file must be array of jobs or object with \"jobs\" array");
+	}
+	auto defaults = Json::parse("{ \"skip_same\": true }");
+	if (doc.is_object() && doc.has("defaults")) {
+		defaults = doc["defaults"].with_defaults(defaults);
+	}
+	vector<Json> jobs;
+	map<int, vector<size_t>> queues;
+	set<uint8_t> addrs;
+	set<string> files;
+	for (const auto& item : list.items()) {
+		auto where = "job " + to_string(jobs.size()) + ": ";
+		try {
+			jobs.push_back(item.with_defaults(defaults));
+			const auto& job = jobs.back();
+			if (DEVICE_JOBS.count(job.get("cmd", "")) == 0) {
+				throw runtime_error("unknown cmd '" + job.get("cmd", "") + "'");
+			}
+			if (job.get("cmd", "") == "upload") {
+				files.insert((base / job.get("file", "")).string());
+			}
+			queues[job.has("port") ? job.get("port", 0) : -1].push_back(jobs.size() - 1);
+			addrs.insert((uint8_t)job.get("addr", DEF_ADDR));
+		}
+		catch (const std::exception& e) {
+			throw runtime_error(where + e.what());
+		}
+	}
+	map<string, uint32_t> checksums;
+	for (const auto& file : files) {
+		MappedFile fw_file(file);
+		checksums[file] = read_firmware(fw_file.data()).checksum;
+	}
+	/* Job identity across runs, equal jobs are told apart by occurrence.
+	 * Crc of parameters (pincode, settings, ...) keeps an edited job from matching state of the old one.
+	 */
+	vector<string> job_keys;
+	map<string, size_t> occurrences;
+	for (const auto& job : jobs) {
+		auto label = run_job_label(job);
+		auto params = job_params(job);
+		char hex[9];
+		snprintf(hex, sizeof(hex), "%08X", crc32((const uint8_t*)params.data(), params.size()));
+		job_keys.push_back(label + " #" + to_string(occurrences[label]++) + " " + hex);
+	}
+	auto image_checksum = [&](size_t index) {
+		char hex[9];
+		snprintf(hex, sizeof(hex), "%08X", checksums.at((base / jobs[index].get("file", "")).string()));
+		return string(hex);
+	};
+	RunCheckpoint checkpoint(checkpoint_path, resume);
+	vector<RunResult> results(jobs.size());
+	for (size_t i = 0; i < jobs.size(); i++) {
+		auto previous = checkpoint.get(job_keys[i]);
+		bool is_upload = jobs[i].get("cmd", "") == "upload";
+		if (previous.has_value() && ((previous->state == RunCheckpoint::State::Verified && is_upload && previous->detail == image_checksum(i))
+			|| (previous->state == RunCheckpoint::State::Done && !is_upload))) {
+			results[i].status = "resumed";
+			checkpoint.record(job_keys[i], previous->state, previous->detail);
+		}
+		else {
+			checkpoint.record(job_keys[i], RunCheckpoint::State::Pending);
+		}
+	}
+	for (auto& [port, queue] : queues) {
+		erase_if(queue, [&results](size_t index) {
+			return results[index].status == "resumed";
+		});
+	}
+	erase_if(queues, [](const auto& item) {
+		return item.second.empty();
+	});
+	vector<int> ports;
+	for (auto& [port, queue] : queues) {
+		stable_sort(queue.begin(), queue.end(), [&jobs](size_t a, size_t b) {
+			return jobs[a].get("priority", 0) > jobs[b].get("priority", 0);
+		});
+		ports.push_back(port);
+	}
+	// Ports with most urgent jobs take threads first
+	stable_sort(ports.begin(), ports.end(), [&](int a, int b) {
+		return jobs[queues.at(a)[0]].get("priority", 0) > jobs[queues.at(b)[0]].get("priority", 0);
+	});
+	if (emu.has_value()) {
+		emu->addrs.assign(addrs.begin(), addrs.end());
+	}
+	DeviceHub hub(emu, chrono::seconds(60));
+	auto begin = chrono::steady_clock::now();
+	RoutedOutput routed(cout.rdbuf());
+	auto stdout_buf = cout.rdbuf(&routed);
+	/* Log write error stops the run, not the job: the device result stands,
+	 * but states after it would be lost for resume. Jobs not started are failed.
+	 */
+	mutex log_lock;
+	optional<string> log_error;
+	auto record = [&](size_t index, RunCheckpoint::State state, const string& detail = "") {
+		try {
+			checkpoint.record(job_keys[index], state, detail);
+			return true;
+		}
+		catch (const std::exception& e) {
+			lock_guard<mutex> guard(log_lock);
+			if (!log_error.has_value()) {
+				log_error = e.what();
+			}
+			return false;
+		}
+	};
+	auto log_failed = [&]() {
+		lock_guard<mutex> guard(log_lock);
+		return log_error.has_value();
+	};
+	// Maps are complete here, workers only look up: operator[] could insert under them
+	auto nthreads = run_parallel(ports.size(), nports == 0 ? ports.size() : nports, [&](size_t i) {
+		for (auto index : queues.at(ports[i])) {
+			if (log_failed() || !record(index, RunCheckpoint::State::Running)) {
+				break;
+			}
+			auto& result = results[index];
+			auto job_begin = chrono::steady_clock::now();
+			stringbuf log;
+			RoutedOutput::route = &log;
+			bool is_upload = jobs[index].get("cmd", "") == "upload";
+			try {
+				result.status = run_job(hub, jobs[index], base) == JobOutcome::Skipped ? "skipped" : "ok";
+			}
+			catch (const std::exception& e) {
+				result.status = "failed";
+				result.error = e.what();
+			}
+			RoutedOutput::route = nullptr;
+			if (result.status == "failed") {
+				record(index, RunCheckpoint::State::Failed, result.error);
+			}
+			else if (is_upload) {
+				record(index, RunCheckpoint::State::Verified, image_checksum(index));
+			}
+			else {
+				record(index, RunCheckpoint::State::Done);
+			}
+			result.log = log.str();
+			result.ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - job_begin).count();
+			// One write per line, ports print concurrently
+			cout << (run_job_label(jobs[index]) + ": " + result.status + (result.error.empty() ? "" : " (" + result.error + ")") + ", " + to_string(result.ms) + " ms\n") << flush;
+		}
+	});
+	cout.rdbuf(stdout_buf);
+	for (auto& result : results) {
+		if (result.status.empty()) {
+			result.status = "failed";
+			result.error = "not run, checkpoint log failed";
+		}
+	}
+	try {
+		checkpoint.close();
+	}
+	catch (const std::exception& e) {
+		if (!log_error.has_value()) {
+			log_error = e.what();
+		}
+	}
+	auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - begin).count();
+	size_t nfailed = count_if(results.begin(), results.end(), [](const RunResult& r) { return r.status == "failed"; });
+	size_t nskipped = count_if(results.begin(), results.end(), [](const RunResult& r) { return r.status == "skipped"; });
+	size_t nresumed = count_if(results.begin(), results.end(), [](const RunResult& r) { return r.status == "resumed"; });
+	if (nresumed > 0) {
+		cout << nresumed << " jobs done by previous run" << endl;
+	}
+	cout << jobs.size() - nfailed - nskipped - nresumed << " ok, " << nskipped << " skipped, " << nfailed << " failed in " << elapsed << " ms, " << min(nthreads, ports.size()) << " of " << ports.size() << " ports at once" << endl;
+	if (report_path.has_value()) {
+		ofstream out(report_path.value(), ios_base::trunc);
+		write_run_report(out, jobs, results, elapsed);
+		if (!out) {
+			throw runtime_error("fail to write report: " + report_path.value());
+		}
+	}
+	if (log_error.has_value()) {
+		throw runtime_error("run stopped, checkpoint log failed: " + log_error.value());
+	}
+	if (nfailed > 0) {
+		throw runtime_error(to_string(nfailed) + " jobs failed");
+	}
+}
+
 int main(int argc, char** argv) {
 	try {
 		auto opt = structopt::app("fwu", "0.0.1").parse<Arguments>(argc, argv);
@@ -229,114 +1813,180 @@ int main(int argc, char** argv) {
 			if (file_repr != ".bin") {
 				throw runtime_error("firmware file must have '.bin' format, not '" + file_repr + "'");
 			}
-			
-			int ver_buf[3];
-			#if defined(__MINGW32__) || defined(_WIN32)
-			if (sscanf_s(opt.encrypt.firmware_version.c_str(), "%i.%i.%i", &ver_buf[0], &ver_buf[1], &ver_buf[2]) != 3) {
-				throw runtime_error("version must be as three numbers between 0..255 delemited by dot, example - '0.5.12'");
-			}
-			#else
-			if (sscanf(opt.encrypt.firmware_version.c_str(), "%i.%i.%i", &ver_buf[0], &ver_buf[1], &ver_buf[2]) != 3) {
-				throw runtime_error("version must be as three numbers between 0..255 delemited by dot, example - '0.5.12'");
-			}
-			#endif
-			vector<uint8_t> version;
-			for (size_t i = 0; i < 3; i++) {
-				if (ver_buf[i] > 255 || ver_buf[i] < 0) {
-					version.push_back(255);
+			// Positional key may be "-" when all keys come from --keys
+			vector<EncryptTarget> targets;
+			if (opt.encrypt.key != "-" || !opt.encrypt.keys.has_value()) {
+				targets.push_back({ opt.encrypt.file + ".enc", parse_key(opt.encrypt.key) });
+			}
+			if (opt.encrypt.keys.has_value()) {
+				auto listed = read_key_list(opt.encrypt.keys.value(), opt.encrypt.file);
+				targets.insert(targets.end(), listed.begin(), listed.end());
+			}
+			if (targets.empty()) {
+				throw runtime_error("key list '" + opt.encrypt.keys.value() + "' is empty");
+			}
+			EncryptJob job = {
+				.file = opt.encrypt.file,
+				.name = opt.encrypt.firmware_name,
+				.version = parse_version(opt.encrypt.firmware_version),
+				.test_phrase = opt.encrypt.test_phrase,
+				.filler = (uint8_t)(opt.encrypt.filler == 0 ? 0 : 0xFF),
+				.compress = opt.encrypt.compress.value(),
+				.enc_version = opt.encrypt.enc_version.value(),
+				.nworkers = max(thread::hardware_concurrency(), 1u)
+			};
+			unique_ptr<EncCache> cache;
+			if (opt.encrypt.cache_dir.has_value()) {
+				cache = make_unique<EncCache>(opt.encrypt.cache_dir.value(), (size_t)opt.encrypt.cache_max_mb.value() << 20);
+				job.cache = cache.get();
+			}
+			auto results = encrypt_firmware_keys(job, targets);
+			// Figures are the same for every key, cached artifacts were made by same settings
+			auto& result = results[0];
+			cout << "initial firmware size: " << result.input_size << endl;
+			if (targets.size() == 1 && result.cached) {
+				cout << "taken from cache" << endl;
+			}
+			if (job.compress) {
+				if (result.codec == FirmwareCodec::Lzss) {
+					cout << "compressed: " << result.raw_size << " -> " << result.fw_size << " bytes (" << (result.fw_size * 100) / result.raw_size << "%)" << endl;
 				}
 				else {
-					version.push_back((uint8_t)ver_buf[i]);
+					cout << "firmware is not compressible, stored as is" << endl;
 				}
 			}
-
-			if (opt.encrypt.key.length() != 32) {
-				throw runtime_error("key must be written as 32 HEX symbols, example - '00112233445566778899AABBCCDDEEFF'");
-			}
-			array<uint8_t, 16> key;
-			char buf[3] = {0};
-			for (size_t i = 0; i < 16; i++) {
-				memcpy(buf, &opt.encrypt.key.c_str()[i*2], 2);
-				key[i] = (uint8_t)std::strtoul(buf, NULL, 16);
+			cout << "complete, new fw size: " << result.fw_size << endl;
+			if (result.nregions > 0) {
+				cout << "filler regions: " << result.nregions << ", " << result.nfiller << " bytes" << endl;
 			}
-
-			if (opt.encrypt.test_phrase.length() != 16) {
-				throw runtime_error("test_phrase must be written as 16 ASCII symbols");
+			printf("checksum: %04X\n", result.checksum);
+			for (size_t i = 0; i < targets.size(); i++) {
+				cout << "encypted file was be written as '" << targets[i].out << "', " << results[i].out_size << " bytes";
+				cout << (targets.size() > 1 && results[i].cached ? " (cache)" : "") << endl;
 			}
-			vector<uint8_t> test_phrase;
-			uint8_t test_phrase_buf[16];
-			raiden_encode(key.data(), (const uint8_t*)opt.encrypt.test_phrase.c_str(), test_phrase_buf, 16);
-			for (size_t i = 0; i < 16; i++) {
-				test_phrase.push_back(test_phrase_buf[i]);
-			}
-
-			uint8_t filler = 0xFF;
-			if (opt.encrypt.filler == 0) {
-				filler = 0;
+		}
+		else if (opt.encrypt_batch.has_value()) {
+			unique_ptr<EncCache> cache;
+			if (opt.encrypt_batch.cache_dir.has_value()) {
+				cache = make_unique<EncCache>(opt.encrypt_batch.cache_dir.value(), (size_t)opt.encrypt_batch.cache_max_mb.value() << 20);
 			}
-
-			ifstream fw_file(opt.encrypt.file, ios_base::binary);
-			if (!fw_file.is_open()) {
-				throw runtime_error("fail to open firmware file");
+			encrypt_batch(opt.encrypt_batch.manifest, opt.encrypt_batch.jobs.value(), cache.get());
+		}
+		else if (opt.verify.has_value()) {
+			if (!opt.verify.key.has_value()) {
+				throw runtime_error("key is required, '--key <32 HEX symbols>'");
 			}
-			fw_file.unsetf(std::ios::skipws);
-			istream_iterator<uint8_t> start(fw_file), end;
-			vector<uint8_t> data(start, end);
-			cout << "initial firmware size: " << data.size() << endl;
-			while (data.size() % 8 != 0) {
-				data.push_back(filler);
+			auto key = parse_key(opt.verify.key.value());
+			auto& files = opt.verify.files;
+			vector<VerifyResult> results(files.size());
+			auto started = chrono::steady_clock::now();
+			size_t nthreads = run_parallel(files.size(), (size_t)max(opt.verify.jobs.value(), 0), [&](size_t i) {
+				try {
+					results[i] = verify_firmware(files[i], key);
+				}
+				catch (const exception& e) {
+					results[i].error = e.what();
+				}
+			});
+			auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started);
+			size_t nfailed = 0;
+			size_t nbytes = 0;
+			for (size_t i = 0; i < files.size(); i++) {
+				auto& r = results[i];
+				if (r.error.empty()) {
+					printf("OK    %s: %s %s, checksum %08X, test phrase '%s'\n", files[i].c_str(), r.name.c_str(), r.version.c_str(), r.checksum, r.test_phrase.c_str());
+					nbytes += r.size;
+				}
+				else {
+					nfailed++;
+					printf("FAIL  %s: %s\n", files[i].c_str(), r.error.c_str());
+				}
 			}
-			auto crc = crc32(data.data(), data.size());
-			raiden_encode_buf(key.data(), data.data(), data.size());
-			FirmwareFile fw = {
-				.name = opt.encrypt.firmware_name,
-				.version = version,
-				.checksum = crc,
-				.test_phrase = test_phrase,
-				.data = data
-			};
-			auto raw_data = msgpack::pack(fw);
-			ofstream out_file(opt.encrypt.file + ".enc", ios_base::binary | ios_base::trunc);
-			for (const auto& v : raw_data) {
-				out_file << v;
+			cout << files.size() - nfailed << " of " << files.size() << " verified, " << nbytes << " bytes in " << elapsed.count() << " ms, " << nthreads << " threads" << endl;
+			if (nfailed > 0) {
+				throw runtime_error(to_string(nfailed) + " files failed");
 			}
-			cout << "complete, new fw size: " << fw.data.size() << endl;
-			printf("checksum: %04X\n", crc);
-			cout << "encypted file was be written as '" << opt.encrypt.file + ".enc" << "', " << raw_data.size() << " bytes" << endl;
 		}
 		else if (opt.upload.has_value()) {
 			auto key = pin_to_key(opt.upload.pincode);
-			ifstream fw_file(opt.upload.file, ios_base::binary);
-			if (!fw_file.is_open()) {
-				throw runtime_error("fail to open firmware file");
-			}
-			fw_file.unsetf(std::ios::skipws);
-			istream_iterator<uint8_t> start(fw_file), end;
-			vector<uint8_t> raw_data(start, end);
-			cout << raw_data.size() << " bytes read from file, unpack.." << endl;
-			auto fw = msgpack::unpack<FirmwareFile>(raw_data);
-			FirmwareInfo fw_info = {
-				.name = fw.name,
-				.version = {fw.version[0], fw.version[1], fw.version[2]},
-				.checksum = fw.checksum
-			};
+			auto server = server_path(opt.upload.server);
+			if (server.has_value() && (opt.upload.emulate.value() || opt.upload.json_stats.has_value() || opt.upload.capture.has_value())) {
+				throw runtime_error("--emulate, --json-stats and --capture are options of serve, not of its jobs");
+			}
+			MappedFile fw_file(opt.upload.file);
+			cout << fw_file.size() << " bytes read from file, unpack.." << endl;
+			// fw.data points into mapped file
+			auto fw = read_firmware(fw_file.data());
+			auto fw_info = firmware_info(fw);
 			cout << "firmware info:" << endl;
 			print_fw_info(fw_info);
-			cout << "size: " << fw.data.size() << endl << endl;
+			cout << "size: " << fw.data.size() << endl;
+			if (fw_info.codec == FirmwareCodec::Lzss) {
+				cout << "compressed, raw size: " << fw.raw_size << endl;
+			}
+			cout << endl;
 			cout << "continue? y/n ?" << endl;
 			char decision;
 			cin >> decision;
-			if (decision == 'y') {
+			UploadSettings settings = {
+				.retries = opt.upload.retries.value(),
+				.backoff_ms = opt.upload.backoff_ms.value(),
+				.max_backoff = opt.upload.max_backoff.value(),
+				.delta = !opt.upload.no_delta.value(),
+				.sparse = opt.upload.sparse.value(),
+				.resume = opt.upload.resume.value(),
+				.journal = opt.upload.journal.value_or(default_journal_path()),
+				.uart_baud = opt.upload.uart_baud,
+				.downshift = opt.upload.downshift.value(),
+				.block_size = opt.upload.block_size.value(),
+				.max_block = opt.upload.max_block.value()
+			};
+			if (decision == 'y' && server.has_value()) {
+				vector<pair<string, string>> job = {
+					{ "cmd", Json::quote("upload") },
+					{ "file", Json::quote(filesystem::absolute(opt.upload.file).string()) },
+					{ "addr", to_string(DEF_ADDR) },
+					{ "pincode", to_string(opt.upload.pincode) },
+					{ "retries", to_string(settings.retries) },
+					{ "backoff_ms", to_string(settings.backoff_ms) },
+					{ "max_backoff", to_string(settings.max_backoff) },
+					{ "no_delta", settings.delta ? "false" : "true" },
+					{ "sparse", settings.sparse ? "true" : "false" },
+					{ "resume", settings.resume ? "true" : "false" },
+					{ "journal", Json::quote(settings.journal) },
+					{ "downshift", to_string(settings.downshift) },
+					{ "ready_ms", to_string(opt.upload.ready_ms.value()) },
+					{ "skip_reset", opt.upload.force_reset.value() ? "false" : "true" },
+					{ "block_size", to_string(settings.block_size) },
+					{ "max_block", to_string(settings.max_block) },
+					{ "stats", opt.upload.stats.value() ? "true" : "false" }
+				};
+				if (opt.upload.port.has_value()) {
+					job.push_back({ "port", to_string(opt.upload.port.value()) });
+				}
+				if (settings.uart_baud.has_value()) {
+					job.push_back({ "uart_baud", to_string(settings.uart_baud.value()) });
+				}
+				serve_request(server.value(), json_object(job));
+			}
+			else if (decision == 'y') {
 				try {
-					array<uint8_t, 16> test_phrase;
-					memcpy(test_phrase.data(), fw.test_phrase.data(), 16);
-					IoEcbm io_ecbm(opt.upload.port);
-					BootProt dev(io_ecbm.instance(), DEF_ADDR, key);
-					dev.upload_firmware(fw_info, test_phrase, fw.data);
-					cout << "complete." << endl;
+					optional<EcbmEmuConfig> emu;
+					if (opt.upload.emulate.value()) {
+						emu = emu_config(opt.upload.pincode, opt.upload.fw_key);
+						emu->flash_size = max(emu->flash_size, max(fw.data.size(), (size_t)fw.raw_size));
+					}
+					IoEcbm io_ecbm(opt.upload.port, emu);
+					io_ecbm.report_stats(opt.upload.stats, opt.upload.json_stats);
+					io_ecbm.capture(opt.upload.capture);
+					BootProt dev(io_ecbm.instance(), DEF_ADDR, key, { .ready_ms = (uint32_t)opt.upload.ready_ms.value(), .skip_reset = !opt.upload.force_reset.value() });
+					if (!upload_with(dev, io_ecbm.port_id(), DEF_ADDR, fw, settings).complete) {
+						return 1;
+					}
 				}
 				catch (const std::exception& e) {
 					cout << e.what() << endl;
+					return 1;
 				}
 			}
 			else {
@@ -351,17 +2001,60 @@ int main(int argc, char** argv) {
 				cout << p << endl;
 			}
 		}
+		else if (opt.info.has_value() && server_path(opt.info.server).has_value()) {
+			if (opt.info.emulate.value() || opt.info.json_stats.has_value() || opt.info.capture.has_value()) {
+				throw runtime_error("--emulate, --json-stats and --capture are options of serve, not of its jobs");
+			}
+			vector<pair<string, string>> job = {
+				{ "cmd", Json::quote("info") },
+				{ "addr", to_string(DEF_ADDR) },
+				{ "pincode", to_string(opt.info.pincode) },
+				{ "ready_ms", to_string(opt.info.ready_ms.value()) },
+				{ "skip_reset", opt.info.force_reset.value() ? "false" : "true" },
+				{ "stats", opt.info.stats.value() ? "true" : "false" }
+			};
+			if (opt.info.port.has_value()) {
+				job.push_back({ "port", to_string(opt.info.port.value()) });
+			}
+			serve_request(server_path(opt.info.server).value(), json_object(job));
+		}
 		else if (opt.info.has_value()) {
 			auto key = pin_to_key(opt.info.pincode);
-			IoEcbm io_ecbm(opt.info.port);
-			BootProt dev(io_ecbm.instance(), DEF_ADDR, key);
+			optional<EcbmEmuConfig> emu;
+			if (opt.info.emulate.value()) {
+				emu = emu_config(opt.info.pincode, nullopt);
+			}
+			IoEcbm io_ecbm(opt.info.port, emu);
+			io_ecbm.report_stats(opt.info.stats, opt.info.json_stats);
+			io_ecbm.capture(opt.info.capture);
+			BootProt dev(io_ecbm.instance(), DEF_ADDR, key, { .ready_ms = (uint32_t)opt.info.ready_ms.value(), .skip_reset = !opt.info.force_reset.value() });
 			auto info = dev.get_firmware_info();
 			cout << "app info:" << endl;
 			print_fw_info(info);
 		}
+		else if (opt.set_pincode.has_value() && server_path(opt.set_pincode.server).has_value()) {
+			if (opt.set_pincode.json_stats.has_value() || opt.set_pincode.capture.has_value()) {
+				throw runtime_error("--json-stats and --capture are options of serve, not of its jobs");
+			}
+			vector<pair<string, string>> job = {
+				{ "cmd", Json::quote("set_pincode") },
+				{ "addr", to_string(DEF_ADDR) },
+				{ "pincode", to_string(opt.set_pincode.pincode) },
+				{ "new_pincode", to_string(opt.set_pincode.new_pincode) },
+				{ "ready_ms", to_string(opt.set_pincode.ready_ms.value()) },
+				{ "skip_reset", opt.set_pincode.force_reset.value() ? "false" : "true" },
+				{ "stats", opt.set_pincode.stats.value() ? "true" : "false" }
+			};
+			if (opt.set_pincode.port.has_value()) {
+				job.push_back({ "port", to_string(opt.set_pincode.port.value()) });
+			}
+			serve_request(server_path(opt.set_pincode.server).value(), json_object(job));
+		}
 		else if (opt.set_pincode.has_value()) {
 			IoEcbm io_ecbm(opt.set_pincode.port);
-			BootProt dev(io_ecbm.instance(), DEF_ADDR, pin_to_key(opt.set_pincode.pincode));
+			io_ecbm.report_stats(opt.set_pincode.stats, opt.set_pincode.json_stats);
+			io_ecbm.capture(opt.set_pincode.capture);
+			BootProt dev(io_ecbm.instance(), DEF_ADDR, pin_to_key(opt.set_pincode.pincode), { .ready_ms = (uint32_t)opt.set_pincode.ready_ms.value(), .skip_reset = !opt.set_pincode.force_reset.value() });
 			dev.set_new_auth_key(pin_to_key(opt.set_pincode.new_pincode));
 		}
 		else if (opt.pintokey.has_value()) {
@@ -415,9 +2108,81 @@ int main(int argc, char** argv) {
 				cout << "}" << endl;
 			}
 		}
+		else if (opt.emulate.has_value()) {
+			auto config = emu_config(opt.emulate.pincode, opt.emulate.key);
+			if (opt.emulate.addr.has_value()) {
+				config.addrs.clear();
+				for (auto a : opt.emulate.addr.value()) {
+					config.addrs.push_back((uint8_t)a);
+				}
+			}
+			config.erase_us = (uint32_t)opt.emulate.erase_us.value();
+			config.program_us = (uint32_t)opt.emulate.program_us.value();
+			config.boot_ms = (uint32_t)opt.emulate.boot_ms.value();
+			config.start_app = opt.emulate.start_app.value();
+			config.max_frame = (size_t)opt.emulate.max_frame.value();
+			EcbmEmu emu(config);
+			emu.run_pty(opt.emulate.verbose.value());
+		}
+		else if (opt.replay.has_value()) {
+			optional<array<uint8_t, 16>> key;
+			if (opt.replay.pincode.has_value()) {
+				key = pin_to_key(opt.replay.pincode.value());
+			}
+			replay_capture(opt.replay.file, key, cout);
+		}
+		else if (opt.ecbm.has_value() && opt.ecbm.wu16.has_value() && server_path(opt.ecbm.server).has_value()) {
+			if (opt.ecbm.json_stats.has_value() || opt.ecbm.capture.has_value()) {
+				throw runtime_error("--json-stats and --capture are options of serve, not of its jobs");
+			}
+			vector<pair<string, string>> job = {
+				{ "cmd", Json::quote("ecbm_wu16") },
+				{ "addr", to_string(opt.ecbm.wu16.addr) },
+				{ "sig", to_string(opt.ecbm.wu16.sig) },
+				{ "data", to_string(opt.ecbm.wu16.data) },
+				{ "stats", opt.ecbm.stats.value() ? "true" : "false" }
+			};
+			if (opt.ecbm.port.has_value()) {
+				job.push_back({ "port", to_string(opt.ecbm.port.value()) });
+			}
+			if (opt.ecbm.wu16.pin.has_value()) {
+				job.push_back({ "pin", to_string(opt.ecbm.wu16.pin.value()) });
+			}
+			serve_request(server_path(opt.ecbm.server).value(), json_object(job));
+		}
+		else if (opt.serve.has_value()) {
+			auto path = opt.serve.socket.value_or(server_path(nullopt).value_or(default_socket_path()));
+			if (opt.serve.stop.value() || opt.serve.status.value()) {
+				serve_request(path, json_object({ { "cmd", Json::quote(opt.serve.stop.value() ? "shutdown" : "status") } }));
+			}
+			else {
+				optional<EcbmEmuConfig> emu;
+				if (opt.serve.emulate.value()) {
+					emu = emu_config(opt.serve.pincode.value(), opt.serve.fw_key);
+					emu->flash_size = SERVE_EMU_FLASH;
+					// Devices outlive jobs, the next one finds the uploaded app running
+					emu->start_app = true;
+					emu->boot_ms = (uint32_t)opt.serve.boot_ms.value();
+				}
+				serve(path, emu, chrono::seconds(opt.serve.session_ttl_s.value()));
+			}
+		}
+		else if (opt.run.has_value()) {
+			optional<EcbmEmuConfig> emu;
+			if (opt.run.emulate.value()) {
+				emu = emu_config(opt.run.pincode.value(), opt.run.fw_key);
+				emu->flash_size = SERVE_EMU_FLASH;
+				emu->start_app = true;
+				emu->boot_ms = (uint32_t)opt.run.boot_ms.value();
+			}
+			auto checkpoint = opt.run.checkpoint.value_or(opt.run.jobs + ".ckpt");
+			run_fleet(opt.run.jobs, (size_t)opt.run.parallel.value(), emu, opt.run.report, checkpoint, opt.run.resume.value());
+		}
 		else if (opt.ecbm.has_value()) {
 			int rc;
 			IoEcbm ecbm(opt.ecbm.port);
+			ecbm.report_stats(opt.ecbm.stats, opt.ecbm.json_stats);
+			ecbm.capture(opt.ecbm.capture);
 			try {
 				if (opt.ecbm.wu16.has_value()) {
 					auto addr = (uint8_t)opt.ecbm.wu16.addr;
@@ -450,6 +2215,7 @@ int main(int argc, char** argv) {
 			}
 			catch (const exception& e) {
 				cout << e.what() << endl;
+				return 1;
 			}
 		}
 		else {
@@ -461,8 +2227,10 @@ int main(int argc, char** argv) {
 		cout << "HELP: " << e.help() << endl;
 		return -1;
 	}
+	// Exit code tells scripts and CI that a command or any of its entries failed
 	catch (const std::exception& e) {
 		cout << e.what() << endl;
+		return 1;
 	}
 	
 	return 0;
@@ -6,6 +6,10 @@
 #define CPPACK_PACKER_HPP
 
 #include <vector>
+#include <string>
+#include <system_error>
+#include <limits>
+#include <unordered_map>
 #include <set>
 #include <list>
 #include <map>
@@ -13,6 +17,9 @@
 #include <chrono>
 #include <cmath>
 #include <bitset>
+#include <span>
+#include <string_view>
+#include <ostream>
 
 namespace msgpack {
     enum class UnpackerError {
@@ -145,8 +152,15 @@ namespace msgpack {
         static const bool value = true;
     };
 
+    /* Two pass packer: a sizing Packer only counts bytes, so pack() reserves
+     * the exact size once and the writing pass never reallocates.
+     */
     class Packer {
     public:
+        struct Sizing {};
+
+        Packer() = default;
+        explicit Packer(Sizing) : sizing(true) {};
 
         template<class ... Types>
         void operator()(const Types &... args) {
@@ -162,12 +176,74 @@ namespace msgpack {
             return serialized_object;
         }
 
+        std::vector<uint8_t> release() {
+            return std::move(serialized_object);
+        }
+
+        // Encoded size, counted in sizing mode
+        std::size_t size() const {
+            return sizing ? nbytes : serialized_object.size();
+        }
+
+        void reserve(std::size_t size) {
+            serialized_object.reserve(size);
+        }
+
         void clear() {
             serialized_object.clear();
+            nbytes = 0;
+        }
+
+        // Header of bin whose payload is written by caller
+        bool bin_header(std::size_t size) {
+            return pack_bin_header(size);
         }
 
     private:
         std::vector<uint8_t> serialized_object;
+        bool sizing = false;
+        std::size_t nbytes = 0;
+
+        void put(uint8_t byte) {
+            if (sizing) {
+                ++nbytes;
+            }
+            else {
+                serialized_object.push_back(byte);
+            }
+        }
+
+        void put(const uint8_t* data, std::size_t size) {
+            if (sizing) {
+                nbytes += size;
+            }
+            else {
+                serialized_object.insert(serialized_object.end(), data, data + size);
+            }
+        }
+
+        bool pack_bin_header(std::size_t size) {
+            if (size < std::numeric_limits<uint8_t>::max()) {
+                put(bin8);
+                put(uint8_t(size));
+            }
+            else if (size < std::numeric_limits<uint16_t>::max()) {
+                put(bin16);
+                for (auto i = sizeof(uint16_t); i > 0; --i) {
+                    put(uint8_t(size >> (8U * (i - 1)) & 0xff));
+                }
+            }
+            else if (size < std::numeric_limits<uint32_t>::max()) {
+                put(bin32);
+                for (auto i = sizeof(uint32_t); i > 0; --i) {
+                    put(uint8_t(size >> (8U * (i - 1)) & 0xff));
+                }
+            }
+            else {
+                return false;
+            }
+            return true;
+        }
 
         template<class T>
         void pack_type(const T& value) {
@@ -178,9 +254,12 @@ namespace msgpack {
                 pack_array(value);
             }
             else {
-                auto recursive_packer = Packer{};
-                const_cast<T&>(value).pack(recursive_packer);
-                pack_type(recursive_packer.vector());
+                // Nested object is bin of its own encoding, written in place after sizing it
+                auto sizer = Packer{ Sizing{} };
+                const_cast<T&>(value).pack(sizer);
+                if (pack_bin_header(sizer.size())) {
+                    const_cast<T&>(value).pack(*this);
+                }
             }
         }
 
@@ -193,18 +272,18 @@ namespace msgpack {
         void pack_array(const T& array) {
             if (array.size() < 16) {
                 auto size_mask = uint8_t(0b10010000);
-                serialized_object.emplace_back(uint8_t(array.size() | size_mask));
+                put(uint8_t(array.size() | size_mask));
             }
             else if (array.size() < std::numeric_limits<uint16_t>::max()) {
-                serialized_object.emplace_back(array16);
+                put(array16);
                 for (auto i = sizeof(uint16_t); i > 0; --i) {
-                    serialized_object.emplace_back(uint8_t(array.size() >> (8U * (i - 1)) & 0xff));
+                    put(uint8_t(array.size() >> (8U * (i - 1)) & 0xff));
                 }
             }
             else if (array.size() < std::numeric_limits<uint32_t>::max()) {
-                serialized_object.emplace_back(array32);
+                put(array32);
                 for (auto i = sizeof(uint32_t); i > 0; --i) {
-                    serialized_object.emplace_back(uint8_t(array.size() >> (8U * (i - 1)) & 0xff));
+                    put(uint8_t(array.size() >> (8U * (i - 1)) & 0xff));
                 }
             }
             else {
@@ -219,18 +298,18 @@ namespace msgpack {
         void pack_map(const T& map) {
             if (map.size() < 16) {
                 auto size_mask = uint8_t(0b10000000);
-                serialized_object.emplace_back(uint8_t(map.size() | size_mask));
+                put(uint8_t(map.size() | size_mask));
             }
             else if (map.size() < std::numeric_limits<uint16_t>::max()) {
-                serialized_object.emplace_back(map16);
+                put(map16);
                 for (auto i = sizeof(uint16_t); i > 0; --i) {
-                    serialized_object.emplace_back(uint8_t(map.size() >> (8U * (i - 1)) & 0xff));
+                    put(uint8_t(map.size() >> (8U * (i - 1)) & 0xff));
                 }
             }
             else if (map.size() < std::numeric_limits<uint32_t>::max()) {
-                serialized_object.emplace_back(map32);
+                put(map32);
                 for (auto i = sizeof(uint32_t); i > 0; --i) {
-                    serialized_object.emplace_back(uint8_t(map.size() >> (8U * (i - 1)) & 0xff));
+                    put(uint8_t(map.size() >> (8U * (i - 1)) & 0xff));
                 }
             }
             for (const auto& elem : map) {
@@ -284,9 +363,9 @@ namespace msgpack {
     inline
         void Packer::pack_type(const int8_t& value) {
         if (value > 31 || value < -32) {
-            serialized_object.emplace_back(int8);
+            put(int8);
         }
-        serialized_object.emplace_back(uint8_t(twos_complement(value).to_ulong()));
+        put(uint8_t(twos_complement(value).to_ulong()));
     }
 
     template<>
@@ -296,10 +375,10 @@ namespace msgpack {
             pack_type(int8_t(value));
         }
         else {
-            serialized_object.emplace_back(int16);
+            put(int16);
             auto serialize_value = uint16_t(twos_complement(value).to_ulong());
             for (auto i = sizeof(value); i > 0; --i) {
-                serialized_object.emplace_back(uint8_t(serialize_value >> (8U * (i - 1)) & 0xff));
+                put(uint8_t(serialize_value >> (8U * (i - 1)) & 0xff));
             }
         }
     }
@@ -311,10 +390,10 @@ namespace msgpack {
             pack_type(int16_t(value));
         }
         else {
-            serialized_object.emplace_back(int32);
+            put(int32);
             auto serialize_value = uint32_t(twos_complement(value).to_ulong());
             for (auto i = sizeof(value); i > 0; --i) {
-                serialized_object.emplace_back(uint8_t(serialize_value >> (8U * (i - 1)) & 0xff));
+                put(uint8_t(serialize_value >> (8U * (i - 1)) & 0xff));
             }
         }
     }
@@ -326,10 +405,10 @@ namespace msgpack {
             pack_type(int32_t(value));
         }
         else {
-            serialized_object.emplace_back(int64);
+            put(int64);
             auto serialize_value = uint64_t(twos_complement(value).to_ullong());
             for (auto i = sizeof(value); i > 0; --i) {
-                serialized_object.emplace_back(uint8_t(serialize_value >> (8U * (i - 1)) & 0xff));
+                put(uint8_t(serialize_value >> (8U * (i - 1)) & 0xff));
             }
         }
     }
@@ -338,11 +417,11 @@ namespace msgpack {
     inline
         void Packer::pack_type(const uint8_t& value) {
         if (value <= 0x7f) {
-            serialized_object.emplace_back(value);
+            put(value);
         }
         else {
-            serialized_object.emplace_back(uint8);
-            serialized_object.emplace_back(value);
+            put(uint8);
+            put(value);
         }
     }
 
@@ -350,9 +429,9 @@ namespace msgpack {
     inline
         void Packer::pack_type(const uint16_t& value) {
         if (value > std::numeric_limits<uint8_t>::max()) {
-            serialized_object.emplace_back(uint16);
+            put(uint16);
             for (auto i = sizeof(value); i > 0U; --i) {
-                serialized_object.emplace_back(uint8_t(value >> (8U * (i - 1)) & 0xff));
+                put(uint8_t(value >> (8U * (i - 1)) & 0xff));
             }
         }
         else {
@@ -364,9 +443,9 @@ namespace msgpack {
     inline
         void Packer::pack_type(const uint32_t& value) {
         if (value > std::numeric_limits<uint16_t>::max()) {
-            serialized_object.emplace_back(uint32);
+            put(uint32);
             for (auto i = sizeof(value); i > 0U; --i) {
-                serialized_object.emplace_back(uint8_t(value >> (8U * (i - 1)) & 0xff));
+                put(uint8_t(value >> (8U * (i - 1)) & 0xff));
             }
         }
         else {
@@ -378,9 +457,9 @@ namespace msgpack {
     inline
         void Packer::pack_type(const uint64_t& value) {
         if (value > std::numeric_limits<uint32_t>::max()) {
-            serialized_object.emplace_back(uint64);
+            put(uint64);
             for (auto i = sizeof(value); i > 0U; --i) {
-                serialized_object.emplace_back(uint8_t(value >> (8U * (i - 1)) & 0xff));
+                put(uint8_t(value >> (8U * (i - 1)) & 0xff));
             }
         }
         else {
@@ -391,17 +470,17 @@ namespace msgpack {
     template<>
     inline
         void Packer::pack_type(const std::nullptr_t&/*value*/) {
-        serialized_object.emplace_back(nil);
+        put(nil);
     }
 
     template<>
     inline
         void Packer::pack_type(const bool& value) {
         if (value) {
-            serialized_object.emplace_back(true_bool);
+            put(true_bool);
         }
         else {
-            serialized_object.emplace_back(false_bool);
+            put(false_bool);
         }
     }
 
@@ -432,9 +511,9 @@ namespace msgpack {
             }
 
             uint32_t ieee754_float32 = (sign_mask | excess_127_exponent_mask | normalized_mantissa_mask).to_ulong();
-            serialized_object.emplace_back(float32);
+            put(float32);
             for (auto i = sizeof(uint32_t); i > 0; --i) {
-                serialized_object.emplace_back(uint8_t(ieee754_float32 >> (8U * (i - 1)) & 0xff));
+                put(uint8_t(ieee754_float32 >> (8U * (i - 1)) & 0xff));
             }
         }
     }
@@ -466,68 +545,59 @@ namespace msgpack {
                 }
             }
             auto ieee754_float64 = (sign_mask | excess_127_exponent_mask | normalized_mantissa_mask).to_ullong();
-            serialized_object.emplace_back(float64);
+            put(float64);
             for (auto i = sizeof(ieee754_float64); i > 0; --i) {
-                serialized_object.emplace_back(uint8_t(ieee754_float64 >> (8U * (i - 1)) & 0xff));
+                put(uint8_t(ieee754_float64 >> (8U * (i - 1)) & 0xff));
             }
         }
     }
 
     template<>
     inline
-        void Packer::pack_type(const std::string& value) {
+        void Packer::pack_type(const std::string_view& value) {
         if (value.size() < 32) {
-            serialized_object.emplace_back(uint8_t(value.size()) | 0b10100000);
+            put(uint8_t(value.size()) | 0b10100000);
         }
         else if (value.size() < std::numeric_limits<uint8_t>::max()) {
-            serialized_object.emplace_back(str8);
-            serialized_object.emplace_back(uint8_t(value.size()));
+            put(str8);
+            put(uint8_t(value.size()));
         }
         else if (value.size() < std::numeric_limits<uint16_t>::max()) {
-            serialized_object.emplace_back(str16);
+            put(str16);
             for (auto i = sizeof(uint16_t); i > 0; --i) {
-                serialized_object.emplace_back(uint8_t(value.size() >> (8U * (i - 1)) & 0xff));
+                put(uint8_t(value.size() >> (8U * (i - 1)) & 0xff));
             }
         }
         else if (value.size() < std::numeric_limits<uint32_t>::max()) {
-            serialized_object.emplace_back(str32);
+            put(str32);
             for (auto i = sizeof(uint32_t); i > 0; --i) {
-                serialized_object.emplace_back(uint8_t(value.size() >> (8U * (i - 1)) & 0xff));
+                put(uint8_t(value.size() >> (8U * (i - 1)) & 0xff));
             }
         }
         else {
             return; // Give up if string is too long
         }
-        for (char i : value) {
-            serialized_object.emplace_back(static_cast<uint8_t>(i));
+        put(reinterpret_cast<const uint8_t*>(value.data()), value.size());
+    }
+
+    template<>
+    inline
+        void Packer::pack_type(const std::string& value) {
+        pack_type(std::string_view(value));
+    }
+
+    template<>
+    inline
+        void Packer::pack_type(const std::span<const uint8_t>& value) {
+        if (pack_bin_header(value.size())) {
+            put(value.data(), value.size());
         }
     }
 
     template<>
     inline
         void Packer::pack_type(const std::vector<uint8_t>& value) {
-        if (value.size() < std::numeric_limits<uint8_t>::max()) {
-            serialized_object.emplace_back(bin8);
-            serialized_object.emplace_back(uint8_t(value.size()));
-        }
-        else if (value.size() < std::numeric_limits<uint16_t>::max()) {
-            serialized_object.emplace_back(bin16);
-            for (auto i = sizeof(uint16_t); i > 0; --i) {
-                serialized_object.emplace_back(uint8_t(value.size() >> (8U * (i - 1)) & 0xff));
-            }
-        }
-        else if (value.size() < std::numeric_limits<uint32_t>::max()) {
-            serialized_object.emplace_back(bin32);
-            for (auto i = sizeof(uint32_t); i > 0; --i) {
-                serialized_object.emplace_back(uint8_t(value.size() >> (8U * (i - 1)) & 0xff));
-            }
-        }
-        else {
-            return; // Give up if vector is too large
-        }
-        for (const auto& elem : value) {
-            serialized_object.emplace_back(elem);
-        }
+        pack_type(std::span<const uint8_t>(value));
     }
 
     class Unpacker {
@@ -574,6 +644,43 @@ namespace msgpack {
             }
         }
 
+        // Size of bin or str payload, data_pointer is left at payload
+        std::size_t unpack_size(uint8_t fmt8, uint8_t fmt16, uint8_t fmt32, uint8_t fixmask) {
+            std::size_t size = 0;
+            std::size_t nbytes;
+            if (safe_data() == fmt32) {
+                nbytes = sizeof(uint32_t);
+            }
+            else if (safe_data() == fmt16) {
+                nbytes = sizeof(uint16_t);
+            }
+            else if (safe_data() == fmt8 || fixmask == 0) {
+                nbytes = sizeof(uint8_t);
+            }
+            else {
+                size = safe_data() & fixmask;
+                safe_increment();
+                return size;
+            }
+            safe_increment();
+            for (auto i = nbytes; i > 0; --i) {
+                size += std::size_t(safe_data()) << 8 * (i - 1);
+                safe_increment();
+            }
+            return size;
+        }
+
+        // Payload stays in source buffer
+        const uint8_t* unpack_payload(std::size_t size) {
+            if (ec || data_pointer > data_end || std::size_t(data_end - data_pointer) < size) {
+                ec = UnpackerError::OutOfRange;
+                return nullptr;
+            }
+            auto payload = data_pointer;
+            data_pointer += size;
+            return payload;
+        }
+
         template<class T>
         void unpack_type(T& value) {
             if constexpr (is_map<T>::value) {
@@ -586,12 +693,15 @@ namespace msgpack {
                 unpack_stdarray(value);
             }
             else {
-                auto recursive_data = std::vector<uint8_t>{};
+                // Nested object is a bin of its fields, unpack them where they are
+                auto recursive_data = std::span<const uint8_t>{};
                 unpack_type(recursive_data);
 
                 auto recursive_unpacker = Unpacker{ recursive_data.data(), recursive_data.size() };
                 value.pack(recursive_unpacker);
-                ec = recursive_unpacker.ec;
+                if (recursive_unpacker.ec) {
+                    ec = recursive_unpacker.ec;
+                }
             }
         }
 
@@ -1010,92 +1120,97 @@ namespace msgpack {
         }
     }
 
+    template<>
+    inline
+        void Unpacker::unpack_type(std::string_view& value) {
+        auto size = unpack_size(str8, str16, str32, 0b00011111);
+        auto payload = unpack_payload(size);
+        value = payload == nullptr ? std::string_view{} : std::string_view{ reinterpret_cast<const char*>(payload), size };
+    }
+
     template<>
     inline
         void Unpacker::unpack_type(std::string& value) {
-        std::size_t str_size = 0;
-        if (safe_data() == str32) {
-            safe_increment();
-            for (auto i = sizeof(uint32_t); i > 0; --i) {
-                str_size += uint32_t(safe_data()) << 8 * (i - 1);
-                safe_increment();
-            }
-        }
-        else if (safe_data() == str16) {
-            safe_increment();
-            for (auto i = sizeof(uint16_t); i > 0; --i) {
-                str_size += uint16_t(safe_data()) << 8 * (i - 1);
-                safe_increment();
-            }
-        }
-        else if (safe_data() == str8) {
-            safe_increment();
-            for (auto i = sizeof(uint8_t); i > 0; --i) {
-                str_size += uint8_t(safe_data()) << 8 * (i - 1);
-                safe_increment();
-            }
-        }
-        else {
-            str_size = safe_data() & 0b00011111;
-            safe_increment();
-        }
-        if (data_pointer + str_size <= data_end) {
-            value = std::string{ data_pointer, data_pointer + str_size };
-            safe_increment(str_size);
-        }
-        else {
-            ec = UnpackerError::OutOfRange;
-        }
+        auto view = std::string_view{};
+        unpack_type(view);
+        value = std::string{ view };
+    }
+
+    template<>
+    inline
+        void Unpacker::unpack_type(std::span<const uint8_t>& value) {
+        auto size = unpack_size(bin8, bin16, bin32, 0);
+        auto payload = unpack_payload(size);
+        value = payload == nullptr ? std::span<const uint8_t>{} : std::span<const uint8_t>{ payload, size };
     }
 
     template<>
     inline
         void Unpacker::unpack_type(std::vector<uint8_t>& value) {
-        std::size_t bin_size = 0;
-        if (safe_data() == bin32) {
-            safe_increment();
-            for (auto i = sizeof(uint32_t); i > 0; --i) {
-                bin_size += uint32_t(safe_data()) << 8 * (i - 1);
-                safe_increment();
-            }
-        }
-        else if (safe_data() == bin16) {
-            safe_increment();
-            for (auto i = sizeof(uint16_t); i > 0; --i) {
-                bin_size += uint16_t(safe_data()) << 8 * (i - 1);
-                safe_increment();
-            }
-        }
-        else {
-            safe_increment();
-            for (auto i = sizeof(uint8_t); i > 0; --i) {
-                bin_size += uint8_t(safe_data()) << 8 * (i - 1);
-                safe_increment();
-            }
-        }
-        if (data_pointer + bin_size <= data_end) {
-            value = std::vector<uint8_t>{ data_pointer, data_pointer + bin_size };
-            safe_increment(bin_size);
-        }
-        else {
-            ec = UnpackerError::OutOfRange;
-        }
+        auto view = std::span<const uint8_t>{};
+        unpack_type(view);
+        value = std::vector<uint8_t>{ view.begin(), view.end() };
+    }
+
+    template<class PackableObject>
+    std::size_t packed_size(PackableObject& obj) {
+        auto sizer = Packer{ Packer::Sizing{} };
+        obj.pack(sizer);
+        return sizer.size();
     }
 
     template<class PackableObject>
     std::vector<uint8_t> pack(PackableObject& obj) {
         auto packer = Packer{};
+        packer.reserve(packed_size(obj));
         obj.pack(packer);
-        return packer.vector();
+        return packer.release();
     }
 
     template<class PackableObject>
     std::vector<uint8_t> pack(PackableObject&& obj) {
-        auto packer = Packer{};
-        obj.pack(packer);
-        return packer.vector();
+        return pack(obj);
     }
 
+    /* Writes packed values to stream as they come, so large bin payload goes
+     * out chunk by chunk after bin_header() and never sits in one buffer
+     */
+    class StreamWriter {
+    public:
+        explicit StreamWriter(std::ostream& out) : out(out) {};
+
+        template<class ... Types>
+        void operator()(const Types &... args) {
+            packer(args...);
+            flush();
+        }
+
+        bool bin_header(std::size_t size) {
+            auto ok = packer.bin_header(size);
+            flush();
+            return ok;
+        }
+
+        void write(std::span<const uint8_t> chunk) {
+            out.write(reinterpret_cast<const char*>(chunk.data()), std::streamsize(chunk.size()));
+            written += chunk.size();
+        }
+
+        std::size_t size() const {
+            return written;
+        }
+
+    private:
+        std::ostream& out;
+        Packer packer;
+        std::size_t written = 0;
+
+        void flush() {
+            write(packer.vector());
+            packer.clear();
+        }
+    };
+
     template<class UnpackableObject>
     UnpackableObject unpack(const uint8_t* data_start, const std::size_t size, std::error_code& ec) {
         auto obj = UnpackableObject{};
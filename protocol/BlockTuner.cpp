@@ -0,0 +1,113 @@
+#include "BlockTuner.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+double BlockSizeSample::goodput() const {
+	return seconds > 0 ? (double)bytes / seconds : 0;
+}
+
+BlockTuner::BlockTuner(const BlockTunerConfig& config) : _config(config) {
+	_config.min = max<size_t>(align(_config.min), 8);
+	_config.max = max(align(_config.max), _config.min);
+	_limit = _config.max;
+	_size = clamp(align(_config.initial), _config.min, _limit);
+	_start = chrono::steady_clock::now();
+}
+
+size_t BlockTuner::size() const {
+	return _size;
+}
+
+bool BlockTuner::on_block(size_t nbytes) {
+	_blocks++;
+	_bytes += nbytes;
+	if (_blocks + _errors < _config.window) {
+		return false;
+	}
+	if (too_many_errors()) {
+		return shrink();
+	}
+	auto s = sample();
+	add_sample(_curve, s);
+	size_t next = _size;
+	if (s.goodput() > _best_goodput * (1 + _config.min_gain)) {
+		_best_goodput = s.goodput();
+		_best_size = _size;
+		if (!_settled) {
+			next = min(_size * 2, _limit);
+		}
+	}
+	else if (!_settled) {
+		// Larger block did not pay off
+		_settled = true;
+		next = _best_size;
+	}
+	size_t prev = _size;
+	set_size(next);
+	return _size != prev;
+}
+
+bool BlockTuner::on_error() {
+	_errors++;
+	// Window just begun has no rate: one error at a new size would read as 100%
+	if (_blocks + _errors < _config.window || !too_many_errors()) {
+		return false;
+	}
+	return shrink();
+}
+
+bool BlockTuner::too_many_errors() const {
+	return (double)_errors / (double)(_blocks + _errors) > _config.max_error_rate;
+}
+
+bool BlockTuner::shrink() {
+	add_sample(_curve, sample());
+	if (++_strikes[_size] >= 2) {
+		_limit = max(_config.min, align(_size / 2));
+	}
+	// Goodput measured before errors does not hold any more
+	_best_goodput = 0;
+	_best_size = 0;
+	_settled = false;
+	size_t prev = _size;
+	set_size(max(_config.min, align(_size / 2)));
+	return _size != prev;
+}
+
+vector<BlockSizeSample> BlockTuner::curve() const {
+	auto curve = _curve;
+	if (_blocks > 0) {
+		add_sample(curve, sample());
+	}
+	return curve;
+}
+
+BlockSizeSample BlockTuner::sample() const {
+	return BlockSizeSample{ _size, _blocks, _errors, _bytes, chrono::duration<double>(chrono::steady_clock::now() - _start).count() };
+}
+
+void BlockTuner::add_sample(vector<BlockSizeSample>& curve, const BlockSizeSample& s) {
+	if (!curve.empty() && curve.back().size == s.size) {
+		auto& last = curve.back();
+		last.blocks += s.blocks;
+		last.errors += s.errors;
+		last.bytes += s.bytes;
+		last.seconds += s.seconds;
+		return;
+	}
+	curve.push_back(s);
+}
+
+void BlockTuner::set_size(size_t size) {
+	_size = clamp(size, _config.min, _limit);
+	_start = chrono::steady_clock::now();
+	_blocks = 0;
+	_bytes = 0;
+	_errors = 0;
+}
+
+size_t BlockTuner::align(size_t size) {
+	return size - size % 8;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <map>
+#include <vector>
+
+struct BlockTunerConfig {
+	size_t initial = 256;			// probe size
+	size_t min = 64;
+	size_t max = 4080;				// device frame limit less header, offset, crc and cipher fill
+	size_t window = 16;				// blocks per goodput measurement
+	double max_error_rate = 0.1;	// link errors per attempt within window
+	double min_gain = 0.05;			// relative goodput gain that is worth a larger size
+};
+
+// Point of goodput curve: consecutive measurement windows at one block size
+struct BlockSizeSample {
+	size_t size;
+	size_t blocks;
+	size_t errors;
+	size_t bytes;
+	double seconds;					// retries included
+
+	double goodput() const;
+};
+
+/* Picks firmware block size from measured goodput. Starts at the probe size and
+ * doubles it after every window that improved goodput by min_gain, settles at the
+ * best size otherwise. Link errors beyond max_error_rate over a full window halve
+ * the size; a size shrunk from twice is taken as device limit and never tried again.
+ * Sizes are multiples of 8, the cipher block.
+ */
+class BlockTuner
+{
+public:
+	BlockTuner(const BlockTunerConfig& config = BlockTunerConfig());
+
+	size_t size() const;
+	// Block of size() delivered, returns true when size changed
+	bool on_block(size_t nbytes);
+	// Link error (timeout, integrity) of a transfer, returns true when size changed
+	bool on_error();
+	// Measurements in order, the open window is included if it has blocks
+	std::vector<BlockSizeSample> curve() const;
+
+private:
+	BlockTunerConfig _config;
+	size_t _size;
+	size_t _limit;
+	size_t _best_size = 0;
+	double _best_goodput = 0;
+	bool _settled = false;
+	std::map<size_t, int> _strikes;
+	std::vector<BlockSizeSample> _curve;
+
+	std::chrono::steady_clock::time_point _start;
+	size_t _blocks = 0;
+	size_t _bytes = 0;
+	size_t _errors = 0;
+
+	BlockSizeSample sample() const;
+	bool too_many_errors() const;
+	// Halves the size after errors, returns true when size changed
+	bool shrink();
+	static void add_sample(std::vector<BlockSizeSample>& curve, const BlockSizeSample& s);
+	void set_size(size_t size);
+	static size_t align(size_t size);
+};
@@ -12,29 +12,48 @@
 #include <thread>
 #include <iostream>
 #include <cstring>
+#include <algorithm>
 
 #define BOOTPROT_DEBUG_EN	1
 
+// Initial timeouts, used until ecbm has measured the device for the sig class
+#define BOOTPROT_BEGIN_TIMEOUT_MS	5000
+#define BOOTPROT_BLOCK_TIMEOUT_MS	2500
+#define BOOTPROT_END_TIMEOUT_MS		5000
+
 using namespace std;
 
-BootProt::BootProt(Ecbm* ecbm, uint8_t addr, const array<uint8_t, 16> auth_key) : _addr(addr), _ecbm(ecbm) {
+BootProt::BootProt(Ecbm* ecbm, uint8_t addr, const array<uint8_t, 16> auth_key, const BootEntryConfig& entry) : _addr(addr), _ecbm(ecbm) {
 	int rc;
 #if BOOTPROT_DEBUG_EN
 	cout << "static auth key: ";
+	// Through cout, serve routes it to the client of the job
+	char hex[4];
 	for (const auto& v : auth_key) {
-		printf("%02X ", v);
+		snprintf(hex, sizeof(hex), "%02X ", v);
+		cout << hex;
 	}
 	cout << endl;
 #endif
+	auto start = chrono::steady_clock::now();
 	rc = ecbm_begin_enc_session(_ecbm, _addr, auth_key.data());
 	if (rc < 0) {
 		throw runtime_error("fail to begin pre-reset encrypted session: " + to_string(rc));
 	}
-	ecbm_reset(_ecbm, _addr);
-	this_thread::sleep_for(chrono::milliseconds(500));
-	rc = ecbm_begin_enc_session(_ecbm, _addr, auth_key.data());
-	if (rc < 0) {
-		throw runtime_error("fail to begin encrypted session: " + to_string(rc));
+	bool was_boot = in_bootloader();
+	if (entry.skip_reset && was_boot) {
+		cout << "device is in bootloader already, reset skipped" << endl;
+	}
+	else {
+		// Identity of the app tells the bootloader from the app still running after reset
+		optional<EcbmDeviceInfo> app_info;
+		EcbmDeviceInfo info = { 0 };
+		if (!was_boot && ecbm_read_info(_ecbm, _addr, &info) >= 0) {
+			app_info = info;
+		}
+		ecbm_reset(_ecbm, _addr);
+		wait_bootloader(auth_key, entry, app_info);
+		cout << "bootloader ready in " << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count() << " ms" << endl;
 	}
 	EcbmDeviceInfo boot_info = { 0 };
 	rc = ecbm_read_info(_ecbm, _addr, &boot_info);
@@ -48,7 +67,11 @@ BootProt::~BootProt() {
 	
 }
 
-void BootProt::upload_firmware(const FirmwareInfo& info, const array<uint8_t, 16>& test_phrase, const vector<uint8_t>& data, size_t blocksize) {
+const UploadReport& BootProt::upload_firmware(const FirmwareInfo& info, const array<uint8_t, 16>& test_phrase, span<const uint8_t> data, size_t blocksize) {
+	_report = UploadReport();
+	_report.baud = ecbm_get_baud(_ecbm);
+	_link_errs = 0;
+	_link_ok = 0;
 	if (data.size() == 0) {
 		throw runtime_error("firmware is empty");
 	}
@@ -63,49 +86,216 @@ void BootProt::upload_firmware(const FirmwareInfo& info, const array<uint8_t, 16
 	strncpy(fw_info.name, info.name.c_str(), 32);
 	#endif
 	memcpy(fw_info.version, info.version.data(), 3);
-	int rc = ecbm_begin_upload_firmware(_ecbm, _addr, &fw_info, test_phrase.data(), 5000);
+	uint8_t flags = 0;
+	size_t fw_len = data.size();
+	if (info.codec == FirmwareCodec::Lzss) {
+		flags |= ECBM_BOOT_FLAG_LZSS;
+		fw_len = info.raw_size;
+	}
+	else if (info.codec != FirmwareCodec::None) {
+		throw runtime_error("unknown firmware codec: " + to_string((int)info.codec));
+	}
+	// Chunks to send as offset and length, tuned upload cuts them into blocks as it goes
+	vector<pair<size_t, size_t>> chunks;
+	auto plan = plan_delta(info, data.size(), blocksize);
+	if (plan.has_value()) {
+		flags |= ECBM_BOOT_FLAG_KEEP;
+		for (auto offset : plan.value()) {
+			size_t len = min(blocksize, data.size() - offset);
+			// Runs of differing blocks are one chunk for tuned upload
+			if (_tuning.has_value() && !chunks.empty() && chunks.back().first + chunks.back().second == offset) {
+				chunks.back().second += len;
+			}
+			else {
+				chunks.emplace_back(offset, len);
+			}
+		}
+		cout << "delta: " << plan->size() << " of " << (data.size() + blocksize - 1) / blocksize << " blocks differ" << endl;
+	}
+	else {
+		size_t start = 0;
+		auto resume = plan_resume(info, blocksize);
+		if (resume.has_value()) {
+			flags |= ECBM_BOOT_FLAG_RESUME;
+			start = min(resume.value(), data.size());
+			_report.resumed_from = start;
+			if (start > 0) {
+				cout << "resume from " << start << " of " << data.size() << " bytes" << endl;
+			}
+		}
+		// Regions of erased value are left to the erase at begin
+		const vector<pair<size_t, size_t>> no_regions;
+		bool sparse = _sparse && info.codec == FirmwareCodec::None && info.filler == BOOTPROT_ERASED_BYTE && !info.filler_regions.empty();
+		chunks = plan_chunks(start, data.size(), _tuning.has_value() ? data.size() : blocksize, sparse ? info.filler_regions : no_regions);
+		if (sparse) {
+			flags |= ECBM_BOOT_FLAG_SPARSE;
+		}
+	}
+	_report.skipped = data.size() - _report.resumed_from;
+	for (const auto& [offset, len] : chunks) {
+		_report.skipped -= len;
+	}
+	bool tracked = (flags & ECBM_BOOT_FLAG_RESUME) != 0 && _journal != nullptr;
+	int rc = ecbm_begin_upload_firmware_ex(_ecbm, _addr, &fw_info, test_phrase.data(), flags, (uint32_t)fw_len, info.checksum, BOOTPROT_BEGIN_TIMEOUT_MS);
 	if (rc < 0) {
 		throw runtime_error("fail to begin upload firmware: " + to_string(rc));
 	}
 
 	cout << "upload.." << endl;
-	size_t ptr = 0;
-	size_t rem = data.size();
-	size_t cur;
-	int tries = 0;
-	while (ptr < rem) {
-		cout << (ptr * 100) / rem << "%" << endl;
-		if (rem - ptr > blocksize) {
-			cur = blocksize;
+	// Created here so that the first window measures blocks only
+	optional<BlockTuner> tuner;
+	if (_tuning.has_value()) {
+		auto config = _tuning.value();
+		config.initial = blocksize;
+		config.max = min(config.max, (size_t)BOOTPROT_MAX_BLOCK_SIZE);
+		tuner.emplace(config);
+	}
+	size_t nsend = data.size() - _report.resumed_from - _report.skipped;
+	size_t iblock = 0;
+	size_t done = 0;		// bytes of current chunk
+	size_t ptr;
+	size_t cur = 0;		// size of block in flight, kept over retries
+	int attempt = 0;
+	uint16_t block_timeout = BOOTPROT_BLOCK_TIMEOUT_MS;
+	size_t timed_size = blocksize;		// block size the flash rtt is measured at
+	// Also for failed upload, its curve tells where the link gave up
+	auto report_blocks = [&]() {
+		_report.block_size = tuner.has_value() ? tuner->size() : blocksize;
+		if (tuner.has_value()) {
+			_report.block_curve = tuner->curve();
 		}
-		else {
-			cur = rem - ptr;
+	};
+	while (iblock < chunks.size()) {
+		if (attempt == 0) {
+			cout << (_report.bytes * 100) / nsend << "%" << endl;
+		}
+		ptr = chunks[iblock].first + done;
+		if (cur == 0) {
+			cur = chunks[iblock].second - done;
+			if (tuner.has_value()) {
+				cur = min(cur, tuner->size());
+			}
+			if (tuner.has_value() && tuner->size() != timed_size) {
+				// Rto learned at the old size does not fit the new one, flash class is measured anew;
+				// until then the timeout is the rto scaled to the new size or the initial one
+				const EcbmRtt* rtt = ecbm_get_rtt(_ecbm, _addr, ECBM_SIGCLS_FLASH);
+				block_timeout = BOOTPROT_BLOCK_TIMEOUT_MS;
+				if (rtt != nullptr && rtt->nsamples > 0) {
+					uint32_t scaled = 2 * (uint32_t)ecbm_get_rto(_ecbm, _addr, ECBM_SIGCLS_FLASH) * tuner->size() / timed_size;
+					block_timeout = (uint16_t)min<uint32_t>(scaled, BOOTPROT_BLOCK_TIMEOUT_MS);
+				}
+				ecbm_reset_rtt_class(_ecbm, _addr, ECBM_SIGCLS_FLASH);
+				timed_size = tuner->size();
+			}
+		}
+		// Failed block is resent as it was, a new size applies from the next one: partial overlapping writes are not assumed
+		rc = ecbm_write_firmware_block(_ecbm, _addr, &data.data()[ptr], cur, ptr, block_timeout);
+		if (rc == ECBM_ERR_TIMEOUT || rc == ECBM_ERR_INTEGRITY) {
+			if (tuner.has_value() && tuner->on_error()) {
+				cout << "link errors, block size " << tuner->size() << endl;
+			}
+			// Above probe size the device buffer may be what fails, that is for the tuner, not for the rate
+			bool probed = !tuner.has_value() || cur <= blocksize;
+			if (probed) {
+				_link_errs++;
+			}
+			if (probed && _link_errs >= _baud.downshift_errs && downshift()) {
+				// Block is resent from scratch at lower rate
+				attempt = 0;
+				continue;
+			}
 		}
-		trie:
-		rc = ecbm_write_firmware_block(_ecbm, _addr, &data.data()[ptr], cur, ptr, 2500);
 		if (rc < 0) {
-			tries++;
-			if (tries > 5) {
+			attempt++;
+			auto decision = _retry.decide(rc, attempt);
+			_report.retries.push_back(RetryRecord{ ptr, attempt, rc, decision });
+#if BOOTPROT_DEBUG_EN
+			cout << "fail to write fw block: " << rc << ", " << RetryPolicy::action_name(decision.action) << " " << decision.delay_ms << " ms" << endl;
+#endif
+			if (decision.action == RetryAction::Fail) {
+				report_blocks();
 				throw runtime_error("fail to write firmware block: " + to_string(rc));
 			}
+			else if (decision.action == RetryAction::Backoff) {
+				_report.backoffs++;
+				this_thread::sleep_for(chrono::milliseconds(decision.delay_ms));
+			}
 			else {
+				_report.resends++;
+			}
+			continue;
+		}
+		if (++_link_ok >= _baud.window) {
+			_link_ok = 0;
+			_link_errs = 0;
+		}
+		attempt = 0;
+		done += cur;
+		if (done == chunks[iblock].second) {
+			iblock++;
+			done = 0;
+		}
+		_report.bytes += cur;
+		_report.blocks++;
+		if (tracked && (_report.blocks % BOOTPROT_JOURNAL_BLOCKS == 0 || iblock == chunks.size())) {
+			update_journal(ptr + cur);
+		}
+		if (tuner.has_value() && tuner->on_block(cur)) {
 #if BOOTPROT_DEBUG_EN
-				cout << "fail to write fw block: " << rc << endl;
+			cout << "block size " << tuner->size() << endl;
 #endif
-				this_thread::sleep_for(chrono::milliseconds(100));
-				goto trie;
-			}
 		}
-		tries = 0;
-		ptr += cur;
+		cur = 0;
 	}
+	report_blocks();
 
 	cout << "verify.." << endl;
-	rc = ecbm_end_upload_firmware(_ecbm, _addr, info.checksum, data.size(), 5000);
+	rc = ecbm_end_upload_firmware(_ecbm, _addr, info.checksum, fw_len, BOOTPROT_END_TIMEOUT_MS);
 	if (rc < 0) {
 		throw runtime_error("fail to terminate firmware upload: " + to_string(rc));
 	}
+	update_journal(nullopt);
 	cout << "upload and verify complete." << endl;
+	_report.complete = true;
+	return _report;
+}
+
+bool BootProt::in_bootloader() {
+	uint32_t checksum;
+	int rc = ecbm_firmware_checksum(_ecbm, _addr, &checksum);
+	// Checksum may be refused for blank or half-written image, yet it is the bootloader that refuses
+	return rc >= 0 || (ECBM_IS_APP_ERR(rc) && rc != ECBM_ERR_NO_SIG);
+}
+
+bool BootProt::rebooted(const optional<EcbmDeviceInfo>& app_info) {
+	if (app_info.has_value()) {
+		EcbmDeviceInfo info = { 0 };
+		if (ecbm_read_info(_ecbm, _addr, &info) >= 0 && (strncmp(info.name, app_info->name, sizeof(info.name)) != 0 || memcmp(info.version, app_info->version, sizeof(info.version)) != 0)) {
+			return true;
+		}
+	}
+	return in_bootloader();
+}
+
+void BootProt::wait_bootloader(const array<uint8_t, 16>& auth_key, const BootEntryConfig& entry, const optional<EcbmDeviceInfo>& app_info) {
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(entry.ready_ms);
+	int rc;
+	while (true) {
+		auto probe_start = chrono::steady_clock::now();
+		rc = ecbm_probe(_ecbm, _addr, entry.probe_ms);
+		if (rc == ECBM_OK) {
+			// App may still answer before it gets to reset
+			rc = ecbm_begin_enc_session(_ecbm, _addr, auth_key.data());
+			if (rc >= 0 && rebooted(app_info)) {
+				return;
+			}
+		}
+		if (chrono::steady_clock::now() >= deadline) {
+			throw runtime_error("bootloader is not ready in " + to_string(entry.ready_ms) + " ms: " + to_string(rc));
+		}
+		// Quick refusals must not flood the device while it boots
+		this_thread::sleep_until(probe_start + chrono::milliseconds(entry.probe_ms));
+	}
 }
 
 void BootProt::pick() {
@@ -133,6 +323,206 @@ FirmwareInfo BootProt::get_firmware_info() {
 	};
 }
 
+vector<pair<size_t, size_t>> BootProt::plan_chunks(size_t start, size_t nbytes, size_t blocksize, const vector<pair<size_t, size_t>>& skip) {
+	vector<pair<size_t, size_t>> chunks;
+	size_t ptr = start;
+	auto region = skip.begin();
+	while (ptr < nbytes) {
+		while (region != skip.end() && region->first + region->second <= ptr) {
+			region++;
+		}
+		if (region != skip.end() && region->first <= ptr) {
+			ptr = region->first + region->second;
+			continue;
+		}
+		size_t end = min(nbytes, ptr + blocksize);
+		if (region != skip.end() && region->first < end) {
+			end = region->first;
+		}
+		chunks.emplace_back(ptr, end - ptr);
+		ptr = end;
+	}
+	return chunks;
+}
+
+void BootProt::set_retry_policy(const RetryPolicy& policy) {
+	_retry = policy;
+}
+
+void BootProt::set_delta(bool enabled) {
+	_delta = enabled;
+}
+
+void BootProt::set_sparse(bool enabled) {
+	_sparse = enabled;
+}
+
+void BootProt::set_resume(bool enabled) {
+	_resume = enabled;
+}
+
+void BootProt::set_journal(UploadJournal* journal, const string& key) {
+	_journal = journal;
+	_journal_key = key;
+}
+
+void BootProt::set_block_tuning(const optional<BlockTunerConfig>& config) {
+	_tuning = config;
+}
+
+// Journal only helps a later resume, its errors must not stop the upload
+void BootProt::update_journal(optional<size_t> offset) {
+	if (_journal == nullptr) {
+		return;
+	}
+	try {
+		if (offset.has_value()) {
+			_journal->set(_journal_key, offset.value());
+		}
+		else {
+			_journal->remove(_journal_key);
+		}
+	}
+	catch (const exception& e) {
+		cout << "warning: " << e.what() << ", upload journal is off" << endl;
+		_journal = nullptr;
+	}
+}
+
+optional<size_t> BootProt::plan_resume(const FirmwareInfo& info, size_t blocksize) {
+	// Decoder state of compressed stream is lost on reset
+	if (info.codec != FirmwareCodec::None) {
+		return nullopt;
+	}
+	uint32_t committed = 0;
+	int rc = ecbm_read_boot_progress(_ecbm, _addr, info.checksum, &committed);
+	if (rc == ECBM_ERR_NO_SIG) {
+		if (_resume) {
+			cout << "device does not track upload progress, upload from start" << endl;
+		}
+		return nullopt;
+	}
+	// Progress is an optimization as delta is, upload from start when it is not readable
+	if (rc < 0) {
+		cout << "fail to read upload progress: " << rc << ", upload from start" << endl;
+		return nullopt;
+	}
+	if (!_resume) {
+		return 0;
+	}
+	size_t start = committed;
+	if (_journal != nullptr) {
+		auto saved = _journal->get(_journal_key);
+		if (saved.has_value()) {
+			// Device is authoritative, journal only may hold it back
+			start = min(start, saved.value());
+		}
+	}
+	return start - start % blocksize;
+}
+
+optional<vector<size_t>> BootProt::plan_delta(const FirmwareInfo& info, size_t nbytes, size_t blocksize) {
+	// Compressed stream is decoded sequentially, it can not be patched
+	if (!_delta || info.codec != FirmwareCodec::None || info.crc_block != blocksize || info.block_crcs.size() * blocksize < nbytes) {
+		return nullopt;
+	}
+	vector<size_t> offsets;
+	size_t nblocks = (nbytes + blocksize - 1) / blocksize;
+	uint32_t dev_crcs[ECBM_MAX_BLOCK_CRCS];
+	for (size_t first = 0; first < nblocks; first += ECBM_MAX_BLOCK_CRCS) {
+		uint16_t count = (uint16_t)min<size_t>(ECBM_MAX_BLOCK_CRCS, nblocks - first);
+		int rc = ecbm_read_block_crcs(_ecbm, _addr, (uint16_t)blocksize, (uint32_t)first, count, dev_crcs);
+		if (rc == ECBM_ERR_NO_SIG) {
+			cout << "device does not report block crcs, full upload" << endl;
+			return nullopt;
+		}
+		// Delta is an optimization, any bootloader must still take a full upload
+		if (rc < 0) {
+			cout << "fail to read device block crcs: " << rc << ", full upload" << endl;
+			return nullopt;
+		}
+		for (size_t i = 0; i < count; i++) {
+			if (dev_crcs[i] != info.block_crcs[first + i]) {
+				offsets.push_back((first + i) * blocksize);
+			}
+		}
+	}
+	return offsets;
+}
+
+const UploadReport& BootProt::last_upload_report() const {
+	return _report;
+}
+
+uint32_t BootProt::negotiate_baud(const BaudConfig& config) {
+	_baud = config;
+	_bauds.clear();
+	uint32_t cur = ecbm_get_baud(_ecbm);
+	if (_base_baud == 0) {
+		_base_baud = cur;
+	}
+	uint32_t dev_bauds[ECBM_MAX_BAUDS];
+	int rc = ecbm_read_bauds(_ecbm, _addr, dev_bauds, ECBM_MAX_BAUDS);
+	if (rc == ECBM_ERR_NO_SIG) {
+		cout << "device does not support baud switch, stay at " << cur << endl;
+		return cur;
+	}
+	if (rc < 0) {
+		throw runtime_error("fail to read device baud rates: " + to_string(rc));
+	}
+	for (int i = 0; i < rc; i++) {
+		if (find(config.bauds.begin(), config.bauds.end(), dev_bauds[i]) != config.bauds.end()) {
+			_bauds.push_back(dev_bauds[i]);
+		}
+	}
+	sort(_bauds.begin(), _bauds.end());
+	_bauds.erase(unique(_bauds.begin(), _bauds.end()), _bauds.end());
+	while (!_bauds.empty() && _bauds.back() > cur) {
+		rc = ecbm_switch_baud(_ecbm, _addr, _bauds.back());
+		if (rc == ECBM_OK) {
+			break;
+		}
+		cout << "fail to switch to " << _bauds.back() << " baud: " << rc << endl;
+		_bauds.pop_back();
+	}
+	cur = ecbm_get_baud(_ecbm);
+	cout << "link rate: " << cur << " baud" << endl;
+	return cur;
+}
+
+void BootProt::restore_baud(bool ask_device) {
+	_bauds.clear();
+	if (_base_baud == 0 || ecbm_get_baud(_ecbm) == _base_baud) {
+		return;
+	}
+	if (!ask_device || ecbm_switch_baud(_ecbm, _addr, _base_baud) != ECBM_OK) {
+		ecbm_set_baud(_ecbm, _base_baud);
+		ecbm_reset_rtt(_ecbm, _addr);
+	}
+	cout << "link rate: " << ecbm_get_baud(_ecbm) << " baud" << endl;
+}
+
+bool BootProt::downshift() {
+	uint32_t cur = ecbm_get_baud(_ecbm);
+	_link_errs = 0;
+	_link_ok = 0;
+	// Rates known to fail are dropped, so search goes only down
+	while (!_bauds.empty() && _bauds.back() >= cur) {
+		_bauds.pop_back();
+	}
+	while (!_bauds.empty()) {
+		int rc = ecbm_switch_baud(_ecbm, _addr, _bauds.back());
+		if (rc == ECBM_OK) {
+			cout << "link errors, downshift to " << _bauds.back() << " baud" << endl;
+			_report.downshifts++;
+			_report.baud = _bauds.back();
+			return true;
+		}
+		_bauds.pop_back();
+	}
+	return false;
+}
+
 void BootProt::set_new_auth_key(const array<uint8_t, 16> new_auth_key) {
 	int rc = ecbm_set_new_auth_key(_ecbm, _addr, new_auth_key.data());
 	if (rc < 0) {
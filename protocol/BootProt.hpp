@@ -1,6 +1,9 @@
 #pragma once
 
 #include "ecbm.h"
+#include "RetryPolicy.hpp"
+#include "BlockTuner.hpp"
+#include "UploadJournal.hpp"
 
 #include <cstdlib>
 #include <cstdint>
@@ -8,27 +11,136 @@
 #include <string>
 #include <vector>
 #include <optional>
+#include <span>
+#include <utility>
 
 //using namespace std;
 
+#define BOOTPROT_BLOCK_SIZE		256
+#define BOOTPROT_MAX_BLOCK_SIZE	((ECBM_MAX_FRAME - 16) & ~7)	// less header, offset, crc and cipher fill
+#define BOOTPROT_JOURNAL_BLOCKS	16		// journal is saved every that many blocks
+#define BOOTPROT_ERASED_BYTE	0xFF
+#define BOOTPROT_SPARSE_MIN		64		// shorter filler runs are not worth a separate chunk
+
+// Codec of firmware data, before encryption
+enum class FirmwareCodec : uint8_t {
+	None = 0,
+	Lzss = 1
+};
+
 struct FirmwareInfo {
 	std::string name;
 	std:: array<uint8_t, 3> version;
 	uint32_t checksum;
+	FirmwareCodec codec = FirmwareCodec::None;
+	size_t raw_size = 0;		// decompressed size, for compressed data only
+	// Plaintext crc32 of every crc_block bytes, lets upload skip blocks the device already has
+	std::vector<uint32_t> block_crcs;
+	size_t crc_block = 0;
+	// Plaintext regions (offset, length) made of filler byte only
+	uint8_t filler = BOOTPROT_ERASED_BYTE;
+	std::vector<std::pair<size_t, size_t>> filler_regions;
+};
+
+struct RetryRecord {
+	size_t offset;
+	int attempt;
+	int rc;
+	RetryDecision decision;
+};
+
+struct UploadReport {
+	size_t bytes = 0;
+	size_t blocks = 0;
+	size_t resends = 0;
+	size_t backoffs = 0;
+	size_t skipped = 0;			// bytes not sent by delta or sparse upload
+	size_t resumed_from = 0;
+	bool complete = false;
+	uint32_t baud = 0;
+	size_t downshifts = 0;
+	std::vector<RetryRecord> retries;
+	size_t block_size = 0;		// in use at the end
+	std::vector<BlockSizeSample> block_curve;	// empty for fixed block size
+};
+
+/* Link rate policy: rates host may use and how many link errors (timeout, integrity)
+ * within window successful blocks make upload step down to the next lower rate
+ */
+struct BaudConfig {
+	std::vector<uint32_t> bauds;
+	int downshift_errs = 3;
+	size_t window = 32;
+};
+
+/* Bootloader entry: after reset the address is probed every probe_ms until
+ * bootloader answers, for at most ready_ms. Device already running bootloader
+ * is not reset unless skip_reset is off, e.g. for an app that answers bootloader sigs
+ */
+struct BootEntryConfig {
+	uint16_t probe_ms = 50;
+	uint32_t ready_ms = 3000;
+	bool skip_reset = true;
 };
 
 class BootProt
 {
 public:
-	BootProt(Ecbm* ecbm, uint8_t addr, const std::array<uint8_t, 16> auth_key);
+	BootProt(Ecbm* ecbm, uint8_t addr, const std::array<uint8_t, 16> auth_key, const BootEntryConfig& entry = BootEntryConfig());
 	~BootProt();
 
-	void upload_firmware(const FirmwareInfo& info, const std::array<uint8_t, 16>& test_phrase, const std::vector<uint8_t>& data, size_t blocksize = 256);
+	const UploadReport& upload_firmware(const FirmwareInfo& info, const std::array<uint8_t, 16>& test_phrase, std::span<const uint8_t> data, size_t blocksize = BOOTPROT_BLOCK_SIZE);
 	void pick();
 	FirmwareInfo get_firmware_info();
 	void set_new_auth_key(const std::array<uint8_t, 16> new_auth_key);
+	void set_retry_policy(const RetryPolicy& policy);
+	void set_delta(bool enabled);
+	// Leave regions of erased value to the erase at begin; off by default, the bootloader must take sparse flag
+	void set_sparse(bool enabled);
+	// Continue interrupted upload of the same image from offset committed by device
+	void set_resume(bool enabled);
+	void set_journal(UploadJournal* journal, const std::string& key);
+	// Block size of upload picked by goodput, nullopt - blocksize given to upload_firmware
+	void set_block_tuning(const std::optional<BlockTunerConfig>& config);
+	const UploadReport& last_upload_report() const;
+	// Split [start, nbytes) into chunks of up to blocksize bytes around sorted skip regions
+	static std::vector<std::pair<size_t, size_t>> plan_chunks(size_t start, size_t nbytes, size_t blocksize, const std::vector<std::pair<size_t, size_t>>& skip);
+	// Switch to the highest rate supported by both sides, returns rate in use
+	uint32_t negotiate_baud(const BaudConfig& config);
+	// Back to rate in use before negotiate_baud, device is asked to switch too when it may stay in bootloader
+	void restore_baud(bool ask_device);
 
 private:
 	uint8_t _addr;
 	Ecbm* _ecbm;
+	RetryPolicy _retry;
+	UploadReport _report;
+	BaudConfig _baud;
+	// Common rates in ascending order, empty when rate is not negotiated
+	std::vector<uint32_t> _bauds;
+	uint32_t _base_baud = 0;
+	int _link_errs = 0;
+	size_t _link_ok = 0;
+
+	bool _delta = true;
+	bool _sparse = false;
+	bool _resume = false;
+	UploadJournal* _journal = nullptr;
+	std::string _journal_key;
+	// Device buffer size is not reported, blocks grow above probe size only up to a given max
+	std::optional<BlockTunerConfig> _tuning = BlockTunerConfig{ .max = BOOTPROT_BLOCK_SIZE };
+
+	bool downshift();
+	// Device answers bootloader-only read, the app does not serve it
+	bool in_bootloader();
+	// Device reports identity other than the app had before reset, or answers as bootloader
+	bool rebooted(const std::optional<EcbmDeviceInfo>& app_info);
+	// Polls until bootloader is up after reset and opens session with it
+	void wait_bootloader(const std::array<uint8_t, 16>& auth_key, const BootEntryConfig& entry, const std::optional<EcbmDeviceInfo>& app_info);
+	// Offsets of blocks differing from installed image, nullopt when delta upload is not possible
+	std::optional<std::vector<size_t>> plan_delta(const FirmwareInfo& info, size_t nbytes, size_t blocksize);
+	// Offset to start from when device tracks progress of the image, nullopt otherwise
+	std::optional<size_t> plan_resume(const FirmwareInfo& info, size_t blocksize);
+	// Saves offset of the image or drops it when nullopt, errors turn journal off
+	void update_journal(std::optional<size_t> offset);
 };
@@ -0,0 +1,136 @@
+#include "ChunkPipeline.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+using namespace std;
+
+ChunkPipeline::ChunkPipeline(size_t nworkers, size_t depth) :
+	_nworkers(nworkers), _depth(max<size_t>(depth, 1)) {
+}
+
+void ChunkPipeline::run(const Reader& reader, const Stage& work, const Stage& sink) {
+	struct Item {
+		size_t index;
+		vector<uint8_t> chunk;
+	};
+	mutex lock;
+	condition_variable changed;
+	vector<vector<uint8_t>> free_chunks(_depth);
+	deque<Item> to_work;
+	map<size_t, vector<uint8_t>> done;
+	optional<size_t> nchunks;
+	exception_ptr error;
+	bool stop = false;
+
+	auto fail = [&](exception_ptr e) {
+		lock_guard<mutex> guard(lock);
+		if (!error) {
+			error = e;
+		}
+		stop = true;
+		changed.notify_all();
+	};
+
+	thread read_thread([&]() {
+		try {
+			for (size_t index = 0;; index++) {
+				vector<uint8_t> chunk;
+				{
+					unique_lock<mutex> guard(lock);
+					changed.wait(guard, [&]() { return stop || !free_chunks.empty(); });
+					if (stop) {
+						return;
+					}
+					chunk = move(free_chunks.back());
+					free_chunks.pop_back();
+				}
+				bool more = reader(index, chunk);
+				lock_guard<mutex> guard(lock);
+				if (!more) {
+					nchunks = index;
+					free_chunks.push_back(move(chunk));
+					changed.notify_all();
+					return;
+				}
+				if (_nworkers == 0) {
+					done[index] = move(chunk);
+				}
+				else {
+					to_work.push_back({ index, move(chunk) });
+				}
+				changed.notify_all();
+			}
+		}
+		catch (...) {
+			fail(current_exception());
+		}
+	});
+
+	vector<thread> workers;
+	for (size_t i = 0; i < _nworkers; i++) {
+		workers.emplace_back([&]() {
+			try {
+				for (;;) {
+					Item item;
+					{
+						unique_lock<mutex> guard(lock);
+						changed.wait(guard, [&]() { return stop || !to_work.empty() || nchunks.has_value(); });
+						if (stop || to_work.empty()) {
+							return;
+						}
+						item = move(to_work.front());
+						to_work.pop_front();
+					}
+					work(item.index, item.chunk);
+					lock_guard<mutex> guard(lock);
+					done[item.index] = move(item.chunk);
+					changed.notify_all();
+				}
+			}
+			catch (...) {
+				fail(current_exception());
+			}
+		});
+	}
+
+	try {
+		for (size_t index = 0;; index++) {
+			vector<uint8_t> chunk;
+			{
+				unique_lock<mutex> guard(lock);
+				changed.wait(guard, [&]() { return stop || done.count(index) != 0 || nchunks == index; });
+				if (stop || nchunks == index) {
+					break;
+				}
+				chunk = move(done[index]);
+				done.erase(index);
+			}
+			sink(index, chunk);
+			lock_guard<mutex> guard(lock);
+			free_chunks.push_back(move(chunk));
+			changed.notify_all();
+		}
+	}
+	catch (...) {
+		fail(current_exception());
+	}
+	{
+		lock_guard<mutex> guard(lock);
+		stop = true;
+		changed.notify_all();
+	}
+	read_thread.join();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	if (error) {
+		rethrow_exception(error);
+	}
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+/* Ordered chunk pipeline: reader thread fills chunks, worker threads transform them
+ * in any order, sink gets them back in reader order on the calling thread.
+ * At most depth chunks are alive, so memory is depth * chunk size.
+ * Exception from any stage stops the pipeline and is rethrown by run().
+ */
+class ChunkPipeline
+{
+public:
+	// Fill chunk number index, return false at end of input
+	using Reader = std::function<bool(size_t index, std::vector<uint8_t>& chunk)>;
+	using Stage = std::function<void(size_t index, std::vector<uint8_t>& chunk)>;
+
+	// nworkers 0 - chunks go from reader to sink as is
+	ChunkPipeline(size_t nworkers, size_t depth);
+
+	void run(const Reader& reader, const Stage& work, const Stage& sink);
+
+private:
+	size_t _nworkers;
+	size_t _depth;
+};
@@ -0,0 +1,539 @@
+#include "EcbmEmu.hpp"
+#include "ecbm.h"
+#include "framer7b.h"
+#include "crc32.h"
+#include "raiden.h"
+#include "stdser.h"
+#include "lzss.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#ifdef __linux
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+EcbmEmuDevice::EcbmEmuDevice(uint8_t addr, const EcbmEmuConfig& config) : _addr(addr), _config(config), _auth_key(config.auth_key), _flash(config.flash_size, 0xFF), _baud(config.baud), _prev_baud(config.baud), _rng(addr) {
+	memset(&_app_info, 0, sizeof(_app_info));
+}
+
+void EcbmEmuDevice::reset() {
+	_session_key.reset();
+	_uploading = false;
+	_baud = _config.baud;
+	_baud_deadline.reset();
+	_in_app = false;
+	if (_config.boot_ms > 0) {
+		_boot_deadline = chrono::steady_clock::now() + chrono::milliseconds(_config.boot_ms);
+	}
+}
+
+void EcbmEmuDevice::poll() {
+	if (_baud_deadline.has_value() && chrono::steady_clock::now() > _baud_deadline.value()) {
+		_baud = _prev_baud;
+		_baud_deadline.reset();
+	}
+}
+
+uint8_t EcbmEmuDevice::addr() const {
+	return _addr;
+}
+
+uint32_t EcbmEmuDevice::baud() const {
+	return _baud;
+}
+
+const vector<uint8_t>& EcbmEmuDevice::flash() const {
+	return _flash;
+}
+
+int EcbmEmuDevice::answer(Framer7b* out, uint8_t typ, const uint8_t* data, size_t ndata, bool plain) {
+	const uint8_t* key = (!plain && _session_key.has_value()) ? _session_key->data() : nullptr;
+	return ecbm_make_answer(out, _addr, typ, data, ndata, key);
+}
+
+int EcbmEmuDevice::error(Framer7b* out, int err) {
+	uint8_t code = (uint8_t)(-err);
+	return answer(out, ECBM_TYP_ERR, &code, 1);
+}
+
+int EcbmEmuDevice::handle(const uint8_t* frame, size_t nframe, Framer7b* out, uint32_t& busy_us) {
+	vector<uint8_t> buf(frame, frame + nframe);
+	EcbmFrameInfo info;
+	bool encrypted = false;
+	busy_us = 0;
+	if (nframe > _config.max_frame) {
+		return 0;
+	}
+	if (_boot_deadline.has_value()) {
+		if (chrono::steady_clock::now() < _boot_deadline.value()) {
+			return 0;
+		}
+		_boot_deadline.reset();
+	}
+	if (_session_key.has_value() && ecbm_parse_frame(buf.data(), buf.size(), _session_key->data(), &info) == ECBM_OK && info.is_req && info.addr == _addr) {
+		encrypted = true;
+	}
+	else {
+		buf.assign(frame, frame + nframe);
+		if (ecbm_parse_frame(buf.data(), buf.size(), nullptr, &info) != ECBM_OK || !info.is_req) {
+			return 0;
+		}
+		if (info.addr != _addr && info.addr != ECBM_ADDR_BROADCAST) {
+			return 0;
+		}
+	}
+
+	if (info.addr == _addr) {
+		// Any valid frame at new rate confirms the switch
+		_baud_deadline.reset();
+	}
+	if (info.addr == ECBM_ADDR_BROADCAST) {
+		if (info.typ == ECBM_TYP_WRITE && info.sig == ECBM_SIG_RESET) {
+			reset();
+		}
+		return 0;
+	}
+	if (info.typ == ECBM_TYP_ENCS) {
+		array<uint8_t, 16> key;
+		array<uint8_t, 16> enc_key;
+		for (auto& v : key) {
+			v = (uint8_t)_rng();
+		}
+		raiden_encode(_auth_key.data(), key.data(), enc_key.data(), 16);
+		_session_key.reset();
+		int rc = answer(out, ECBM_TYP_READ, enc_key.data(), enc_key.size(), true);
+		_session_key = key;
+		return rc;
+	}
+	if (!encrypted && info.sig != ECBM_SIG_INFO && info.sig != ECBM_SIG_RESET) {
+		return error(out, ECBM_ERR_MUST_ENC);
+	}
+	if (_in_app && info.sig != ECBM_SIG_INFO && info.sig != ECBM_SIG_RESET) {
+		return error(out, ECBM_ERR_NO_SIG);
+	}
+	if (info.typ == ECBM_TYP_READ) {
+		return handle_read(info.sig, info.payload, info.npayload, out);
+	}
+	return handle_write(info.sig, info.payload, info.npayload, out, busy_us);
+}
+
+int EcbmEmuDevice::handle_read(uint16_t sig, const uint8_t* data, size_t ndata, Framer7b* out) {
+	uint8_t buf[sizeof(EcbmDeviceInfo) + 4];
+	size_t ptr;
+	switch (sig) {
+	case ECBM_SIG_INFO:
+		if (_in_app) {
+			ptr = stdser_sstr(_app_info.name, buf, 32);
+			memcpy(&buf[ptr], _app_info.version, 3);
+			return answer(out, ECBM_TYP_READ, buf, ptr + 3);
+		}
+		ptr = stdser_sstr(_config.name.c_str(), buf, 32);
+		memcpy(&buf[ptr], _config.version.data(), 3);
+		return answer(out, ECBM_TYP_READ, buf, ptr + 3);
+	case ECBM_SIG_BOOT_FW_INFO:
+		ptr = stdser_sstr(_app_info.name, buf, 32);
+		memcpy(&buf[ptr], _app_info.version, 3);
+		return answer(out, ECBM_TYP_READ, buf, ptr + 3);
+	case ECBM_SIG_BOOT_CHECKSUM:
+		if (_app_len == 0 && _config.checksum_needs_app) {
+			return error(out, ECBM_ERR_BOOT_INC_CHECKSUM);
+		}
+		stdser_s32(_app_len == 0 ? 0 : crc32(_flash.data(), _app_len), buf);
+		return answer(out, ECBM_TYP_READ, buf, 4);
+	case ECBM_SIG_BOOT_PROGRESS:
+		if (ndata != 4) {
+			return error(out, ECBM_ERR_INTERNAL);
+		}
+		stdser_s32(_progress_checksum == stdser_g32(data) ? _committed : 0, buf);
+		return answer(out, ECBM_TYP_READ, buf, 4);
+	case ECBM_SIG_BOOT_BLOCK_CRC: {
+		if (ndata != 8) {
+			return error(out, ECBM_ERR_INTERNAL);
+		}
+		size_t block_size = stdser_g16(data);
+		size_t first = stdser_g32(&data[2]);
+		size_t count = stdser_g16(&data[6]);
+		if (block_size == 0 || count > ECBM_MAX_BLOCK_CRCS) {
+			return error(out, ECBM_ERR_INTERNAL);
+		}
+		uint8_t crcs[ECBM_MAX_BLOCK_CRCS * 4];
+		for (size_t i = 0; i < count; i++) {
+			size_t begin = min(_flash.size(), (first + i) * block_size);
+			size_t end = min(_flash.size(), begin + block_size);
+			stdser_s32(crc32(_flash.data() + begin, end - begin), &crcs[i * 4]);
+		}
+		return answer(out, ECBM_TYP_READ, crcs, count * 4);
+	}
+	case ECBM_SIG_BAUD: {
+		uint8_t bauds[ECBM_MAX_BAUDS * 4];
+		size_t n = min<size_t>(_config.bauds.size(), ECBM_MAX_BAUDS);
+		for (size_t i = 0; i < n; i++) {
+			stdser_s32(_config.bauds[i], &bauds[i * 4]);
+		}
+		return answer(out, ECBM_TYP_READ, bauds, n * 4);
+	}
+	default:
+		return error(out, ECBM_ERR_NO_SIG);
+	}
+}
+
+int EcbmEmuDevice::handle_write(uint16_t sig, const uint8_t* data, size_t ndata, Framer7b* out, uint32_t& busy_us) {
+	switch (sig) {
+	case ECBM_SIG_RESET: {
+		int rc = answer(out, ECBM_TYP_WRITE, nullptr, 0);
+		reset();
+		return rc;
+	}
+	case ECBM_SIG_PICK:
+		return answer(out, ECBM_TYP_WRITE, nullptr, 0);
+	case ECBM_SIG_BAUD: {
+		if (ndata != 4) {
+			return error(out, ECBM_ERR_INTERNAL);
+		}
+		uint32_t baud = stdser_g32(data);
+		if (find(_config.bauds.begin(), _config.bauds.end(), baud) == _config.bauds.end()) {
+			return error(out, ECBM_ERR_INTERNAL);
+		}
+		// Answer goes out at current rate
+		int rc = answer(out, ECBM_TYP_WRITE, nullptr, 0);
+		_prev_baud = _baud;
+		_baud = baud;
+		_baud_deadline = chrono::steady_clock::now() + chrono::milliseconds(ECBM_BAUD_CONFIRM_MS);
+		return rc;
+	}
+	case ECBM_SIG_AKEY:
+		if (ndata != 16) {
+			return error(out, ECBM_ERR_INTERNAL);
+		}
+		memcpy(_auth_key.data(), data, 16);
+		return answer(out, ECBM_TYP_WRITE, nullptr, 0);
+	case ECBM_SIG_BOOT_BEGIN: {
+		EcbmDeviceInfo info;
+		memset(&info, 0, sizeof(info));
+		size_t ptr = stdser_gstr(data, info.name, min<size_t>(32, ndata));
+		if (ptr + 19 > ndata) {
+			return error(out, ECBM_ERR_INTERNAL);
+		}
+		memcpy(info.version, &data[ptr], 3);
+		if (_config.fw_key.has_value()) {
+			uint8_t phrase[16];
+			raiden_decode(_config.fw_key->data(), &data[ptr + 3], phrase, 16);
+			for (auto c : phrase) {
+				if (c < 0x20 || c > 0x7E) {
+					return error(out, ECBM_ERR_BOOT_INC_KEY);
+				}
+			}
+		}
+		_lz.reset();
+		_sparse = false;
+		bool keep = false;
+		uint8_t flags = 0;
+		if (ndata > ptr + 19) {
+			if (ndata != ptr + 28) {
+				return error(out, ECBM_ERR_INTERNAL);
+			}
+			flags = data[ptr + 19];
+			// Compressed stream is written in order from scratch, it can not be patched or resumed
+			if ((flags & ~(ECBM_BOOT_FLAG_LZSS | ECBM_BOOT_FLAG_KEEP | ECBM_BOOT_FLAG_RESUME | ECBM_BOOT_FLAG_SPARSE)) != 0 ||
+				((flags & ECBM_BOOT_FLAG_LZSS) && (flags & (ECBM_BOOT_FLAG_KEEP | ECBM_BOOT_FLAG_RESUME | ECBM_BOOT_FLAG_SPARSE)))) {
+				return error(out, ECBM_ERR_INTERNAL);
+			}
+			keep = (flags & ECBM_BOOT_FLAG_KEEP) != 0;
+			_sparse = (flags & ECBM_BOOT_FLAG_SPARSE) != 0;
+			_raw_size = stdser_g32(&data[ptr + 20]);
+			if (_raw_size > _flash.size()) {
+				return error(out, ECBM_ERR_INTERNAL);
+			}
+			if (flags & ECBM_BOOT_FLAG_LZSS) {
+				_lz = make_unique<LzssDecoder>();
+				lzss_decoder_init(_lz.get());
+				_lz_in = 0;
+				_lz_out = 0;
+			}
+		}
+		if (flags & ECBM_BOOT_FLAG_RESUME) {
+			uint32_t checksum = stdser_g32(&data[ptr + 24]);
+			if (_progress_checksum == checksum) {
+				keep = true;
+			}
+			else {
+				_progress_checksum = checksum;
+				_committed = 0;
+			}
+		}
+		else {
+			_progress_checksum.reset();
+			_committed = 0;
+		}
+		if (!keep) {
+			fill(_flash.begin(), _flash.end(), 0xFF);
+			busy_us = _config.erase_us;
+		}
+		_app_len = 0;
+		_app_info = info;
+		_uploading = true;
+		return answer(out, ECBM_TYP_WRITE, nullptr, 0);
+	}
+	case ECBM_SIG_BOOT_WRITE: {
+		if (!_uploading || ndata < 4 || (ndata - 4) % 8 != 0) {
+			return error(out, ECBM_ERR_INTERNAL);
+		}
+		uint32_t offset = stdser_g32(data);
+		size_t n = ndata - 4;
+		// Power loss in the middle of upload
+		if (_config.reset_at != 0 && !_was_reset_at && offset >= _config.reset_at) {
+			_was_reset_at = true;
+			reset();
+			return 0;
+		}
+		if (_lz) {
+			return handle_lz_block(offset, &data[4], n, out, busy_us);
+		}
+		if ((size_t)offset + n > _flash.size()) {
+			return error(out, ECBM_ERR_INTERNAL);
+		}
+		memcpy(&_flash[offset], &data[4], n);
+		if (_config.fw_key.has_value()) {
+			raiden_decode_buf(_config.fw_key->data(), &_flash[offset], n);
+		}
+		// Gaps of sparse upload are erased filler, so they count as written
+		if (_progress_checksum.has_value() && (offset <= _committed || _sparse) && offset + n > _committed) {
+			_committed = offset + (uint32_t)n;
+		}
+		busy_us = (uint32_t)((uint64_t)_config.program_us * ((n + _config.program_block - 1) / _config.program_block));
+		return answer(out, ECBM_TYP_WRITE, nullptr, 0);
+	}
+	case ECBM_SIG_BOOT_END: {
+		if (!_uploading || ndata != 8) {
+			return error(out, ECBM_ERR_INTERNAL);
+		}
+		uint32_t checksum = stdser_g32(data);
+		uint32_t len = stdser_g32(&data[4]);
+		if (len > _flash.size()) {
+			return error(out, ECBM_ERR_INTERNAL);
+		}
+		_uploading = false;
+		_progress_checksum.reset();
+		_committed = 0;
+		if (_config.fw_key.has_value() && crc32(_flash.data(), len) != checksum) {
+			_app_len = 0;
+			memset(&_app_info, 0, sizeof(_app_info));
+			return error(out, ECBM_ERR_BOOT_INC_CHECKSUM);
+		}
+		_app_len = len;
+		_in_app = _config.start_app;
+		if (_in_app) {
+			// App starts at default rate, the answer is queued already
+			_baud = _config.baud;
+			_baud_deadline.reset();
+		}
+		return answer(out, ECBM_TYP_WRITE, nullptr, 0);
+	}
+	default:
+		return error(out, ECBM_ERR_NO_SIG);
+	}
+}
+
+int EcbmEmuDevice::handle_lz_block(uint32_t offset, const uint8_t* data, size_t ndata, Framer7b* out, uint32_t& busy_us) {
+	if ((size_t)offset + ndata <= _lz_in) {
+		// Resent after lost answer, already programmed
+		return answer(out, ECBM_TYP_WRITE, nullptr, 0);
+	}
+	if (offset != _lz_in) {
+		return error(out, ECBM_ERR_INTERNAL);
+	}
+	if (!_config.fw_key.has_value()) {
+		// Stream can not be decoded without key, only accepted
+		_lz_in += (uint32_t)ndata;
+		return answer(out, ECBM_TYP_WRITE, nullptr, 0);
+	}
+	vector<uint8_t> block(data, data + ndata);
+	raiden_decode_buf(_config.fw_key->data(), block.data(), block.size());
+	int n = lzss_decode_push(_lz.get(), block.data(), block.size(), _flash.data() + _lz_out, _raw_size - _lz_out);
+	if (n < 0) {
+		return error(out, ECBM_ERR_INTERNAL);
+	}
+	_lz_in += (uint32_t)ndata;
+	_lz_out += (uint32_t)n;
+	busy_us = (uint32_t)((uint64_t)_config.program_us * ((n + _config.program_block - 1) / _config.program_block));
+	return answer(out, ECBM_TYP_WRITE, nullptr, 0);
+}
+
+static int _emu_write(size_t id, const uint8_t* data, size_t ndata) {
+	((EcbmEmu*)id)->host_write(data, ndata);
+	return 0;
+}
+
+static int _emu_read(size_t id, uint8_t* buf, size_t bufsize) {
+	return ((EcbmEmu*)id)->host_read(buf, bufsize);
+}
+
+static int _emu_set_baud(size_t id, uint32_t baud) {
+	((EcbmEmu*)id)->host_set_baud(baud);
+	return 0;
+}
+
+static void _emu_sleep_ms(uint32_t ms) {
+	this_thread::sleep_for(chrono::milliseconds(ms));
+}
+
+static uint32_t _emu_clock_us() {
+	return (uint32_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+EcbmEmu::EcbmEmu(const EcbmEmuConfig& config) : _config(config), _rx_framer(make_unique<Framer7b>()), _tx_framer(make_unique<Framer7b>()) {
+	framer7b_init(_rx_framer.get());
+	framer7b_init(_tx_framer.get());
+	for (auto addr : _config.addrs) {
+		if (addr == ECBM_ADDR_BROADCAST) {
+			throw runtime_error("emulated device can not have broadcast address");
+		}
+		_devices.push_back(make_unique<EcbmEmuDevice>(addr, _config));
+	}
+}
+
+void EcbmEmu::attach(Ecbm* ecbm) {
+	// Ecbm id is handed back to callbacks, use it to find the emulator
+	ecbm_init(ecbm, (size_t)this, _emu_write, _emu_read, _emu_sleep_ms);
+	ecbm_set_clock(ecbm, _emu_clock_us);
+	_bus_baud = _config.baud;
+	ecbm_set_baud_cb(ecbm, _emu_set_baud, _config.baud);
+}
+
+void EcbmEmu::host_set_baud(uint32_t baud) {
+	_bus_baud = baud;
+}
+
+EcbmEmuDevice* EcbmEmu::device(uint8_t addr) {
+	for (auto& d : _devices) {
+		if (d->addr() == addr) {
+			return d.get();
+		}
+	}
+	return nullptr;
+}
+
+chrono::microseconds EcbmEmu::wire_time(size_t nbytes) const {
+	uint32_t baud = _bus_baud.value_or(_config.baud);
+	if (baud == 0) {
+		return chrono::microseconds(0);
+	}
+	// 8N1: ten bit times per byte
+	return chrono::microseconds((uint64_t)nbytes * 10 * 1000000 / baud);
+}
+
+int EcbmEmu::dispatch(const uint8_t* frame, size_t nframe, uint32_t& busy_us) {
+	int rc = 0;
+	busy_us = 0;
+	for (auto& d : _devices) {
+		d->poll();
+		if (_bus_baud.has_value() && d->baud() != _bus_baud.value()) {
+			continue;
+		}
+		uint32_t dev_busy_us = 0;
+		int n = d->handle(frame, nframe, _tx_framer.get(), dev_busy_us);
+		if (n > 0) {
+			rc = n;
+			busy_us = dev_busy_us;
+		}
+	}
+	return rc;
+}
+
+void EcbmEmu::host_write(const uint8_t* data, size_t ndata) {
+	auto t = chrono::steady_clock::now();
+	if (!_to_host.empty() && _to_host.back().first > t) {
+		t = _to_host.back().first;
+	}
+	for (size_t i = 0; i < ndata; i++) {
+		int rc = framer7b_push(_rx_framer.get(), data[i]);
+		if (rc <= 0) {
+			continue;
+		}
+		uint32_t busy_us;
+		int n = dispatch(framer7b_get_read_buf(_rx_framer.get()), rc, busy_us);
+		if (n <= 0) {
+			continue;
+		}
+		t += wire_time(i + 1) + chrono::microseconds(busy_us);
+		auto byte_time = wire_time(1);
+		const uint8_t* answ = framer7b_get_send_buf(_tx_framer.get());
+		for (int j = 0; j < n; j++) {
+			t += byte_time;
+			_to_host.emplace_back(t, answ[j]);
+		}
+	}
+}
+
+int EcbmEmu::host_read(uint8_t* buf, size_t bufsize) {
+	auto now = chrono::steady_clock::now();
+	size_t n = 0;
+	while (n < bufsize && !_to_host.empty() && _to_host.front().first <= now) {
+		buf[n++] = _to_host.front().second;
+		_to_host.pop_front();
+	}
+	return (int)n;
+}
+
+int EcbmEmu::run_pty(bool verbose) {
+#ifdef __linux
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+		throw runtime_error("fail to open pty");
+	}
+	struct termios tty;
+	if (tcgetattr(fd, &tty) == 0) {
+		cfmakeraw(&tty);
+		tcsetattr(fd, TCSANOW, &tty);
+	}
+	cout << "emulated bus on " << ptsname(fd) << ", addresses:";
+	for (auto& d : _devices) {
+		cout << " " << (int)d->addr();
+	}
+	cout << endl;
+	uint8_t buf[256];
+	while (true) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		if (poll(&pfd, 1, 1000) <= 0) {
+			continue;
+		}
+		auto nread = read(fd, buf, sizeof(buf));
+		if (nread <= 0) {
+			// No one holds the slave side yet
+			this_thread::sleep_for(chrono::milliseconds(10));
+			continue;
+		}
+		for (ssize_t i = 0; i < nread; i++) {
+			int rc = framer7b_push(_rx_framer.get(), buf[i]);
+			if (rc <= 0) {
+				continue;
+			}
+			uint32_t busy_us;
+			int n = dispatch(framer7b_get_read_buf(_rx_framer.get()), rc, busy_us);
+			if (verbose) {
+				cout << "frame " << rc << " bytes, answer " << n << " bytes" << endl;
+			}
+			if (n <= 0) {
+				continue;
+			}
+			this_thread::sleep_for(chrono::microseconds(busy_us));
+			if (write(fd, framer7b_get_send_buf(_tx_framer.get()), n) != n) {
+				throw runtime_error("fail to write pty");
+			}
+		}
+	}
+#else
+	throw runtime_error("pty emulation is supported on Linux only");
+#endif
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "ecbm.h"
+#include "framer7b.h"
+#include "lzss.h"
+
+#include <cstdlib>
+#include <cstdint>
+#include <array>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+struct EcbmEmuConfig {
+	std::vector<uint8_t> addrs = { 1 };
+	std::array<uint8_t, 16> auth_key = {};
+	// Key the firmware was encrypted with; without it blocks are stored as is and checksum is not verified
+	std::optional<std::array<uint8_t, 16>> fw_key;
+	std::string name = "ecbm-emu";
+	std::array<uint8_t, 3> version = { 1, 0, 0 };
+	size_t flash_size = 1024 * 1024;
+	uint32_t erase_us = 0;
+	uint32_t program_us = 0;		// per program_block bytes
+	size_t program_block = 256;
+	uint32_t baud = 115200;			// wire time of simulated uart, 0 - instant
+	std::vector<uint32_t> bauds = { 115200, 230400, 460800, 921600 };	// rates accepted by ECBM_SIG_BAUD
+	uint32_t boot_ms = 0;			// device is deaf that long after reset
+	size_t max_frame = ECBM_MAX_FRAME;	// longer frames are dropped, like by a small device buffer
+	bool checksum_needs_app = false;	// checksum read is refused while flash holds no complete image
+	uint32_t reset_at = 0;			// device resets once, unanswered, on firmware write at this offset or past it; 0 - never
+	// Bootloader starts the app after successful upload; app answers ECBM_SIG_INFO,
+	// sessions and reset only, reset brings bootloader back
+	bool start_app = false;
+};
+
+/* Bootloader side of ECBM for one bus address, holds simulated flash
+ */
+class EcbmEmuDevice
+{
+public:
+	EcbmEmuDevice(uint8_t addr, const EcbmEmuConfig& config);
+
+	// Handle decoded frame, returns answer in framer send buffer (0 - no answer) and sets processing time
+	int handle(const uint8_t* frame, size_t nframe, Framer7b* out, uint32_t& busy_us);
+	void reset();
+	// Drops unconfirmed baud switch after ECBM_BAUD_CONFIRM_MS
+	void poll();
+
+	uint8_t addr() const;
+	uint32_t baud() const;
+	const std::vector<uint8_t>& flash() const;
+
+private:
+	uint8_t _addr;
+	const EcbmEmuConfig& _config;
+	std::array<uint8_t, 16> _auth_key;
+	std::optional<std::array<uint8_t, 16>> _session_key;
+	std::vector<uint8_t> _flash;
+	EcbmDeviceInfo _app_info;
+	uint32_t _app_len = 0;
+	bool _uploading = false;
+	bool _sparse = false;
+	// Compressed upload: decoder state, stream bytes consumed and flash bytes produced
+	std::unique_ptr<LzssDecoder> _lz;
+	uint32_t _lz_in = 0;
+	uint32_t _lz_out = 0;
+	uint32_t _raw_size = 0;
+	// Resumable upload, kept over reset like bootloader keeps it in flash
+	std::optional<uint32_t> _progress_checksum;
+	uint32_t _committed = 0;
+	uint32_t _baud;
+	uint32_t _prev_baud;
+	std::optional<std::chrono::steady_clock::time_point> _baud_deadline;
+	std::optional<std::chrono::steady_clock::time_point> _boot_deadline;
+	bool _in_app = false;
+	bool _was_reset_at = false;
+	std::minstd_rand _rng;
+
+	int answer(Framer7b* out, uint8_t typ, const uint8_t* data, size_t ndata, bool plain = false);
+	int error(Framer7b* out, int err);
+	int handle_write(uint16_t sig, const uint8_t* data, size_t ndata, Framer7b* out, uint32_t& busy_us);
+	int handle_read(uint16_t sig, const uint8_t* data, size_t ndata, Framer7b* out);
+	int handle_lz_block(uint32_t offset, const uint8_t* data, size_t ndata, Framer7b* out, uint32_t& busy_us);
+};
+
+/* Simulated bus with one or more devices.
+ * attach() connects an Ecbm through in-memory callbacks, answers become readable
+ * after device processing time plus uart wire time. run_pty() serves a Linux PTY instead.
+ */
+class EcbmEmu
+{
+public:
+	EcbmEmu(const EcbmEmuConfig& config);
+
+	void attach(Ecbm* ecbm);
+	void host_write(const uint8_t* data, size_t ndata);
+	void host_set_baud(uint32_t baud);
+	int host_read(uint8_t* buf, size_t bufsize);
+	int run_pty(bool verbose);
+
+	EcbmEmuDevice* device(uint8_t addr);
+
+private:
+	EcbmEmuConfig _config;
+	std::vector<std::unique_ptr<EcbmEmuDevice>> _devices;
+	std::unique_ptr<Framer7b> _rx_framer;
+	std::unique_ptr<Framer7b> _tx_framer;
+	// Host side rate, devices at other rate do not see frames; not tracked on pty
+	std::optional<uint32_t> _bus_baud;
+	std::deque<std::pair<std::chrono::steady_clock::time_point, uint8_t>> _to_host;
+
+	// Returns answer length in _tx_framer send buffer
+	int dispatch(const uint8_t* frame, size_t nframe, uint32_t& busy_us);
+	std::chrono::microseconds wire_time(size_t nbytes) const;
+};
@@ -0,0 +1,120 @@
+#include "EcbmReport.hpp"
+#include "ecbm.h"
+
+#include <ostream>
+#include <string>
+#include <memory>
+
+using namespace std;
+
+static string sig_label(size_t sig) {
+	if (sig == ECBM_STATS_MAX_SIG) {
+		return ">=" + to_string(ECBM_STATS_MAX_SIG);
+	}
+	auto name = ecbm_sig_name((uint16_t)sig);
+	return name != nullptr ? string(name) : to_string(sig);
+}
+
+static void print_counters(ostream& out, const EcbmCounters& c) {
+	out << "frames tx/rx: " << c.frames_tx << "/" << c.frames_rx;
+	out << ", bytes tx/rx: " << c.bytes_tx << "/" << c.bytes_rx;
+	out << ", integrity: " << c.integrity_errs;
+	out << ", timeouts: " << c.timeouts;
+	out << ", resyncs: " << c.resyncs;
+	out << ", device errors: " << c.dev_errs;
+	if (c.dev_errs > 0) {
+		out << " (last " << c.last_dev_err << ")";
+	}
+	out << endl;
+}
+
+static void json_counters(ostream& out, const EcbmCounters& c) {
+	out << "{\"frames_tx\": " << c.frames_tx << ", \"frames_rx\": " << c.frames_rx;
+	out << ", \"bytes_tx\": " << c.bytes_tx << ", \"bytes_rx\": " << c.bytes_rx;
+	out << ", \"integrity_errs\": " << c.integrity_errs << ", \"timeouts\": " << c.timeouts;
+	out << ", \"resyncs\": " << c.resyncs << ", \"dev_errs\": " << c.dev_errs;
+	out << ", \"last_dev_err\": " << c.last_dev_err << "}";
+}
+
+void print_ecbm_stats(ostream& out, const Ecbm* ecbm) {
+	// EcbmStats holds histograms for every sig, too big for the stack
+	auto stats = make_unique<EcbmStats>();
+	if (ecbm_stats_snapshot(ecbm, stats.get()) != ECBM_OK) {
+		out << "ecbm stats are disabled" << endl;
+		return;
+	}
+	out << "bus: ";
+	print_counters(out, stats->bus);
+	for (size_t i = 0; i < ECBM_MAX_PEERS; i++) {
+		EcbmCounters c;
+		auto addr = ecbm->peers[i].addr;
+		if (addr != 0 && ecbm_peer_stats_snapshot(ecbm, addr, &c) == ECBM_OK) {
+			out << "addr " << (int)addr << ": ";
+			print_counters(out, c);
+		}
+	}
+	for (size_t i = 0; i < 256; i++) {
+		if (stats->dev_err_codes[i] > 0) {
+			out << "device error " << -(int)i << ": " << stats->dev_err_codes[i] << endl;
+		}
+	}
+	for (size_t i = 0; i <= ECBM_STATS_MAX_SIG; i++) {
+		const auto& h = stats->latency[i];
+		if (h.count == 0) {
+			continue;
+		}
+		out << "latency " << sig_label(i) << ": n " << h.count;
+		out << ", mean " << h.sum_us / h.count << " us";
+		out << ", p50 " << ecbm_hist_percentile(&h, 500) << " us";
+		out << ", p99 " << ecbm_hist_percentile(&h, 990) << " us";
+		out << ", max " << h.max_us << " us" << endl;
+	}
+}
+
+void write_ecbm_stats_json(ostream& out, const Ecbm* ecbm) {
+	auto stats = make_unique<EcbmStats>();
+	ecbm_stats_snapshot(ecbm, stats.get());
+	out << "{\n\t\"bus\": ";
+	json_counters(out, stats->bus);
+	out << ",\n\t\"peers\": {";
+	bool first = true;
+	for (size_t i = 0; i < ECBM_MAX_PEERS; i++) {
+		EcbmCounters c;
+		auto addr = ecbm->peers[i].addr;
+		if (addr != 0 && ecbm_peer_stats_snapshot(ecbm, addr, &c) == ECBM_OK) {
+			out << (first ? "\n\t\t\"" : ",\n\t\t\"") << (int)addr << "\": ";
+			json_counters(out, c);
+			first = false;
+		}
+	}
+	out << "\n\t},\n\t\"dev_err_codes\": {";
+	first = true;
+	for (size_t i = 0; i < 256; i++) {
+		if (stats->dev_err_codes[i] > 0) {
+			out << (first ? "" : ", ") << "\"" << -(int)i << "\": " << stats->dev_err_codes[i];
+			first = false;
+		}
+	}
+	out << "},\n\t\"latency_us\": {";
+	first = true;
+	for (size_t i = 0; i <= ECBM_STATS_MAX_SIG; i++) {
+		const auto& h = stats->latency[i];
+		if (h.count == 0) {
+			continue;
+		}
+		out << (first ? "\n\t\t\"" : ",\n\t\t\"") << sig_label(i) << "\": {";
+		out << "\"count\": " << h.count << ", \"sum\": " << h.sum_us << ", \"max\": " << h.max_us;
+		out << ", \"p50\": " << ecbm_hist_percentile(&h, 500) << ", \"p90\": " << ecbm_hist_percentile(&h, 900);
+		out << ", \"p99\": " << ecbm_hist_percentile(&h, 990) << ", \"buckets\": [";
+		bool first_bucket = true;
+		for (size_t b = 0; b < ECBM_HIST_BUCKETS; b++) {
+			if (h.buckets[b] > 0) {
+				out << (first_bucket ? "" : ", ") << "[" << ecbm_hist_bucket_value(b) << ", " << h.buckets[b] << "]";
+				first_bucket = false;
+			}
+		}
+		out << "]}";
+		first = false;
+	}
+	out << "\n\t}\n}" << endl;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "ecbm.h"
+
+#include <ostream>
+
+void print_ecbm_stats(std::ostream& out, const Ecbm* ecbm);
+void write_ecbm_stats_json(std::ostream& out, const Ecbm* ecbm);
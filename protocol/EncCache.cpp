@@ -0,0 +1,161 @@
+#include "EncCache.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__MINGW32__) || defined(_WIN32)
+#include <process.h>
+#define _cache_getpid	_getpid
+#else
+#include <unistd.h>
+#define _cache_getpid	getpid
+#endif
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// Artifact lands in place of path, existing file is unlinked so its other links stay intact
+static void _cache_place(const fs::path& from, const fs::path& to) {
+	error_code ec;
+	fs::remove(to, ec);
+	fs::create_hard_link(from, to, ec);
+	if (ec) {
+		fs::copy_file(from, to, fs::copy_options::overwrite_existing);
+	}
+}
+
+// Temporary name of path unique to this process and call, cache dir may be shared by processes
+static string _cache_tmp(const string& path) {
+	static atomic<unsigned> counter = 0;
+	return path + "." + to_string(_cache_getpid()) + "." + to_string(counter++) + ".tmp";
+}
+
+EncCache::EncCache(const string& dir, size_t max_bytes) : _dir(dir), _max_bytes(max_bytes) {
+	fs::create_directories(fs::path(_dir) / "objects");
+	bool indexed = merge_index();
+	if (!indexed) {
+		for (auto& file : fs::directory_iterator(fs::path(_dir) / "objects")) {
+			if (file.path().extension() == ".enc") {
+				_entries[file.path().stem().string()] = { (size_t)file.file_size(), 0 };
+			}
+		}
+	}
+	// Cap may be lower than in previous run
+	if (evict() || !indexed) {
+		save();
+	}
+}
+
+bool EncCache::fetch(const string& hash, const string& path) {
+	lock_guard<mutex> guard(_lock);
+	auto it = _entries.find(hash);
+	if (it == _entries.end()) {
+		// Stored by another process whose index save lost the race
+		error_code ec;
+		auto size = fs::file_size(object_path(hash), ec);
+		if (ec) {
+			return false;
+		}
+		it = _entries.emplace(hash, Entry{ (size_t)size, 0 }).first;
+	}
+	try {
+		_cache_place(object_path(hash), path);
+	}
+	catch (const fs::filesystem_error&) {
+		// Object removed behind our back
+		_entries.erase(it);
+		save();
+		return false;
+	}
+	it->second.tick = ++_tick;
+	save();
+	return true;
+}
+
+void EncCache::store(const string& hash, const string& path) {
+	lock_guard<mutex> guard(_lock);
+	auto object = object_path(hash);
+	auto tmp = _cache_tmp(object);
+	_cache_place(path, tmp);
+	fs::rename(tmp, object);
+	_entries[hash] = { (size_t)fs::file_size(object), ++_tick };
+	evict();
+	save();
+}
+
+size_t EncCache::size() const {
+	lock_guard<mutex> guard(_lock);
+	size_t total = 0;
+	for (const auto& [hash, entry] : _entries) {
+		total += entry.size;
+	}
+	return total;
+}
+
+string EncCache::object_path(const string& hash) const {
+	return (fs::path(_dir) / "objects" / (hash + ".enc")).string();
+}
+
+bool EncCache::evict() {
+	bool evicted = false;
+	size_t total = 0;
+	for (const auto& [hash, entry] : _entries) {
+		total += entry.size;
+	}
+	while (total > _max_bytes && _entries.size() > 1) {
+		auto oldest = _entries.begin();
+		for (auto it = _entries.begin(); it != _entries.end(); it++) {
+			if (it->second.tick < oldest->second.tick) {
+				oldest = it;
+			}
+		}
+		error_code ec;
+		fs::remove(object_path(oldest->first), ec);
+		total -= oldest->second.size;
+		_entries.erase(oldest);
+		evicted = true;
+	}
+	return evicted;
+}
+
+bool EncCache::merge_index() {
+	ifstream in((fs::path(_dir) / "index").string());
+	if (!in.is_open()) {
+		return false;
+	}
+	string hash;
+	Entry entry;
+	while (in >> hash >> entry.size >> entry.tick) {
+		if (_entries.count(hash) == 0 && fs::exists(object_path(hash))) {
+			_entries[hash] = entry;
+			_tick = max(_tick, entry.tick);
+		}
+	}
+	return true;
+}
+
+void EncCache::save() {
+	// Objects stored by other processes since our index was read
+	merge_index();
+	auto path = (fs::path(_dir) / "index").string();
+	string tmp_path = _cache_tmp(path);
+	{
+		ofstream out(tmp_path, ios_base::trunc);
+		for (const auto& [hash, entry] : _entries) {
+			out << hash << " " << entry.size << " " << entry.tick << "\n";
+		}
+		if (!out) {
+			throw runtime_error("fail to write cache index: " + tmp_path);
+		}
+	}
+#if defined(__MINGW32__) || defined(_WIN32)
+	// rename does not replace existing file there
+	std::remove(path.c_str());
+#endif
+	if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+		throw runtime_error("fail to replace cache index: " + path);
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+/* Content addressed store of encrypted artifacts, "<dir>/objects/<hash>.enc".
+ * "<dir>/index" holds "<hash> <size> <tick>" lines, tick orders entries by last use
+ * and least recently used ones are evicted above max_bytes. Index is replaced
+ * atomically and rebuilt from objects when missing. Methods are thread safe;
+ * processes sharing the dir use unique temporary names and merge entries of
+ * each other's index on save.
+ */
+class EncCache
+{
+public:
+	EncCache(const std::string& dir, size_t max_bytes);
+
+	// Hard link (copy when linking fails) cached artifact to path, false on miss
+	bool fetch(const std::string& hash, const std::string& path);
+	void store(const std::string& hash, const std::string& path);
+
+	size_t size() const;
+
+private:
+	struct Entry {
+		size_t size;
+		uint64_t tick;
+	};
+
+	std::string _dir;
+	size_t _max_bytes;
+	std::map<std::string, Entry> _entries;
+	uint64_t _tick = 0;
+	mutable std::mutex _lock;
+
+	std::string object_path(const std::string& hash) const;
+	bool evict();
+	// Adds entries of index file with existing objects, false when there is no index
+	bool merge_index();
+	void save();
+};
@@ -0,0 +1,161 @@
+#include "FileIo.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#if defined(__MINGW32__) || defined(_WIN32)
+#include <windows.h>
+#include <io.h>
+#define _fio_open(path, flags, mode)	_open(path, (flags) | _O_BINARY, mode)
+#define _fio_write						_write
+#define _fio_read						_read
+#define _fio_lseek						_lseeki64
+#define _fio_close						::_close
+#define _fio_unlink						::_unlink
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#define _fio_open						::open
+#define _fio_write						::write
+#define _fio_read						::read
+#define _fio_lseek						::lseek
+#define _fio_close						::close
+#define _fio_unlink						::unlink
+#endif
+
+using namespace std;
+
+MappedFile::MappedFile(const string& path) : _path(path) {
+	int fd = _fio_open(path.c_str(), O_RDONLY, 0);
+	if (fd < 0) {
+		throw runtime_error("fail to open file '" + path + "'");
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		_fio_close(fd);
+		throw runtime_error("fail to stat file '" + path + "'");
+	}
+	_size = (size_t)st.st_size;
+	_mtime = (int64_t)st.st_mtime;
+	#if defined(__MINGW32__) || defined(_WIN32)
+	if (_size > 0) {
+		_mapping = CreateFileMappingA((HANDLE)_get_osfhandle(fd), NULL, PAGE_READONLY, 0, 0, NULL);
+		if (_mapping != NULL) {
+			_data = (const uint8_t*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+			if (_data == nullptr) {
+				CloseHandle(_mapping);
+				_mapping = nullptr;
+			}
+		}
+	}
+	#else
+	if (_size > 0) {
+		void* map = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, _size, MADV_SEQUENTIAL);
+			_data = (const uint8_t*)map;
+		}
+	}
+	#endif
+	if (_data == nullptr) {
+		_fallback.resize(_size);
+		size_t nread = 0;
+		while (nread < _size) {
+			auto n = _fio_read(fd, &_fallback[nread], (unsigned)min<size_t>(_size - nread, 1 << 30));
+			if (n <= 0) {
+				break;
+			}
+			nread += (size_t)n;
+		}
+		if (nread != _size) {
+			_fio_close(fd);
+			throw runtime_error("fail to read file '" + path + "'");
+		}
+		_data = _fallback.data();
+	}
+	_fio_close(fd);
+}
+
+MappedFile::~MappedFile() {
+	if (_fallback.empty() && _data != nullptr) {
+		#if defined(__MINGW32__) || defined(_WIN32)
+		UnmapViewOfFile(_data);
+		CloseHandle(_mapping);
+		#else
+		munmap((void*)_data, _size);
+		#endif
+	}
+}
+
+span<const uint8_t> MappedFile::data() const {
+	return { _data, _size };
+}
+
+size_t MappedFile::size() const {
+	return _size;
+}
+
+bool MappedFile::changed() const {
+	struct stat st;
+	if (stat(_path.c_str(), &st) != 0) {
+		return true;
+	}
+	return (size_t)st.st_size != _size || (int64_t)st.st_mtime != _mtime;
+}
+
+OutputFile::OutputFile(const string& path) : _path(path) {
+	// Replace instead of truncate, hard links to old file keep their content
+	_fio_unlink(path.c_str());
+	_fd = _fio_open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (_fd < 0) {
+		throw runtime_error("fail to create file '" + path + "'");
+	}
+}
+
+OutputFile::~OutputFile() {
+	if (_fd >= 0) {
+		_fio_close(_fd);
+	}
+}
+
+void OutputFile::close() {
+	int fd = _fd;
+	_fd = -1;
+	if (fd >= 0 && _fio_close(fd) != 0) {
+		throw runtime_error("fail to write file '" + _path + "'");
+	}
+}
+
+streamsize OutputFile::xsputn(const char* data, streamsize ndata) {
+	streamsize nwritten = 0;
+	while (nwritten < ndata) {
+		auto n = _fio_write(_fd, data + nwritten, (unsigned)min<streamsize>(ndata - nwritten, 1 << 30));
+		if (n <= 0) {
+			break;
+		}
+		nwritten += n;
+	}
+	return nwritten;
+}
+
+OutputFile::int_type OutputFile::overflow(int_type c) {
+	if (traits_type::eq_int_type(c, traits_type::eof())) {
+		return traits_type::not_eof(c);
+	}
+	char ch = traits_type::to_char_type(c);
+	return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+}
+
+OutputFile::pos_type OutputFile::seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which) {
+	if (!(which & ios_base::out)) {
+		return pos_type(off_type(-1));
+	}
+	int whence = dir == ios_base::beg ? SEEK_SET : dir == ios_base::cur ? SEEK_CUR : SEEK_END;
+	return pos_type(off_type(_fio_lseek(_fd, off, whence)));
+}
+
+OutputFile::pos_type OutputFile::seekpos(pos_type pos, ios_base::openmode which) {
+	return seekoff(off_type(pos), ios_base::beg, which);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <span>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+/* Read-only view of whole file. Mapped with sequential read-ahead hint,
+ * files that can not be mapped are read into memory and checked against their size.
+ * Mapping is not a snapshot: a file truncated under it faults on access, so writers
+ * of the file must replace it, and readers check changed() after use.
+ */
+class MappedFile
+{
+public:
+	MappedFile(const std::string& path);
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	std::span<const uint8_t> data() const;
+	size_t size() const;
+	// File on disk differs in size or modification time from the time it was opened
+	bool changed() const;
+
+private:
+	std::string _path;
+	const uint8_t* _data = nullptr;
+	size_t _size = 0;
+	int64_t _mtime = 0;
+	std::vector<uint8_t> _fallback;
+	#if defined(__MINGW32__) || defined(_WIN32)
+	void* _mapping = nullptr;
+	#endif
+};
+
+/* Unbuffered output file for std::ostream, every write() is one system call
+ * with caller's buffer, seeking is supported for patching headers.
+ * Existing file is unlinked, not truncated.
+ * close() reports errors which destructor would lose.
+ */
+class OutputFile : public std::streambuf
+{
+public:
+	OutputFile(const std::string& path);
+	~OutputFile();
+	OutputFile(const OutputFile&) = delete;
+	OutputFile& operator=(const OutputFile&) = delete;
+
+	void close();
+
+protected:
+	std::streamsize xsputn(const char* data, std::streamsize ndata) override;
+	int_type overflow(int_type c) override;
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+	int _fd = -1;
+	std::string _path;
+};
@@ -0,0 +1,245 @@
+#include "FirmwareContainer.hpp"
+#include "crc32.h"
+#include "stdser.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+static void _fwc_put_header(const FirmwareContainerHeader& header, uint8_t* buf) {
+	memset(buf, 0, FWC_HEADER_SIZE);
+	memcpy(buf, FWC_MAGIC, 4);
+	stdser_s32(header.meta_offset, &buf[4]);
+	stdser_s32(header.meta_size, &buf[8]);
+	stdser_s32(header.table_offset, &buf[12]);
+	stdser_s32(header.chunk_size, &buf[16]);
+	stdser_s32(header.nchunks, &buf[20]);
+	stdser_s32(header.payload_offset, &buf[24]);
+	stdser_s32(header.payload_size, &buf[28]);
+	stdser_s16(header.version, &buf[32]);
+}
+
+static FirmwareContainerHeader _fwc_get_header(const uint8_t* buf) {
+	FirmwareContainerHeader header;
+	header.meta_offset = stdser_g32(&buf[4]);
+	header.meta_size = stdser_g32(&buf[8]);
+	header.table_offset = stdser_g32(&buf[12]);
+	header.chunk_size = stdser_g32(&buf[16]);
+	header.nchunks = stdser_g32(&buf[20]);
+	header.payload_offset = stdser_g32(&buf[24]);
+	header.payload_size = stdser_g32(&buf[28]);
+	header.version = stdser_g16(&buf[32]);
+	return header;
+}
+
+static uint32_t _fwc_index_crc(const uint8_t* header, span<const uint8_t> meta, span<const uint8_t> table) {
+	auto crc = crc32(header, FWC_HEADER_SIZE - 4);
+	crc = crc32_update(crc, meta.data(), meta.size());
+	return crc32_update(crc, table.data(), table.size());
+}
+
+// Layout sanity against file size, table and payload are checked by index crc and chunk crcs
+static void _fwc_check_header(const FirmwareContainerHeader& header, size_t file_size) {
+	if (header.version != FWC_VERSION) {
+		throw runtime_error("unsupported firmware container version " + to_string(header.version));
+	}
+	if (header.chunk_size == 0
+		|| header.nchunks != (header.payload_size + (uint64_t)header.chunk_size - 1) / header.chunk_size
+		|| (uint64_t)header.meta_offset + header.meta_size > file_size
+		|| (uint64_t)header.table_offset + (uint64_t)header.nchunks * 4 > file_size
+		|| (uint64_t)header.payload_offset + header.payload_size > file_size) {
+		throw runtime_error("firmware container header is corrupted");
+	}
+}
+
+static FirmwareFile _fwc_unpack_meta(span<const uint8_t> meta) {
+	error_code ec;
+	auto fw = msgpack::unpack<FirmwareFile>(meta.data(), meta.size(), ec);
+	if (ec) {
+		throw runtime_error("firmware metadata is corrupted");
+	}
+	return fw;
+}
+
+// Index of first chunk with wrong crc, chunks are split between threads
+static optional<size_t> _fwc_find_bad_chunk(span<const uint8_t> payload, const FirmwareContainerHeader& header, span<const uint8_t> table, size_t nthreads) {
+	if (nthreads == 0) {
+		nthreads = max(thread::hardware_concurrency(), 1u);
+	}
+	nthreads = min<size_t>(nthreads, header.nchunks);
+	atomic<size_t> bad = SIZE_MAX;
+	auto check = [&](size_t first, size_t last) {
+		for (size_t i = first; i < last && bad.load() == SIZE_MAX; i++) {
+			size_t offset = i * header.chunk_size;
+			size_t n = min<size_t>(header.chunk_size, payload.size() - offset);
+			if (crc32(&payload[offset], n) != stdser_g32(&table[i * 4])) {
+				size_t prev = SIZE_MAX;
+				while (i < prev && !bad.compare_exchange_weak(prev, i)) {}
+				return;
+			}
+		}
+	};
+	if (nthreads <= 1) {
+		check(0, header.nchunks);
+	}
+	else {
+		vector<thread> workers;
+		for (size_t t = 0; t < nthreads; t++) {
+			workers.emplace_back(check, t * header.nchunks / nthreads, (t + 1) * header.nchunks / nthreads);
+		}
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	}
+	if (bad.load() == SIZE_MAX) {
+		return nullopt;
+	}
+	return bad.load();
+}
+
+FirmwareContainerWriter::FirmwareContainerWriter(ostream& out, const FirmwareFile& meta, size_t payload_size, int version) :
+	_out(out), _meta(meta), _version(version), _v1(out) {
+	_meta.data = {};
+	if (payload_size > UINT32_MAX) {
+		throw runtime_error("firmware is too large");
+	}
+	_header.payload_size = (uint32_t)payload_size;
+	if (_version == 1) {
+		_meta.pack_head(_v1);
+		_v1.bin_header(payload_size);
+		return;
+	}
+	if (_version != FWC_VERSION) {
+		throw runtime_error("unsupported firmware container version " + to_string(_version));
+	}
+	_meta_bytes = msgpack::pack(_meta);
+	_header.nchunks = (uint32_t)((payload_size + FWC_CHUNK_SIZE - 1) / FWC_CHUNK_SIZE);
+	_header.meta_offset = FWC_HEADER_SIZE;
+	_header.meta_size = (uint32_t)_meta_bytes.size();
+	_header.table_offset = _header.meta_offset + _header.meta_size;
+	size_t table_end = _header.table_offset + (size_t)_header.nchunks * 4;
+	_header.payload_offset = (uint32_t)((table_end + FWC_PAGE_SIZE - 1) / FWC_PAGE_SIZE * FWC_PAGE_SIZE);
+	// Table is filled by finish(), placeholders keep payload at its offset
+	vector<uint8_t> head(_header.payload_offset, 0);
+	memcpy(&head[_header.meta_offset], _meta_bytes.data(), _meta_bytes.size());
+	write_raw(head);
+}
+
+void FirmwareContainerWriter::write(span<const uint8_t> chunk) {
+	if (_version == 1) {
+		_v1.write(chunk);
+		_npayload += chunk.size();
+		return;
+	}
+	write_raw(chunk);
+	while (!chunk.empty()) {
+		size_t in_chunk = _npayload % FWC_CHUNK_SIZE;
+		size_t n = min(chunk.size(), (size_t)FWC_CHUNK_SIZE - in_chunk);
+		_chunk_crc = crc32_update(in_chunk == 0 ? 0 : _chunk_crc, chunk.data(), n);
+		_npayload += n;
+		chunk = chunk.subspan(n);
+		if (_npayload % FWC_CHUNK_SIZE == 0) {
+			_table.push_back(_chunk_crc);
+		}
+	}
+}
+
+void FirmwareContainerWriter::finish() {
+	if (_npayload != _header.payload_size) {
+		throw runtime_error("firmware payload size mismatch");
+	}
+	if (_version == 1) {
+		_meta.pack_tail(_v1);
+		if (!_out) {
+			throw runtime_error("fail to write encrypted file");
+		}
+		return;
+	}
+	if (_npayload % FWC_CHUNK_SIZE != 0) {
+		_table.push_back(_chunk_crc);
+	}
+	vector<uint8_t> table(_table.size() * 4);
+	for (size_t i = 0; i < _table.size(); i++) {
+		stdser_s32(_table[i], &table[i * 4]);
+	}
+	uint8_t header[FWC_HEADER_SIZE];
+	_fwc_put_header(_header, header);
+	stdser_s32(_fwc_index_crc(header, _meta_bytes, table), &header[FWC_HEADER_SIZE - 4]);
+	auto end = _out.tellp();
+	_out.seekp(_header.table_offset);
+	_out.write((const char*)table.data(), table.size());
+	_out.seekp(0);
+	_out.write((const char*)header, FWC_HEADER_SIZE);
+	_out.seekp(end);
+	if (!_out) {
+		throw runtime_error("fail to write encrypted file");
+	}
+}
+
+size_t FirmwareContainerWriter::size() const {
+	if (_version == 1) {
+		return _v1.size();
+	}
+	return (size_t)_header.payload_offset + _npayload;
+}
+
+void FirmwareContainerWriter::write_raw(span<const uint8_t> data) {
+	_out.write((const char*)data.data(), data.size());
+}
+
+int firmware_container_version(span<const uint8_t> head) {
+	if (head.size() >= FWC_HEADER_SIZE && memcmp(head.data(), FWC_MAGIC, 4) == 0) {
+		return stdser_g16(&head[32]);
+	}
+	return 1;
+}
+
+optional<FirmwareFile> read_firmware_meta(istream& in) {
+	uint8_t head[FWC_HEADER_SIZE];
+	in.seekg(0, ios_base::end);
+	size_t file_size = (size_t)in.tellg();
+	in.seekg(0, ios_base::beg);
+	if (!in.read((char*)head, FWC_HEADER_SIZE) || firmware_container_version(head) == 1) {
+		in.clear();
+		in.seekg(0, ios_base::beg);
+		return nullopt;
+	}
+	auto header = _fwc_get_header(head);
+	_fwc_check_header(header, file_size);
+	vector<uint8_t> meta(header.meta_size);
+	vector<uint8_t> table((size_t)header.nchunks * 4);
+	in.seekg(header.meta_offset);
+	in.read((char*)meta.data(), meta.size());
+	in.seekg(header.table_offset);
+	in.read((char*)table.data(), table.size());
+	if (!in || _fwc_index_crc(head, meta, table) != stdser_g32(&head[FWC_HEADER_SIZE - 4])) {
+		throw runtime_error("firmware container index is corrupted");
+	}
+	return _fwc_unpack_meta(meta);
+}
+
+FirmwareFile read_firmware(span<const uint8_t> file, bool verify, size_t nthreads) {
+	if (firmware_container_version(file) == 1) {
+		return msgpack::unpack<FirmwareFile>(file.data(), file.size());
+	}
+	auto header = _fwc_get_header(file.data());
+	_fwc_check_header(header, file.size());
+	auto meta = file.subspan(header.meta_offset, header.meta_size);
+	auto table = file.subspan(header.table_offset, (size_t)header.nchunks * 4);
+	if (_fwc_index_crc(file.data(), meta, table) != stdser_g32(&file[FWC_HEADER_SIZE - 4])) {
+		throw runtime_error("firmware container index is corrupted");
+	}
+	auto fw = _fwc_unpack_meta(meta);
+	fw.data = file.subspan(header.payload_offset, header.payload_size);
+	if (verify) {
+		auto bad = _fwc_find_bad_chunk(fw.data, header, table, nthreads);
+		if (bad.has_value()) {
+			throw runtime_error("firmware chunk " + to_string(bad.value()) + " is corrupted");
+		}
+	}
+	return fw;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "../msgpack.hpp"
+
+#include <cstdlib>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <istream>
+#include <span>
+#include <string>
+#include <vector>
+
+/* * * .enc v2: fixed header, msgpack metadata, crc32 table of payload chunks and
+ * page aligned encrypted payload. Integers are big endian.
+ *
+ * 0  magic "FWUE"         4   u32 meta offset       8  u32 meta size
+ * 12 u32 table offset     16  u32 chunk size        20 u32 chunk count
+ * 24 u32 payload offset   28  u32 payload size      32 u16 version
+ * 34 reserved             44  u32 crc32 of header bytes before it, metadata and table
+ *
+ * v1 is a single msgpack FirmwareFile, it has no magic.
+ * * */
+#define FWC_MAGIC				"FWUE"
+#define FWC_VERSION				2
+#define FWC_HEADER_SIZE			48
+#define FWC_PAGE_SIZE			4096
+#define FWC_CHUNK_SIZE			(64 * 1024)
+
+struct FirmwareFile {
+	std::string name;
+	std::vector<uint8_t> version;
+	uint32_t checksum;
+	std::vector<uint8_t> test_phrase;
+	std::span<const uint8_t> data;
+	// Appended fields, files written before them unpack as uncompressed
+	uint8_t codec = 0;
+	uint32_t raw_size = 0;
+	uint32_t crc_block = 0;
+	std::vector<uint32_t> block_crcs;
+	uint8_t filler = 0;
+	std::vector<uint32_t> sparse_map;		// offset, length pairs of filler only plaintext
+
+	template<class T>
+	void pack(T& pack) {
+		pack_head(pack);
+		pack(data);
+		pack_tail(pack);
+	}
+
+	// Fields before and after data, v1 writer streams data between them
+	template<class T>
+	void pack_head(T& pack) {
+		pack(name, version, checksum, test_phrase);
+	}
+
+	template<class T>
+	void pack_tail(T& pack) {
+		pack(codec, raw_size, crc_block, block_crcs, filler, sparse_map);
+	}
+};
+
+struct FirmwareContainerHeader {
+	uint16_t version = FWC_VERSION;
+	uint32_t meta_offset = 0;
+	uint32_t meta_size = 0;
+	uint32_t table_offset = 0;
+	uint32_t chunk_size = FWC_CHUNK_SIZE;
+	uint32_t nchunks = 0;
+	uint32_t payload_offset = 0;
+	uint32_t payload_size = 0;
+};
+
+/* Writes firmware of known payload size, payload comes by chunks of any size
+ * between constructor and finish(). v2 stream must be seekable.
+ */
+class FirmwareContainerWriter
+{
+public:
+	FirmwareContainerWriter(std::ostream& out, const FirmwareFile& meta, size_t payload_size, int version = FWC_VERSION);
+
+	void write(std::span<const uint8_t> chunk);
+	void finish();
+	// Bytes written to stream
+	size_t size() const;
+
+private:
+	std::ostream& _out;
+	FirmwareFile _meta;
+	int _version;
+	FirmwareContainerHeader _header;
+	std::vector<uint8_t> _meta_bytes;
+	std::vector<uint32_t> _table;
+	msgpack::StreamWriter _v1;
+	size_t _npayload = 0;
+	uint32_t _chunk_crc = 0;
+
+	void write_raw(std::span<const uint8_t> data);
+};
+
+// Container version from first bytes of file
+int firmware_container_version(std::span<const uint8_t> head);
+// Metadata without payload, reads header, metadata and table only; nullopt for v1
+std::optional<FirmwareFile> read_firmware_meta(std::istream& in);
+// Any version, data points into file; v2 chunks are checked on nthreads (0 - one per core) when verify is set
+FirmwareFile read_firmware(std::span<const uint8_t> file, bool verify = true, size_t nthreads = 0);
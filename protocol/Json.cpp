@@ -0,0 +1,361 @@
+#include "Json.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+class JsonParser
+{
+public:
+	JsonParser(const string& text) : _text(text) {}
+
+	Json document() {
+		auto value = parse_value(0);
+		skip_ws();
+		if (_pos != _text.size()) {
+			fail("trailing characters");
+		}
+		return value;
+	}
+
+private:
+	static constexpr int max_depth = 64;
+
+	const string& _text;
+	size_t _pos = 0;
+
+	[[noreturn]] void fail(const string& what) const {
+		throw runtime_error("json: " + what + " at offset " + to_string(_pos));
+	}
+
+	void skip_ws() {
+		while (_pos < _text.size() && (_text[_pos] == ' ' || _text[_pos] == '\t' || _text[_pos] == '\r' || _text[_pos] == '\n')) {
+			_pos++;
+		}
+	}
+
+	bool take(char c) {
+		skip_ws();
+		if (_pos < _text.size() && _text[_pos] == c) {
+			_pos++;
+			return true;
+		}
+		return false;
+	}
+
+	void expect(char c) {
+		if (!take(c)) {
+			fail(string("expected '") + c + "'");
+		}
+	}
+
+	bool take_word(const char* word) {
+		size_t n = strlen(word);
+		if (_text.compare(_pos, n, word) == 0) {
+			_pos += n;
+			return true;
+		}
+		return false;
+	}
+
+	Json parse_value(int depth) {
+		Json value;
+		if (depth > max_depth) {
+			fail("nesting is too deep");
+		}
+		skip_ws();
+		if (_pos >= _text.size()) {
+			fail("unexpected end");
+		}
+		char c = _text[_pos];
+		if (c == '{') {
+			_pos++;
+			value._type = Json::Type::Object;
+			if (!take('}')) {
+				do {
+					skip_ws();
+					auto key = parse_string();
+					expect(':');
+					value._members[key] = parse_value(depth + 1);
+				} while (take(','));
+				expect('}');
+			}
+		}
+		else if (c == '[') {
+			_pos++;
+			value._type = Json::Type::Array;
+			if (!take(']')) {
+				do {
+					value._items.push_back(parse_value(depth + 1));
+				} while (take(','));
+				expect(']');
+			}
+		}
+		else if (c == '"') {
+			value._type = Json::Type::String;
+			value._str = parse_string();
+		}
+		else if (take_word("true")) {
+			value._type = Json::Type::Bool;
+			value._bool = true;
+		}
+		else if (take_word("false")) {
+			value._type = Json::Type::Bool;
+		}
+		else if (take_word("null")) {
+			value._type = Json::Type::Null;
+		}
+		else if (c == '-' || (c >= '0' && c <= '9')) {
+			const char* begin = _text.c_str() + _pos;
+			char* end = nullptr;
+			value._type = Json::Type::Number;
+			value._number = strtod(begin, &end);
+			if (end == begin) {
+				fail("bad number");
+			}
+			_pos += (size_t)(end - begin);
+		}
+		else {
+			fail("unexpected character");
+		}
+		return value;
+	}
+
+	static void put_utf8(string& out, uint32_t cp) {
+		if (cp < 0x80) {
+			out += (char)cp;
+		}
+		else if (cp < 0x800) {
+			out += (char)(0xC0 | (cp >> 6));
+			out += (char)(0x80 | (cp & 0x3F));
+		}
+		else if (cp < 0x10000) {
+			out += (char)(0xE0 | (cp >> 12));
+			out += (char)(0x80 | ((cp >> 6) & 0x3F));
+			out += (char)(0x80 | (cp & 0x3F));
+		}
+		else {
+			out += (char)(0xF0 | (cp >> 18));
+			out += (char)(0x80 | ((cp >> 12) & 0x3F));
+			out += (char)(0x80 | ((cp >> 6) & 0x3F));
+			out += (char)(0x80 | (cp & 0x3F));
+		}
+	}
+
+	uint32_t parse_hex4() {
+		if (_pos + 4 > _text.size()) {
+			fail("bad escape");
+		}
+		uint32_t cp = 0;
+		for (int i = 0; i < 4; i++) {
+			char h = _text[_pos++];
+			cp <<= 4;
+			if (h >= '0' && h <= '9') cp |= (uint32_t)(h - '0');
+			else if (h >= 'a' && h <= 'f') cp |= (uint32_t)(h - 'a' + 10);
+			else if (h >= 'A' && h <= 'F') cp |= (uint32_t)(h - 'A' + 10);
+			else fail("bad escape");
+		}
+		return cp;
+	}
+
+	string parse_string() {
+		string out;
+		if (_pos >= _text.size() || _text[_pos] != '"') {
+			fail("expected string");
+		}
+		_pos++;
+		while (_pos < _text.size() && _text[_pos] != '"') {
+			char c = _text[_pos++];
+			if (c != '\\') {
+				out += c;
+				continue;
+			}
+			if (_pos >= _text.size()) {
+				break;
+			}
+			char e = _text[_pos++];
+			switch (e) {
+			case '"': out += '"'; break;
+			case '\\': out += '\\'; break;
+			case '/': out += '/'; break;
+			case 'b': out += '\b'; break;
+			case 'f': out += '\f'; break;
+			case 'n': out += '\n'; break;
+			case 'r': out += '\r'; break;
+			case 't': out += '\t'; break;
+			case 'u': {
+				uint32_t cp = parse_hex4();
+				if (cp >= 0xD800 && cp < 0xDC00 && take_word("\\u")) {
+					uint32_t low = parse_hex4();
+					cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+				}
+				put_utf8(out, cp);
+				break;
+			}
+			default:
+				fail("bad escape");
+			}
+		}
+		if (_pos >= _text.size()) {
+			fail("unterminated string");
+		}
+		_pos++;
+		return out;
+	}
+};
+
+Json Json::parse(const string& text) {
+	return JsonParser(text).document();
+}
+
+Json Json::parse_file(const string& path) {
+	ifstream in(path, ios_base::binary);
+	if (!in.is_open()) {
+		throw runtime_error("fail to open '" + path + "'");
+	}
+	stringstream text;
+	text << in.rdbuf();
+	return parse(text.str());
+}
+
+string Json::quote(const string& str) {
+	string out = "\"";
+	char buf[8];
+	for (char c : str) {
+		switch (c) {
+		case '"': out += "\\\""; break;
+		case '\\': out += "\\\\"; break;
+		case '\n': out += "\\n"; break;
+		case '\r': out += "\\r"; break;
+		case '\t': out += "\\t"; break;
+		default:
+			if ((uint8_t)c < 0x20) {
+				snprintf(buf, sizeof(buf), "\\u%04x", c);
+				out += buf;
+			}
+			else {
+				out += c;
+			}
+		}
+	}
+	return out + "\"";
+}
+
+Json::Type Json::type() const {
+	return _type;
+}
+
+bool Json::is_null() const {
+	return _type == Type::Null;
+}
+
+bool Json::is_array() const {
+	return _type == Type::Array;
+}
+
+bool Json::is_object() const {
+	return _type == Type::Object;
+}
+
+bool Json::boolean() const {
+	if (_type != Type::Bool) {
+		throw runtime_error("json: value is not boolean");
+	}
+	return _bool;
+}
+
+double Json::number() const {
+	if (_type != Type::Number) {
+		throw runtime_error("json: value is not number");
+	}
+	return _number;
+}
+
+const string& Json::str() const {
+	if (_type != Type::String) {
+		throw runtime_error("json: value is not string");
+	}
+	return _str;
+}
+
+const vector<Json>& Json::items() const {
+	if (_type != Type::Array) {
+		throw runtime_error("json: value is not array");
+	}
+	return _items;
+}
+
+const map<string, Json>& Json::members() const {
+	if (_type != Type::Object) {
+		throw runtime_error("json: value is not object");
+	}
+	return _members;
+}
+
+bool Json::has(const string& key) const {
+	return _type == Type::Object && _members.count(key) != 0;
+}
+
+Json Json::with_defaults(const Json& defaults) const {
+	if (_type != Type::Object || (!defaults.is_null() && defaults._type != Type::Object)) {
+		throw runtime_error("json: value is not object");
+	}
+	Json merged = *this;
+	for (const auto& [key, value] : defaults._members) {
+		merged._members.emplace(key, value);
+	}
+	return merged;
+}
+
+const Json& Json::operator[](const string& key) const {
+	static const Json null;
+	if (!has(key)) {
+		return null;
+	}
+	return _members.at(key);
+}
+
+string Json::get(const string& key, const string& def) const {
+	auto& value = (*this)[key];
+	if (value.is_null()) {
+		return def;
+	}
+	if (value._type != Type::String) {
+		throw runtime_error("json: '" + key + "' must be string");
+	}
+	return value._str;
+}
+
+string Json::get(const string& key, const char* def) const {
+	return get(key, string(def));
+}
+
+double Json::get(const string& key, double def) const {
+	auto& value = (*this)[key];
+	if (value.is_null()) {
+		return def;
+	}
+	if (value._type != Type::Number) {
+		throw runtime_error("json: '" + key + "' must be number");
+	}
+	return value._number;
+}
+
+int Json::get(const string& key, int def) const {
+	return (int)get(key, (double)def);
+}
+
+bool Json::get(const string& key, bool def) const {
+	auto& value = (*this)[key];
+	if (value.is_null()) {
+		return def;
+	}
+	if (value._type != Type::Bool) {
+		throw runtime_error("json: '" + key + "' must be boolean");
+	}
+	return value._bool;
+}
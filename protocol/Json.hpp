@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+/* Minimal JSON document for manifests and job files. parse() throws
+ * runtime_error with byte offset, missing members read as null.
+ */
+class Json
+{
+public:
+	enum class Type { Null, Bool, Number, String, Array, Object };
+
+	static Json parse(const std::string& text);
+	static Json parse_file(const std::string& path);
+	// String literal with escapes, for code writing JSON
+	static std::string quote(const std::string& str);
+
+	Type type() const;
+	bool is_null() const;
+	bool is_array() const;
+	bool is_object() const;
+
+	bool boolean() const;
+	double number() const;
+	const std::string& str() const;
+	const std::vector<Json>& items() const;
+	const std::map<std::string, Json>& members() const;
+
+	bool has(const std::string& key) const;
+	// Object with members of defaults that this object lacks
+	Json with_defaults(const Json& defaults) const;
+	const Json& operator[](const std::string& key) const;
+
+	// Member of object with type check, default when missing
+	std::string get(const std::string& key, const std::string& def) const;
+	std::string get(const std::string& key, const char* def) const;
+	double get(const std::string& key, double def) const;
+	int get(const std::string& key, int def) const;
+	bool get(const std::string& key, bool def) const;
+
+private:
+	Type _type = Type::Null;
+	bool _bool = false;
+	double _number = 0;
+	std::string _str;
+	std::vector<Json> _items;
+	std::map<std::string, Json> _members;
+
+	friend class JsonParser;
+};
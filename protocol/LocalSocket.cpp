@@ -0,0 +1,174 @@
+#include "LocalSocket.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#if !defined(__MINGW32__) && !defined(_WIN32)
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifdef MSG_NOSIGNAL
+#define _ls_send_flags		MSG_NOSIGNAL
+#else
+#define _ls_send_flags		0
+#endif
+
+using namespace std;
+
+#if defined(__MINGW32__) || defined(_WIN32)
+
+LocalSocket::LocalSocket(int fd) : _fd(fd) {}
+LocalSocket::~LocalSocket() {}
+
+unique_ptr<LocalSocket> LocalSocket::connect(const string& path) {
+	throw runtime_error("local sockets are not supported on this platform");
+}
+
+bool LocalSocket::read_line(string& line, size_t max_len) {
+	return false;
+}
+
+bool LocalSocket::write(const string& data) {
+	return false;
+}
+
+LocalServer::LocalServer(const string& path) : _path(path) {
+	throw runtime_error("local sockets are not supported on this platform");
+}
+
+LocalServer::~LocalServer() {}
+
+unique_ptr<LocalSocket> LocalServer::accept(int timeout_ms) {
+	return nullptr;
+}
+
+#else
+
+static sockaddr_un _ls_address(const string& path) {
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) {
+		throw runtime_error("socket path is too long: " + path);
+	}
+	memcpy(addr.sun_path, path.c_str(), path.size());
+	return addr;
+}
+
+LocalSocket::LocalSocket(int fd) : _fd(fd) {
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+	setsockopt(_fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+LocalSocket::~LocalSocket() {
+	::close(_fd);
+}
+
+unique_ptr<LocalSocket> LocalSocket::connect(const string& path) {
+	auto addr = _ls_address(path);
+	int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		throw runtime_error("fail to create socket");
+	}
+	if (::connect(fd, (const sockaddr*)&addr, sizeof(addr)) != 0) {
+		::close(fd);
+		throw runtime_error("fail to connect to '" + path + "', is serve running?");
+	}
+	return make_unique<LocalSocket>(fd);
+}
+
+bool LocalSocket::read_line(string& line, size_t max_len) {
+	char buf[4096];
+	size_t end;
+	while ((end = _rx.find('\n')) == string::npos) {
+		// Peer that never ends the line must not grow the buffer without bound
+		if (_rx.size() > max_len) {
+			return false;
+		}
+		auto n = ::recv(_fd, buf, sizeof(buf), 0);
+		if (n <= 0) {
+			return false;
+		}
+		_rx.append(buf, (size_t)n);
+	}
+	if (end > max_len) {
+		return false;
+	}
+	line = _rx.substr(0, end);
+	_rx.erase(0, end + 1);
+	return true;
+}
+
+bool LocalSocket::write(const string& data) {
+	size_t nsent = 0;
+	while (nsent < data.size()) {
+		auto n = ::send(_fd, &data[nsent], data.size() - nsent, _ls_send_flags);
+		if (n <= 0) {
+			return false;
+		}
+		nsent += (size_t)n;
+	}
+	return true;
+}
+
+LocalServer::LocalServer(const string& path) : _path(path) {
+	auto addr = _ls_address(path);
+	bool live = true;
+	try {
+		LocalSocket::connect(path);
+	}
+	catch (const runtime_error&) {
+		// Nobody answers, file is left by a server that did not exit cleanly
+		live = false;
+	}
+	if (live) {
+		throw runtime_error("another server is running at '" + path + "'");
+	}
+	// Jobs name files the server reads and writes, other users must not reach it
+	auto slash = path.rfind('/');
+	if (slash != string::npos && slash > 0) {
+		auto dir = path.substr(0, slash);
+		if (::mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+			throw runtime_error("fail to create socket directory '" + dir + "'");
+		}
+	}
+	::unlink(path.c_str());
+	_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (_fd < 0) {
+		throw runtime_error("fail to create socket");
+	}
+	// Mode is set at creation, chmod after bind would leave a window
+	auto mask = ::umask(0177);
+	int rc = ::bind(_fd, (const sockaddr*)&addr, sizeof(addr));
+	::umask(mask);
+	if (rc != 0 || ::chmod(path.c_str(), 0600) != 0 || ::listen(_fd, 16) != 0) {
+		::close(_fd);
+		throw runtime_error("fail to listen at '" + path + "'");
+	}
+}
+
+LocalServer::~LocalServer() {
+	::close(_fd);
+	::unlink(_path.c_str());
+}
+
+unique_ptr<LocalSocket> LocalServer::accept(int timeout_ms) {
+	pollfd pfd = { _fd, POLLIN, 0 };
+	if (::poll(&pfd, 1, timeout_ms) <= 0) {
+		return nullptr;
+	}
+	int fd = ::accept(_fd, nullptr, nullptr);
+	if (fd < 0) {
+		return nullptr;
+	}
+	return make_unique<LocalSocket>(fd);
+}
+
+#endif
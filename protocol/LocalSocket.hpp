@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#define LOCAL_SOCKET_MAX_LINE		(64 * 1024)
+
+/* Connected stream of a Unix domain socket, line oriented.
+ * write() reports a gone peer by false instead of a signal.
+ */
+class LocalSocket
+{
+public:
+	explicit LocalSocket(int fd);
+	~LocalSocket();
+	LocalSocket(const LocalSocket&) = delete;
+	LocalSocket& operator=(const LocalSocket&) = delete;
+
+	static std::unique_ptr<LocalSocket> connect(const std::string& path);
+
+	// Line without '\n', false at end of stream or on line longer than max_len
+	bool read_line(std::string& line, size_t max_len = LOCAL_SOCKET_MAX_LINE);
+	bool write(const std::string& data);
+
+private:
+	int _fd;
+	std::string _rx;
+};
+
+/* Listening socket at path, connectable by its owner only: mode 0600, missing
+ * directory is created with mode 0700. Stale socket file is replaced, live one
+ * (another server answers there) is an error. File is removed on destruction.
+ */
+class LocalServer
+{
+public:
+	LocalServer(const std::string& path);
+	~LocalServer();
+	LocalServer(const LocalServer&) = delete;
+	LocalServer& operator=(const LocalServer&) = delete;
+
+	// nullptr when no client came within timeout_ms
+	std::unique_ptr<LocalSocket> accept(int timeout_ms);
+
+private:
+	int _fd = -1;
+	std::string _path;
+};
@@ -0,0 +1,45 @@
+#include "RetryPolicy.hpp"
+#include "ecbm.h"
+
+#include <algorithm>
+#include <random>
+
+using namespace std;
+
+RetryPolicy::RetryPolicy(const RetryConfig& config) : _config(config), _rng(random_device()()) {
+
+}
+
+RetryDecision RetryPolicy::decide(int rc, int attempt) {
+	if (attempt > _config.max_retries) {
+		return RetryDecision{ RetryAction::Fail, 0 };
+	}
+	if (rc == ECBM_ERR_INTEGRITY) {
+		return RetryDecision{ RetryAction::Resend, 0 };
+	}
+	if (ECBM_IS_BUS_ERR(rc) || rc == ECBM_ERR_READ || rc == ECBM_ERR_WRITE) {
+		// "Equal jitter": half of the exponential step is fixed, half is random
+		// The first backoff waits base, the shift is wide enough for any base before the cap
+		uint64_t wide = (uint64_t)_config.backoff_base_ms << clamp(attempt - 1, 0, 16);
+		uint32_t step = (uint32_t)min<uint64_t>(wide, _config.backoff_max_ms);
+		uniform_int_distribution<uint32_t> jitter(0, step / 2);
+		return RetryDecision{ RetryAction::Backoff, step - step / 2 + jitter(_rng) };
+	}
+	// ECBM_ERR_BOOT_INC_KEY, ECBM_ERR_INTERNAL and the rest of app/local errors will not go away on resend
+	return RetryDecision{ RetryAction::Fail, 0 };
+}
+
+const RetryConfig& RetryPolicy::config() const {
+	return _config;
+}
+
+const char* RetryPolicy::action_name(RetryAction action) {
+	switch (action) {
+	case RetryAction::Resend:
+		return "resend";
+	case RetryAction::Backoff:
+		return "backoff";
+	default:
+		return "fail";
+	}
+}
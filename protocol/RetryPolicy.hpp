@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <random>
+#include <string>
+
+enum class RetryAction {
+	Resend,
+	Backoff,
+	Fail
+};
+
+struct RetryConfig {
+	int max_retries = 5;			// resends after the first attempt
+	uint32_t backoff_base_ms = 20;
+	uint32_t backoff_max_ms = 1000;
+};
+
+struct RetryDecision {
+	RetryAction action;
+	uint32_t delay_ms;
+};
+
+/* Chooses what to do after a failed ecbm transfer, by error class:
+ * integrity errors are resent at once (the frame was damaged, the device is alive),
+ * timeouts and port errors back off exponentially with jitter,
+ * errors reported by the device itself (wrong key, bad checksum, ...) and local ones are final.
+ */
+class RetryPolicy
+{
+public:
+	RetryPolicy(const RetryConfig& config = RetryConfig());
+
+	// attempt - failed attempts of the transfer so far, the first one included
+	RetryDecision decide(int rc, int attempt);
+	const RetryConfig& config() const;
+
+	static const char* action_name(RetryAction action);
+
+private:
+	RetryConfig _config;
+	std::minstd_rand _rng;
+};
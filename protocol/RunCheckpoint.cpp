@@ -0,0 +1,125 @@
+#include "RunCheckpoint.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+
+#if defined(__MINGW32__) || defined(_WIN32)
+#include <io.h>
+#define _rc_open(path, flags, mode)		_open(path, (flags) | _O_BINARY, mode)
+#define _rc_write						_write
+#define _rc_sync						_commit
+#define _rc_close						::_close
+#else
+#include <unistd.h>
+#define _rc_open						::open
+#define _rc_write						::write
+#define _rc_sync						::fsync
+#define _rc_close						::close
+#endif
+
+using namespace std;
+
+static const char* _rc_names[] = { "pending", "running", "verified", "done", "failed" };
+
+RunCheckpoint::RunCheckpoint(const string& path, bool resume, uint32_t sync_ms) : _path(path), _sync_ms(sync_ms) {
+	if (resume) {
+		ifstream in(_path);
+		string line;
+		while (getline(in, line)) {
+			// Torn last line of a crashed run has no state field and is dropped
+			auto tab = line.find('\t');
+			auto tab2 = tab == string::npos ? string::npos : line.find('\t', tab + 1);
+			if (tab2 == string::npos) {
+				continue;
+			}
+			auto name = line.substr(tab + 1, tab2 - tab - 1);
+			for (size_t i = 0; i < sizeof(_rc_names) / sizeof(_rc_names[0]); i++) {
+				if (name == _rc_names[i]) {
+					_previous[line.substr(0, tab)] = { (State)i, line.substr(tab2 + 1) };
+				}
+			}
+		}
+	}
+	_fd = _rc_open(_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | (resume ? 0 : O_TRUNC), 0644);
+	if (_fd < 0) {
+		throw runtime_error("fail to open checkpoint log '" + _path + "'");
+	}
+	// Crashed run may leave a line without end, records start on a new one
+	if (resume) {
+		_rc_write(_fd, "\n", 1);
+	}
+	_syncer = thread(&RunCheckpoint::sync_loop, this);
+}
+
+RunCheckpoint::~RunCheckpoint() {
+	try {
+		close();
+	}
+	catch (const exception&) {
+	}
+}
+
+optional<RunCheckpoint::Entry> RunCheckpoint::get(const string& job) const {
+	lock_guard<mutex> guard(_lock);
+	auto it = _previous.find(job);
+	if (it == _previous.end()) {
+		return nullopt;
+	}
+	return it->second;
+}
+
+void RunCheckpoint::record(const string& job, State state, const string& detail) {
+	string line = job + "\t" + _rc_names[(int)state] + "\t";
+	for (char c : detail) {
+		line += c == '\n' || c == '\t' ? ' ' : c;
+	}
+	line += "\n";
+	lock_guard<mutex> guard(_lock);
+	if (_fd < 0) {
+		throw runtime_error("checkpoint log is closed");
+	}
+	if (_rc_write(_fd, line.data(), (unsigned)line.size()) != (int)line.size()) {
+		throw runtime_error("fail to write checkpoint log '" + _path + "'");
+	}
+	_dirty = true;
+}
+
+void RunCheckpoint::close() {
+	{
+		lock_guard<mutex> guard(_lock);
+		if (_fd < 0) {
+			return;
+		}
+		_stop = true;
+	}
+	_wake.notify_all();
+	_syncer.join();
+	lock_guard<mutex> guard(_lock);
+	bool synced = _rc_sync(_fd) == 0;
+	_rc_close(_fd);
+	_fd = -1;
+	if (!synced) {
+		throw runtime_error("fail to sync checkpoint log '" + _path + "'");
+	}
+}
+
+const char* RunCheckpoint::state_name(State state) {
+	return _rc_names[(int)state];
+}
+
+void RunCheckpoint::sync_loop() {
+	unique_lock<mutex> guard(_lock);
+	while (!_stop) {
+		_wake.wait_for(guard, chrono::milliseconds(_sync_ms));
+		if (_dirty) {
+			_dirty = false;
+			int fd = _fd;
+			// Records go on while disk catches up
+			guard.unlock();
+			_rc_sync(fd);
+			guard.lock();
+		}
+	}
+}
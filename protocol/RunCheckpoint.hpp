@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+/* Append-only state log of a fleet run, "<job>\t<state>\t<detail>" lines,
+ * the last line of a job wins. Every record is one write, so a killed process
+ * loses nothing; fsync is batched by a background thread at most every sync_ms,
+ * power loss drops only the records of that window. Methods are thread safe.
+ */
+class RunCheckpoint
+{
+public:
+	enum class State {
+		Pending,
+		Running,
+		Verified,		// detail is image checksum
+		Done,			// job without image
+		Failed			// detail is error
+	};
+
+	struct Entry {
+		State state;
+		std::string detail;
+	};
+
+	// Without resume previous log is discarded
+	RunCheckpoint(const std::string& path, bool resume, uint32_t sync_ms = 200);
+	~RunCheckpoint();
+	RunCheckpoint(const RunCheckpoint&) = delete;
+	RunCheckpoint& operator=(const RunCheckpoint&) = delete;
+
+	// State left by previous runs
+	std::optional<Entry> get(const std::string& job) const;
+	void record(const std::string& job, State state, const std::string& detail = "");
+	// Syncs and stops background thread, errors are thrown here
+	void close();
+
+	static const char* state_name(State state);
+
+private:
+	std::string _path;
+	int _fd = -1;
+	uint32_t _sync_ms;
+	std::map<std::string, Entry> _previous;
+	mutable std::mutex _lock;
+	std::condition_variable _wake;
+	bool _dirty = false;
+	bool _stop = false;
+	std::thread _syncer;
+
+	void sync_loop();
+};
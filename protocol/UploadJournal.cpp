@@ -0,0 +1,62 @@
+#include "UploadJournal.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+UploadJournal::UploadJournal(const string& path) : _path(path) {
+	ifstream in(_path);
+	string key;
+	size_t offset;
+	while (in >> key >> offset) {
+		_entries[key] = offset;
+	}
+}
+
+optional<size_t> UploadJournal::get(const string& key) const {
+	auto it = _entries.find(key);
+	if (it == _entries.end()) {
+		return nullopt;
+	}
+	return it->second;
+}
+
+void UploadJournal::set(const string& key, size_t offset) {
+	_entries[key] = offset;
+	save();
+}
+
+void UploadJournal::remove(const string& key) {
+	if (_entries.erase(key) > 0) {
+		save();
+	}
+}
+
+string UploadJournal::make_key(const string& port, uint8_t addr, uint32_t image_hash) {
+	char hash[9];
+	snprintf(hash, sizeof(hash), "%08X", image_hash);
+	return port + ":" + to_string(addr) + ":" + hash;
+}
+
+void UploadJournal::save() const {
+	string tmp_path = _path + ".tmp";
+	{
+		ofstream out(tmp_path, ios_base::trunc);
+		for (const auto& [key, offset] : _entries) {
+			out << key << " " << offset << "\n";
+		}
+		if (!out) {
+			throw runtime_error("fail to write upload journal: " + tmp_path);
+		}
+	}
+#if defined(__MINGW32__) || defined(_WIN32)
+	// rename does not replace existing file there
+	std::remove(_path.c_str());
+#endif
+	if (rename(tmp_path.c_str(), _path.c_str()) != 0) {
+		throw runtime_error("fail to replace upload journal: " + _path);
+	}
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+
+/* Host side record of unfinished uploads, one "<key> <offset>" line per
+ * port, address and image. File is replaced atomically on every change,
+ * so a killed process leaves the last saved offset.
+ */
+class UploadJournal
+{
+public:
+	UploadJournal(const std::string& path);
+
+	std::optional<size_t> get(const std::string& key) const;
+	void set(const std::string& key, size_t offset);
+	void remove(const std::string& key);
+
+	static std::string make_key(const std::string& port, uint8_t addr, uint32_t image_hash);
+
+private:
+	std::string _path;
+	std::map<std::string, size_t> _entries;
+
+	void save() const;
+};
@@ -0,0 +1,261 @@
+#include "WireCapture.hpp"
+#include "ecbm.h"
+#include "framer7b.h"
+#include "raiden.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <stdexcept>
+
+using namespace std;
+
+#define _WIRECAPTURE_MERGE_GAP_US	1000
+#define _WIRECAPTURE_REC_HDR		16
+
+struct PcapHeader {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t network;
+};
+
+struct PcapRecord {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+WireCapture::WireCapture(const string& path, size_t bufsize) : _out(path, ios_base::binary | ios_base::trunc), _buf(bufsize) {
+	if (!_out.is_open()) {
+		throw runtime_error("fail to open capture file '" + path + "'");
+	}
+	PcapHeader hdr = { 0xA1B2C3D4, 2, 4, 0, 0, 65535, WIRECAPTURE_LINKTYPE };
+	_out.write((const char*)&hdr, sizeof(hdr));
+	_t0 = chrono::steady_clock::now();
+	_epoch_us0 = (uint64_t)chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+WireCapture::~WireCapture() {
+	flush();
+}
+
+uint64_t WireCapture::now_us() const {
+	return _epoch_us0 + (uint64_t)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - _t0).count();
+}
+
+void WireCapture::record(Dir dir, const uint8_t* data, size_t ndata) {
+	if (ndata == 0) {
+		return;
+	}
+	auto ts = now_us();
+	PcapRecord rec;
+	if (_last != SIZE_MAX && _last_dir == dir && ts - _last_us < _WIRECAPTURE_MERGE_GAP_US && _used + ndata <= _buf.size()) {
+		memcpy(&rec, &_buf[_last], sizeof(rec));
+		if (rec.incl_len + ndata <= 65535) {
+			rec.ts_sec = (uint32_t)(ts / 1000000);
+			rec.ts_usec = (uint32_t)(ts % 1000000);
+			rec.incl_len += (uint32_t)ndata;
+			rec.orig_len = rec.incl_len;
+			memcpy(&_buf[_last], &rec, sizeof(rec));
+			memcpy(&_buf[_used], data, ndata);
+			_used += ndata;
+			_last_us = ts;
+			return;
+		}
+	}
+	if (_used + _WIRECAPTURE_REC_HDR + 1 + ndata > _buf.size()) {
+		flush();
+	}
+	rec.ts_sec = (uint32_t)(ts / 1000000);
+	rec.ts_usec = (uint32_t)(ts % 1000000);
+	rec.incl_len = (uint32_t)(ndata + 1);
+	rec.orig_len = rec.incl_len;
+	if (_WIRECAPTURE_REC_HDR + 1 + ndata > _buf.size()) {
+		// Chunk larger than whole buffer, bypass it
+		_out.write((const char*)&rec, sizeof(rec));
+		_out.put((char)dir);
+		_out.write((const char*)data, ndata);
+		_last = SIZE_MAX;
+		return;
+	}
+	_last = _used;
+	memcpy(&_buf[_used], &rec, sizeof(rec));
+	_buf[_used + _WIRECAPTURE_REC_HDR] = dir;
+	memcpy(&_buf[_used + _WIRECAPTURE_REC_HDR + 1], data, ndata);
+	_used += _WIRECAPTURE_REC_HDR + 1 + ndata;
+	_last_dir = dir;
+	_last_us = ts;
+}
+
+void WireCapture::flush() {
+	if (_used > 0) {
+		_out.write((const char*)_buf.data(), _used);
+	}
+	_out.flush();
+	_used = 0;
+	_last = SIZE_MAX;
+}
+
+struct ReplayRequest {
+	uint64_t ts_us;
+	uint8_t addr;
+	uint16_t sig;
+	uint8_t is_encs;
+	size_t nbytes;
+	bool parsed;
+};
+
+static string sig_label(uint16_t sig) {
+	auto name = ecbm_sig_name(sig);
+	return name != nullptr ? string(name) : to_string(sig);
+}
+
+void replay_capture(const string& path, const optional<array<uint8_t, 16>>& base_key, ostream& out) {
+	ifstream in(path, ios_base::binary);
+	if (!in.is_open()) {
+		throw runtime_error("fail to open capture file '" + path + "'");
+	}
+	vector<uint8_t> raw((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+	PcapHeader hdr;
+	if (raw.size() < sizeof(hdr)) {
+		throw runtime_error("capture file is too short");
+	}
+	memcpy(&hdr, raw.data(), sizeof(hdr));
+	if (hdr.magic != 0xA1B2C3D4 || hdr.network != WIRECAPTURE_LINKTYPE) {
+		throw runtime_error("not an ecbm capture file");
+	}
+
+	auto framers = make_unique<array<Framer7b, 2>>();
+	framer7b_init(&(*framers)[WireCapture::Tx]);
+	framer7b_init(&(*framers)[WireCapture::Rx]);
+	map<uint8_t, array<uint8_t, 16>> sessions;
+	map<uint16_t, EcbmHist> latency;
+	optional<ReplayRequest> pending;
+	optional<array<uint8_t, 16>> pending_key;
+	uint64_t t_first = 0;
+	size_t ntrans = 0;
+	size_t nlost = 0;
+
+	auto close_pending = [&](const char* status) {
+		if (!pending.has_value()) {
+			return;
+		}
+		out << (pending->ts_us - t_first) / 1000.0 << " ms\taddr " << (int)pending->addr << "\t";
+		out << (pending->parsed ? (pending->is_encs ? string("encs") : sig_label(pending->sig)) : string("?"));
+		out << "\t" << pending->nbytes << " B\t" << status << endl;
+		nlost++;
+		pending.reset();
+	};
+
+	size_t ptr = sizeof(hdr);
+	while (ptr + sizeof(PcapRecord) <= raw.size()) {
+		PcapRecord rec;
+		memcpy(&rec, &raw[ptr], sizeof(rec));
+		ptr += sizeof(rec);
+		if (rec.incl_len == 0 || ptr + rec.incl_len > raw.size()) {
+			break;
+		}
+		uint64_t ts = (uint64_t)rec.ts_sec * 1000000 + rec.ts_usec;
+		if (t_first == 0) {
+			t_first = ts;
+		}
+		auto dir = raw[ptr] == WireCapture::Rx ? WireCapture::Rx : WireCapture::Tx;
+		auto framer = &(*framers)[dir];
+		for (size_t i = 1; i < rec.incl_len; i++) {
+			int rc = framer7b_push(framer, raw[ptr + i]);
+			if (rc <= 0) {
+				continue;
+			}
+			vector<uint8_t> frame(framer7b_get_read_buf(framer), framer7b_get_read_buf(framer) + rc);
+			EcbmFrameInfo info;
+			if (dir == WireCapture::Tx) {
+				close_pending("no answer");
+				ReplayRequest req = { ts, 0, 0, 0, frame.size(), false };
+				pending_key.reset();
+				auto copy = frame;
+				if (ecbm_parse_frame(copy.data(), copy.size(), nullptr, &info) == ECBM_OK && info.is_req) {
+					req.parsed = true;
+				}
+				else {
+					for (const auto& s : sessions) {
+						copy = frame;
+						if (ecbm_parse_frame(copy.data(), copy.size(), s.second.data(), &info) == ECBM_OK && info.is_req && info.addr == s.first) {
+							req.parsed = true;
+							pending_key = s.second;
+							break;
+						}
+					}
+				}
+				if (req.parsed) {
+					req.addr = info.addr;
+					req.sig = info.sig;
+					req.is_encs = ecbm_frame_is_encs(&info);
+					if (req.is_encs || req.sig == ECBM_SIG_RESET) {
+						sessions.erase(req.addr);
+					}
+				}
+				if (req.parsed && req.addr == ECBM_ADDR_BROADCAST) {
+					out << (ts - t_first) / 1000.0 << " ms\tbroadcast " << sig_label(req.sig) << endl;
+					sessions.clear();
+					continue;
+				}
+				pending = req;
+			}
+			else {
+				if (!pending.has_value()) {
+					continue;
+				}
+				auto status = string("?");
+				if (!pending->parsed) {
+					status = "answer";
+				}
+				else if (ecbm_parse_frame(frame.data(), frame.size(), pending_key.has_value() ? pending_key->data() : nullptr, &info) != ECBM_OK) {
+					status = "integrity error";
+				}
+				else if (info.err != 0) {
+					status = "error " + to_string(info.err);
+				}
+				else {
+					status = "ok";
+					if (pending->is_encs && base_key.has_value() && info.npayload == 16) {
+						array<uint8_t, 16> key;
+						raiden_decode(base_key->data(), info.payload, key.data(), 16);
+						sessions[pending->addr] = key;
+					}
+				}
+				auto lat = ts - pending->ts_us;
+				uint16_t hist_sig = pending->is_encs ? 0xFFFF : pending->sig;
+				auto& h = latency[pending->parsed ? hist_sig : 0xFFFE];
+				h.count++;
+				h.sum_us += lat;
+				h.max_us = max(h.max_us, (uint32_t)lat);
+				h.buckets[ecbm_hist_bucket((uint32_t)lat)]++;
+				out << (pending->ts_us - t_first) / 1000.0 << " ms\taddr " << (int)pending->addr << "\t";
+				out << (pending->parsed ? (pending->is_encs ? string("encs") : sig_label(pending->sig)) : string("?"));
+				out << "\t" << pending->nbytes << " B\t" << status << "\t" << lat << " us" << endl;
+				ntrans++;
+				pending.reset();
+			}
+		}
+		ptr += rec.incl_len;
+	}
+	close_pending("no answer");
+
+	out << endl << "transactions: " << ntrans << ", unanswered: " << nlost << endl;
+	for (const auto& l : latency) {
+		const auto& h = l.second;
+		string name = l.first == 0xFFFF ? string("encs") : (l.first == 0xFFFE ? string("?") : sig_label(l.first));
+		out << name << ": n " << h.count << ", mean " << h.sum_us / h.count << " us";
+		out << ", p50 " << ecbm_hist_percentile(&h, 500) << " us, p99 " << ecbm_hist_percentile(&h, 990) << " us";
+		out << ", max " << h.max_us << " us" << endl;
+	}
+}
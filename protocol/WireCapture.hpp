@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#define WIRECAPTURE_LINKTYPE	147		// LINKTYPE_USER0, payload is direction byte + raw bytes
+#define WIRECAPTURE_BUFSIZE		(4 * 1024 * 1024)
+
+/* Captures raw bytes passed through ecbm write/read callbacks into a pcap file.
+ * Records are built in place in a preallocated buffer, which is written out in
+ * one go when full and on destruction. Consecutive chunks in the same direction
+ * are merged into one record, its timestamp is the time of the last chunk.
+ */
+class WireCapture
+{
+public:
+	enum Dir : uint8_t {
+		Tx = 0,
+		Rx = 1
+	};
+
+	WireCapture(const std::string& path, size_t bufsize = WIRECAPTURE_BUFSIZE);
+	~WireCapture();
+
+	void record(Dir dir, const uint8_t* data, size_t ndata);
+	void flush();
+
+private:
+	std::ofstream _out;
+	std::vector<uint8_t> _buf;
+	size_t _used = 0;
+	size_t _last = SIZE_MAX;
+	Dir _last_dir = Tx;
+	uint64_t _last_us = 0;
+	std::chrono::steady_clock::time_point _t0;
+	uint64_t _epoch_us0;
+
+	uint64_t now_us() const;
+};
+
+void replay_capture(const std::string& path, const std::optional<std::array<uint8_t, 16>>& base_key, std::ostream& out);
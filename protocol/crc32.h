@@ -11,6 +11,7 @@ extern "C" {
 #define CRC32_POLYNOME      0x04C11DB7
 
 uint32_t crc32(const uint8_t* data, size_t ndata);
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t ndata);
 uint32_t crc32_dync(uint32_t crc, uint8_t data);
 
 #ifdef __cplusplus
@@ -17,10 +17,16 @@
 #define _ECBM_PD_TYP_MASK		0b00001111
 #define _ECBM_PD_DIR_REQ		0b00010000
 #define _ECBM_PD_DIR_ANSW		0b00000000
-#define _ECBM_PD_TYP_WRITE		0b00000000
-#define _ECBM_PD_TYP_READ		0b00000001
-#define _ECBM_PD_TYP_ENCS		0b00000100
-#define _ECBM_PD_TYP_ERR		0b00001000
+#define _ECBM_PD_TYP_WRITE		ECBM_TYP_WRITE
+#define _ECBM_PD_TYP_READ		ECBM_TYP_READ
+#define _ECBM_PD_TYP_ENCS		ECBM_TYP_ENCS
+#define _ECBM_PD_TYP_ERR		ECBM_TYP_ERR
+
+#if ECBM_STATS_EN
+#define _ECBM_COUNT(ecbm, peer, field, n)	do { (ecbm)->stats.bus.field += (n); if ((peer) != NULL) { (peer)->stats.field += (n); } } while (0)
+#else
+#define _ECBM_COUNT(ecbm, peer, field, n)	do { } while (0)
+#endif
 
 void ecbm_init(
 	Ecbm* ecbm,
@@ -34,11 +40,142 @@ void ecbm_init(
 	ecbm->write = write;
 	ecbm->read = read;
 	ecbm->sleep_ms = sleep_ms;
+	ecbm->clock_us = NULL;
+	ecbm->set_baud = NULL;
+	ecbm->baud = 0;
 	ecbm->timeout_ms = ECBM_DEF_TIMEOUT_MS;
-	framer7b_reset(&ecbm->framer);
+	ecbm->rto_floor_ms = ECBM_RTO_FLOOR_MS;
+	ecbm->rto_ceil_ms = ECBM_RTO_CEIL_MS;
+	framer7b_init(&ecbm->framer);
 	for (i = 0; i < ECBM_MAX_ENC_SESSIONS; i++) {
 		ecbm->enc_sessions[i].addr = 0;
 	}
+	memset(ecbm->peers, 0, sizeof(ecbm->peers));
+#if ECBM_STATS_EN
+	memset(&ecbm->stats, 0, sizeof(ecbm->stats));
+#endif
+}
+
+static EcbmPeer* _ecbm_get_peer(Ecbm* ecbm, uint8_t addr, uint8_t create) {
+	size_t i;
+	if (addr == ECBM_ADDR_BROADCAST) {
+		return NULL;
+	}
+	for (i = 0; i < ECBM_MAX_PEERS; i++) {
+		if (ecbm->peers[i].addr == addr) {
+			return &ecbm->peers[i];
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+	for (i = 0; i < ECBM_MAX_PEERS; i++) {
+		if (ecbm->peers[i].addr == 0) {
+			memset(&ecbm->peers[i], 0, sizeof(EcbmPeer));
+			ecbm->peers[i].addr = addr;
+			return &ecbm->peers[i];
+		}
+	}
+	return NULL;
+}
+
+static int _ecbm_sig_class(uint16_t sig, uint8_t pd_typ) {
+	if (pd_typ == _ECBM_PD_TYP_ENCS) {
+		return ECBM_SIGCLS_READ;
+	}
+	if (pd_typ == _ECBM_PD_TYP_READ && sig != ECBM_SIG_BOOT_CHECKSUM && sig != ECBM_SIG_BOOT_BLOCK_CRC) {
+		return ECBM_SIGCLS_READ;
+	}
+	return ecbm_sig_class(sig);
+}
+
+static EcbmRtt* _ecbm_peer_rtt(const Ecbm* ecbm, EcbmPeer* peer, int cls) {
+	if (peer == NULL || cls == ECBM_SIGCLS_NONE || ecbm->clock_us == NULL) {
+		return NULL;
+	}
+	return &peer->rtt[cls];
+}
+
+/* * * Jacobson/Karels update: alpha = 1/8, beta = 1/4
+ * every transfer is a single attempt (retries are separate transfers with
+ * a flushed rx), so each answer is unambiguous and may be sampled
+ * * */
+static void _ecbm_rtt_sample(EcbmRtt* rtt, uint32_t sample_us) {
+	uint32_t delta;
+	if (rtt->nsamples == 0) {
+		rtt->srtt_us = sample_us;
+		rtt->rttvar_us = sample_us / 2;
+	}
+	else {
+		delta = rtt->srtt_us > sample_us ? rtt->srtt_us - sample_us : sample_us - rtt->srtt_us;
+		rtt->rttvar_us = rtt->rttvar_us - rtt->rttvar_us / 4 + delta / 4;
+		rtt->srtt_us = rtt->srtt_us - rtt->srtt_us / 8 + sample_us / 8;
+	}
+	rtt->nsamples++;
+	rtt->backoff = 0;
+}
+
+static uint16_t _ecbm_rto(const Ecbm* ecbm, const EcbmRtt* rtt) {
+	uint32_t rto_ms;
+	if (rtt == NULL || rtt->nsamples == 0) {
+		return ecbm->timeout_ms;
+	}
+	rto_ms = (rtt->srtt_us + 4 * rtt->rttvar_us + 999) / 1000;
+	rto_ms <<= rtt->backoff;
+	if (rto_ms < ecbm->rto_floor_ms) {
+		rto_ms = ecbm->rto_floor_ms;
+	}
+	if (rto_ms > ecbm->rto_ceil_ms) {
+		rto_ms = ecbm->rto_ceil_ms;
+	}
+	return (uint16_t)rto_ms;
+}
+
+static uint32_t _ecbm_msb(uint32_t value) {
+#if defined(__GNUC__)
+	return 31 - (uint32_t)__builtin_clz(value);
+#else
+	uint32_t n = 0;
+	while (value >>= 1) {
+		n++;
+	}
+	return n;
+#endif
+}
+
+#if ECBM_STATS_EN
+static void _ecbm_hist_add(EcbmHist* hist, uint32_t value_us) {
+	hist->count++;
+	hist->sum_us += value_us;
+	if (value_us > hist->max_us) {
+		hist->max_us = value_us;
+	}
+	hist->buckets[ecbm_hist_bucket(value_us)]++;
+}
+#endif
+
+/* * * Account result of answer check: CRC/decrypt failures and error codes sent by device
+ * * */
+static int _ecbm_account_answ(Ecbm* ecbm, uint8_t addr, int rc) {
+#if ECBM_STATS_EN
+	EcbmPeer* peer;
+	if (rc >= 0) {
+		return rc;
+	}
+	peer = _ecbm_get_peer(ecbm, addr, 0);
+	if (rc == ECBM_ERR_INTEGRITY) {
+		_ECBM_COUNT(ecbm, peer, integrity_errs, 1);
+	}
+	else if (ECBM_IS_APP_ERR(rc)) {
+		_ECBM_COUNT(ecbm, peer, dev_errs, 1);
+		ecbm->stats.bus.last_dev_err = (int16_t)rc;
+		ecbm->stats.dev_err_codes[-rc]++;
+		if (peer != NULL) {
+			peer->stats.last_dev_err = (int16_t)rc;
+		}
+	}
+#endif
+	return rc;
 }
 
 static int _ecbm_assert_answ(const uint8_t* data, size_t ndata, uint8_t addr, uint8_t pd_typ) {
@@ -69,51 +206,93 @@ static int _ecbm_assert_answ(const uint8_t* data, size_t ndata, uint8_t addr, ui
 	}
 }
 
-static int _ecbm_transfer(Ecbm* ecbm, size_t ndata, uint8_t addr) {
+static int _ecbm_transfer(Ecbm* ecbm, size_t ndata, uint8_t addr, uint16_t sig, int sig_class) {
 	uint32_t elapsed_ms;
+	uint32_t start_us;
+	uint32_t last_us;
+	uint16_t timeout_ms;
+	EcbmPeer* peer;
+	EcbmRtt* rtt;
 	int rc;
 	uint8_t buf[1];
 	
-	while (ecbm->read(ecbm->id, buf, 1) > 0) {}
+	peer = _ecbm_get_peer(ecbm, addr, 1);
+	while (ecbm->read(ecbm->id, buf, 1) > 0) {
+		_ECBM_COUNT(ecbm, peer, bytes_rx, 1);
+	}
 	rc = ecbm->write(ecbm->id, framer7b_get_send_buf(&ecbm->framer), ndata);
 	if (rc < 0) {
 		return ECBM_ERR_WRITE;
 	}
+	_ECBM_COUNT(ecbm, peer, frames_tx, 1);
+	_ECBM_COUNT(ecbm, peer, bytes_tx, ndata);
 	framer7b_reset(&ecbm->framer);
 	if (addr == ECBM_ADDR_BROADCAST) {
 		return 0;
 	}
+	rtt = _ecbm_peer_rtt(ecbm, peer, sig_class);
+	timeout_ms = _ecbm_rto(ecbm, rtt);
 	elapsed_ms = 0;
+	start_us = ecbm->clock_us != NULL ? ecbm->clock_us() : 0;
+	last_us = start_us;
 	uint8_t is_rx = 0;
 	while (1) {
 		rc = ecbm->read(ecbm->id, buf, 1);
 		if (rc > 0) {
 			is_rx = 1;
 			elapsed_ms = 0;
+			_ECBM_COUNT(ecbm, peer, bytes_rx, 1);
+			if (ecbm->clock_us != NULL) {
+				last_us = ecbm->clock_us();
+			}
 			rc = framer7b_push(&ecbm->framer, buf[0]);
 			if (rc > 0) {
 				break;
 			}
 			else if (rc < 0) {
+				_ECBM_COUNT(ecbm, peer, resyncs, 1);
 				return ECBM_ERR_INTEGRITY;
 			}
 		}
 		else if (rc == 0) {
-			ecbm->sleep_ms(10);
-			elapsed_ms += 11;
-			if (elapsed_ms > ecbm->timeout_ms) {
+			if (ecbm->clock_us != NULL) {
+				// Fine grained polling, so lost frames are detected close to the rto
+				elapsed_ms = (ecbm->clock_us() - last_us) / 1000;
+			}
+			if (elapsed_ms > timeout_ms) {
 				if (is_rx) {
+					_ECBM_COUNT(ecbm, peer, integrity_errs, 1);
 					return ECBM_ERR_INTEGRITY;
 				}
 				else {
+					_ECBM_COUNT(ecbm, peer, timeouts, 1);
+					if (rtt != NULL && rtt->nsamples > 0 && rtt->backoff < 8) {
+						rtt->backoff++;
+					}
 					return ECBM_ERR_TIMEOUT;
 				}
 			}
+			if (ecbm->clock_us != NULL) {
+				ecbm->sleep_ms(1);
+			}
+			else {
+				ecbm->sleep_ms(10);
+				elapsed_ms += 11;
+			}
 		}
 		else if (rc < 0) {
 			return ECBM_ERR_READ;
 		}
 	}
+	_ECBM_COUNT(ecbm, peer, frames_rx, 1);
+	if (rtt != NULL) {
+		_ecbm_rtt_sample(rtt, last_us - start_us);
+	}
+#if ECBM_STATS_EN
+	if (ecbm->clock_us != NULL) {
+		_ecbm_hist_add(&ecbm->stats.latency[sig < ECBM_STATS_MAX_SIG ? sig : ECBM_STATS_MAX_SIG], last_us - start_us);
+	}
+#endif
 
 	return rc;
 }
@@ -127,6 +306,9 @@ int ecbm_write(Ecbm* ecbm, uint8_t addr, uint16_t sig, const uint8_t* data, size
 	key = ecbm_get_session_key(ecbm, addr);
 	buf = framer7b_get_write_buf(&ecbm->framer);
 	nfill = key == NULL ? 0 : 8 - ((ndata + 9) % 8);
+	if (ndata + 9 + nfill > ECBM_MAX_FRAME) {
+		return ECBM_ERR_OVERFLOW;
+	}
 	buf[0] = nfill;
 	buf[1] = addr;
 	buf[2] = _ECBM_PD_DIR_REQ | _ECBM_PD_TYP_WRITE;
@@ -142,7 +324,7 @@ int ecbm_write(Ecbm* ecbm, uint8_t addr, uint16_t sig, const uint8_t* data, size
 	if (rc <= 0) {
 		return ECBM_ERR_ENCODE;
 	}
-	rc = _ecbm_transfer(ecbm, rc, addr);
+	rc = _ecbm_transfer(ecbm, rc, addr, sig, _ecbm_sig_class(sig, _ECBM_PD_TYP_WRITE));
 	if (rc < 0) {
 		return rc;
 	}
@@ -152,14 +334,14 @@ int ecbm_write(Ecbm* ecbm, uint8_t addr, uint16_t sig, const uint8_t* data, size
 	buf = framer7b_get_read_buf(&ecbm->framer);
 	if (key != NULL) {
 		if (rc % 8 != 0) {
-			return ECBM_ERR_INTEGRITY;
+			return _ecbm_account_answ(ecbm, addr, ECBM_ERR_INTEGRITY);
 		}
 		raiden_decode_buf(key, buf, rc);
 	}
-	return _ecbm_assert_answ(buf, rc, addr, _ECBM_PD_TYP_WRITE);
+	return _ecbm_account_answ(ecbm, addr, _ecbm_assert_answ(buf, rc, addr, _ECBM_PD_TYP_WRITE));
 }
 
-static int _ecbm_read(Ecbm* ecbm, uint8_t addr, uint16_t sig, uint8_t* buffer, size_t bufsize, uint8_t pd_typ) {
+static int _ecbm_read(Ecbm* ecbm, uint8_t addr, uint16_t sig, const uint8_t* req, size_t nreq, uint8_t* buffer, size_t bufsize, uint8_t pd_typ, int sig_class) {
 	uint8_t* buf;
 	uint8_t* key;
 	int rc;
@@ -167,27 +349,30 @@ static int _ecbm_read(Ecbm* ecbm, uint8_t addr, uint16_t sig, uint8_t* buffer, s
 
 	key = ecbm_get_session_key(ecbm, addr);
 	buf = framer7b_get_write_buf(&ecbm->framer);
-	nfill = key == NULL ? 0 : 7;
+	nfill = key == NULL ? 0 : (8 - (nreq + 9) % 8) % 8;
 	buf[0] = nfill;
 	buf[1] = addr;
 	buf[2] = _ECBM_PD_DIR_REQ | pd_typ;
 	stdser_s16(sig, &buf[3]);
-	stdser_s32(crc32(buf, 5), &buf[5]);
+	if (nreq > 0) {
+		memcpy(&buf[5], req, nreq);
+	}
+	stdser_s32(crc32(buf, nreq + 5), &buf[nreq + 5]);
 
 	key = ecbm_get_session_key(ecbm, addr);
 	if (key != NULL) {
-		memset(&buf[9], ECBM_ENC_FILL_BYTE, 7);
+		memset(&buf[nreq + 9], ECBM_ENC_FILL_BYTE, nfill);
 #if ECBM_DEBUG_EN
 		printf("[ECBM:READ] buf before enc: {");
-		for (size_t i = 0; i < 16; i++) {
+		for (size_t i = 0; i < nreq + 9 + nfill; i++) {
 			printf("%02X ", buf[i]);
 		}
 		printf("}\n");
 #endif
-		raiden_encode_buf(key, buf, 16);
+		raiden_encode_buf(key, buf, nreq + 9 + nfill);
 #if ECBM_DEBUG_EN
 		printf("[ECBM:READ] buf after enc: {");
-		for (size_t i = 0; i < 16; i++) {
+		for (size_t i = 0; i < nreq + 9 + nfill; i++) {
 			printf("%02X ", buf[i]);
 		}
 		printf("}\n");
@@ -196,31 +381,31 @@ static int _ecbm_read(Ecbm* ecbm, uint8_t addr, uint16_t sig, uint8_t* buffer, s
 #if ECBM_DEBUG_EN
 	else {
 		printf("[ECBM:READ] buf without enc: {");
-		for (size_t i = 0; i < 16; i++) {
+		for (size_t i = 0; i < nreq + 9 + nfill; i++) {
 			printf("%02X ", buf[i]);
 		}
 		printf("}\n");
 	}
 #endif
-	rc = framer7b_make(&ecbm->framer, 9 + nfill);
+	rc = framer7b_make(&ecbm->framer, nreq + 9 + nfill);
 	if (rc <= 0) {
 		return ECBM_ERR_ENCODE;
 	}
 #if ECBM_DEBUG_EN
 	printf("[ECBM:READ] bytes to send: %i\n", rc);
 #endif
-	rc = _ecbm_transfer(ecbm, rc, addr);
+	rc = _ecbm_transfer(ecbm, rc, addr, sig, sig_class);
 	if (rc < 0) {
 		return rc;
 	}
 	buf = framer7b_get_read_buf(&ecbm->framer);
 	if (key != NULL) {
 		if (rc % 8 != 0) {
-			return ECBM_ERR_INTEGRITY;
+			return _ecbm_account_answ(ecbm, addr, ECBM_ERR_INTEGRITY);
 		}
 		raiden_decode_buf(key, buf, rc);
 	}
-	rc = _ecbm_assert_answ(buf, rc, addr, _ECBM_PD_TYP_READ);
+	rc = _ecbm_account_answ(ecbm, addr, _ecbm_assert_answ(buf, rc, addr, _ECBM_PD_TYP_READ));
 	if (rc < 0) {
 		return rc;
 	}
@@ -232,7 +417,13 @@ static int _ecbm_read(Ecbm* ecbm, uint8_t addr, uint16_t sig, uint8_t* buffer, s
 }
 
 int ecbm_read(Ecbm* ecbm, uint8_t addr, uint16_t sig, uint8_t* buffer, size_t bufsize) {
-	return _ecbm_read(ecbm, addr, sig, buffer, bufsize, _ECBM_PD_TYP_READ);
+	return _ecbm_read(ecbm, addr, sig, NULL, 0, buffer, bufsize, _ECBM_PD_TYP_READ, _ecbm_sig_class(sig, _ECBM_PD_TYP_READ));
+}
+
+/* * * Read with request arguments, they go after sig like write data
+ * * */
+int ecbm_read_ex(Ecbm* ecbm, uint8_t addr, uint16_t sig, const uint8_t* req, size_t nreq, uint8_t* buffer, size_t bufsize) {
+	return _ecbm_read(ecbm, addr, sig, req, nreq, buffer, bufsize, _ECBM_PD_TYP_READ, _ecbm_sig_class(sig, _ECBM_PD_TYP_READ));
 }
 
 static int _ecbm_read_info(Ecbm* ecbm, uint8_t addr, EcbmDeviceInfo* info_buf, uint16_t sig) {
@@ -262,6 +453,25 @@ int ecbm_firmware_info(Ecbm* ecbm, uint8_t addr, EcbmDeviceInfo* info_buf) {
 	return _ecbm_read_info(ecbm, addr, info_buf, ECBM_SIG_BOOT_FW_INFO);
 }
 
+/* * * Liveness check of addr by ECBM_SIG_INFO with fixed timeout, rtt estimation
+ * is not touched, so probes of a rebooting device do not inflate later timeouts.
+ * Any answer counts, error code too: device is up, it just refused the request
+ * * */
+int ecbm_probe(Ecbm* ecbm, uint8_t addr, uint16_t timeout_ms) {
+	uint8_t buf[sizeof(EcbmDeviceInfo)];
+	uint16_t prev_timeout;
+	int rc;
+
+	prev_timeout = ecbm->timeout_ms;
+	ecbm->timeout_ms = timeout_ms;
+	rc = _ecbm_read(ecbm, addr, ECBM_SIG_INFO, NULL, 0, buf, sizeof(buf), _ECBM_PD_TYP_READ, ECBM_SIGCLS_NONE);
+	ecbm->timeout_ms = prev_timeout;
+	if (rc >= 0 || ECBM_IS_APP_ERR(rc)) {
+		return ECBM_OK;
+	}
+	return rc;
+}
+
 int ecbm_pick(Ecbm* ecbm, uint8_t addr) {
 	return ecbm_write(ecbm, addr, ECBM_SIG_PICK, NULL, 0);
 }
@@ -284,9 +494,177 @@ uint16_t ecbm_get_timeout(const Ecbm* ecbm) {
 	return ecbm->timeout_ms;
 }
 
+void ecbm_set_clock(Ecbm* ecbm, uint32_t (*clock_us)(void)) {
+	ecbm->clock_us = clock_us;
+}
+
+void ecbm_set_rto_limits(Ecbm* ecbm, uint16_t floor_ms, uint16_t ceil_ms) {
+	ecbm->rto_floor_ms = floor_ms;
+	ecbm->rto_ceil_ms = ceil_ms < floor_ms ? floor_ms : ceil_ms;
+}
+
+int ecbm_sig_class(uint16_t sig) {
+	switch (sig) {
+	case ECBM_SIG_RESET:
+		// Device may reboot before answer, timeout there says nothing about link
+		return ECBM_SIGCLS_NONE;
+	case ECBM_SIG_BOOT_BEGIN:
+	case ECBM_SIG_BOOT_END:
+		// Erase and image check take as long as the image is big, not as the link is slow;
+		// caller timeout is used, quick reads must not shrink it
+		return ECBM_SIGCLS_NONE;
+	case ECBM_SIG_BOOT_WRITE:
+		return ECBM_SIGCLS_FLASH;
+	case ECBM_SIG_BOOT_CHECKSUM:
+	case ECBM_SIG_BOOT_BLOCK_CRC:
+		return ECBM_SIGCLS_VERIFY;
+	case ECBM_SIG_INFO:
+	case ECBM_SIG_BOOT_FW_INFO:
+		return ECBM_SIGCLS_READ;
+	default:
+		// Reads are classified by request type, see _ecbm_sig_class
+		return ECBM_SIGCLS_WRITE;
+	}
+}
+
+const char* ecbm_sig_name(uint16_t sig) {
+	switch (sig) {
+	case ECBM_SIG_RESET:
+		return "reset";
+	case ECBM_SIG_INFO:
+		return "info";
+	case ECBM_SIG_PICK:
+		return "pick";
+	case ECBM_SIG_BOOT_BEGIN:
+		return "boot_begin";
+	case ECBM_SIG_BOOT_END:
+		return "boot_end";
+	case ECBM_SIG_BOOT_CHECKSUM:
+		return "boot_checksum";
+	case ECBM_SIG_BOOT_WRITE:
+		return "boot_write";
+	case ECBM_SIG_BOOT_FW_INFO:
+		return "boot_fw_info";
+	case ECBM_SIG_AKEY:
+		return "akey";
+	case ECBM_SIG_BAUD:
+		return "baud";
+	case ECBM_SIG_BOOT_BLOCK_CRC:
+		return "boot_block_crc";
+	case ECBM_SIG_BOOT_PROGRESS:
+		return "boot_progress";
+	default:
+		return NULL;
+	}
+}
+
+/* * * Parse frame data returned by framer7b (decoded in place when key given)
+ * return ECBM_OK when frame is consistent, ECBM_ERR_INTEGRITY otherwise
+ * * */
+int ecbm_parse_frame(uint8_t* data, size_t ndata, const uint8_t key[16], EcbmFrameInfo* info) {
+	size_t nhead;
+	size_t ncrc;
+	memset(info, 0, sizeof(EcbmFrameInfo));
+	if (key != NULL) {
+		if (ndata % 8 != 0) {
+			return ECBM_ERR_INTEGRITY;
+		}
+		raiden_decode_buf(key, data, ndata);
+	}
+	if (ndata < 7) {
+		return ECBM_ERR_INTEGRITY;
+	}
+	info->addr = data[1];
+	info->is_req = (data[2] & _ECBM_PD_DIR_MASK) == _ECBM_PD_DIR_REQ;
+	info->typ = data[2] & _ECBM_PD_TYP_MASK;
+	nhead = info->is_req ? 5 : 3;
+	if ((size_t)data[0] + 4 + nhead > ndata) {
+		return ECBM_ERR_INTEGRITY;
+	}
+	ncrc = ndata - (4 + data[0]);
+	info->crc_ok = crc32(data, ncrc) == stdser_g32(&data[ncrc]);
+	if (info->is_req) {
+		info->sig = stdser_g16(&data[3]);
+	}
+	else if (info->typ == _ECBM_PD_TYP_ERR) {
+		info->err = -(int16_t)data[3];
+	}
+	info->payload = &data[nhead];
+	info->npayload = ncrc - nhead;
+	return info->crc_ok ? ECBM_OK : ECBM_ERR_INTEGRITY;
+}
+
+int ecbm_frame_is_encs(const EcbmFrameInfo* info) {
+	return info->typ == _ECBM_PD_TYP_ENCS;
+}
+
+/* * * Device side: build answer frame in framer send buffer, return bytes to send
+ * for ECBM_TYP_ERR data is single byte with positive error code
+ * * */
+int ecbm_make_answer(Framer7b* framer, uint8_t addr, uint8_t typ, const uint8_t* data, size_t ndata, const uint8_t key[16]) {
+	uint8_t* buf;
+	uint8_t nfill;
+	if (ndata + 7 + 8 + (ndata + 7) / 7 + 2 > framer->bufsize) {
+		return ECBM_ERR_OVERFLOW;
+	}
+	buf = framer7b_get_write_buf(framer);
+	nfill = key == NULL ? 0 : (8 - (ndata + 7) % 8) % 8;
+	buf[0] = nfill;
+	buf[1] = addr;
+	buf[2] = _ECBM_PD_DIR_ANSW | typ;
+	if (ndata > 0) {
+		memcpy(&buf[3], data, ndata);
+	}
+	stdser_s32(crc32(buf, ndata + 3), &buf[ndata + 3]);
+	if (key != NULL) {
+		memset(&buf[ndata + 7], ECBM_ENC_FILL_BYTE, nfill);
+		raiden_encode_buf(key, buf, ndata + 7 + nfill);
+	}
+	return framer7b_make(framer, ndata + 7 + nfill);
+}
+
+uint16_t ecbm_get_rto(Ecbm* ecbm, uint8_t addr, int sig_class) {
+	return _ecbm_rto(ecbm, _ecbm_peer_rtt(ecbm, _ecbm_get_peer(ecbm, addr, 0), sig_class));
+}
+
+const EcbmRtt* ecbm_get_rtt(Ecbm* ecbm, uint8_t addr, int sig_class) {
+	EcbmPeer* peer;
+	if (sig_class < 0 || sig_class >= ECBM_SIGCLS_CNT) {
+		return NULL;
+	}
+	peer = _ecbm_get_peer(ecbm, addr, 0);
+	if (peer == NULL) {
+		return NULL;
+	}
+	return &peer->rtt[sig_class];
+}
+
+void ecbm_reset_rtt(Ecbm* ecbm, uint8_t addr) {
+	EcbmPeer* peer = _ecbm_get_peer(ecbm, addr, 0);
+	if (peer != NULL) {
+		memset(peer->rtt, 0, sizeof(peer->rtt));
+	}
+}
+
+/* * * Forget one class only, e.g. flash writes after block size change
+ * * */
+void ecbm_reset_rtt_class(Ecbm* ecbm, uint8_t addr, int sig_class) {
+	EcbmPeer* peer = _ecbm_get_peer(ecbm, addr, 0);
+	if (peer != NULL && sig_class >= 0 && sig_class < ECBM_SIGCLS_CNT) {
+		memset(&peer->rtt[sig_class], 0, sizeof(peer->rtt[sig_class]));
+	}
+}
+
 int ecbm_begin_upload_firmware(Ecbm* ecbm, uint8_t addr, const EcbmDeviceInfo* fw_info, const uint8_t test_phrase[16], uint16_t timeout_ms) {
-	uint8_t buf[32 + 3 + 16];
+	return ecbm_begin_upload_firmware_ex(ecbm, addr, fw_info, test_phrase, 0, 0, 0, timeout_ms);
+}
+
+/* * * Without flags request is the same as ecbm_begin_upload_firmware, so old bootloaders still work
+ * * */
+int ecbm_begin_upload_firmware_ex(Ecbm* ecbm, uint8_t addr, const EcbmDeviceInfo* fw_info, const uint8_t test_phrase[16], uint8_t flags, uint32_t raw_size, uint32_t checksum, uint16_t timeout_ms) {
+	uint8_t buf[32 + 3 + 16 + 9];
 	size_t ptr;
+	size_t ndata;
 	int rc;
 	uint16_t prev_timeout;
 	ptr = stdser_sstr(fw_info->name, buf, 32);
@@ -294,9 +672,16 @@ int ecbm_begin_upload_firmware(Ecbm* ecbm, uint8_t addr, const EcbmDeviceInfo* f
 	buf[ptr + 1] = fw_info->version[1];
 	buf[ptr + 2] = fw_info->version[2];
 	memcpy(&buf[ptr + 3], test_phrase, 16);
+	ndata = ptr + 19;
+	if (flags != 0) {
+		buf[ndata] = flags;
+		stdser_s32(raw_size, &buf[ndata + 1]);
+		stdser_s32(checksum, &buf[ndata + 5]);
+		ndata += 9;
+	}
 	prev_timeout = ecbm->timeout_ms;
 	ecbm->timeout_ms = timeout_ms;
-	rc = ecbm_write(ecbm, addr, ECBM_SIG_BOOT_BEGIN, buf, ptr + 19);
+	rc = ecbm_write(ecbm, addr, ECBM_SIG_BOOT_BEGIN, buf, ndata);
 	ecbm->timeout_ms = prev_timeout;
 	return rc;
 }
@@ -331,6 +716,50 @@ int ecbm_end_upload_firmware(Ecbm* ecbm, uint8_t addr, uint32_t checksum, size_t
 	return rc;
 }
 
+/* * * Highest contiguous offset written for image with checksum, 0 when device has other image in progress
+ * * */
+int ecbm_read_boot_progress(Ecbm* ecbm, uint8_t addr, uint32_t checksum, uint32_t* offset_buf) {
+	uint8_t req[4];
+	uint8_t buf[4];
+	int rc;
+	stdser_s32(checksum, req);
+	rc = ecbm_read_ex(ecbm, addr, ECBM_SIG_BOOT_PROGRESS, req, sizeof(req), buf, sizeof(buf));
+	if (rc < 0) {
+		return rc;
+	}
+	if (rc != 4) {
+		return ECBM_ERR_INTEGRITY;
+	}
+	*offset_buf = stdser_g32(buf);
+	return ECBM_OK;
+}
+
+/* * * Plaintext crc32 of count installed blocks starting from block first
+ * * */
+int ecbm_read_block_crcs(Ecbm* ecbm, uint8_t addr, uint16_t block_size, uint32_t first, uint16_t count, uint32_t* crcs_buf) {
+	uint8_t req[8];
+	uint8_t buf[ECBM_MAX_BLOCK_CRCS * 4];
+	int rc;
+	int i;
+	if (count > ECBM_MAX_BLOCK_CRCS) {
+		return ECBM_ERR_INC_ARG;
+	}
+	stdser_s16(block_size, req);
+	stdser_s32(first, &req[2]);
+	stdser_s16(count, &req[6]);
+	rc = ecbm_read_ex(ecbm, addr, ECBM_SIG_BOOT_BLOCK_CRC, req, sizeof(req), buf, sizeof(buf));
+	if (rc < 0) {
+		return rc;
+	}
+	if (rc != count * 4) {
+		return ECBM_ERR_INTEGRITY;
+	}
+	for (i = 0; i < count; i++) {
+		crcs_buf[i] = stdser_g32(&buf[i * 4]);
+	}
+	return count;
+}
+
 int ecbm_firmware_checksum(Ecbm* ecbm, uint8_t addr, uint32_t* checksum_buf) {
 	uint8_t buf[4];
 	int rc;
@@ -351,7 +780,7 @@ int ecbm_begin_enc_session(Ecbm* ecbm, uint8_t addr, const uint8_t base_key[16])
 	size_t i;
 
 	ecbm_close_enc_session(ecbm, addr);
-	rc = _ecbm_read(ecbm, addr, 0, buf, sizeof(buf), _ECBM_PD_TYP_ENCS);
+	rc = _ecbm_read(ecbm, addr, 0, NULL, 0, buf, sizeof(buf), _ECBM_PD_TYP_ENCS, _ecbm_sig_class(0, _ECBM_PD_TYP_ENCS));
 	if (rc < 0) {
 		return rc;
 	}
@@ -408,3 +837,175 @@ uint8_t* ecbm_get_session_key(Ecbm* ecbm, uint8_t addr) {
 int ecbm_set_new_auth_key(Ecbm* ecbm, uint8_t addr, const uint8_t new_key[16]) {
 	return ecbm_write(ecbm, addr, ECBM_SIG_AKEY, new_key, 16);
 }
+
+int ecbm_stats_snapshot(const Ecbm* ecbm, EcbmStats* stats_buf) {
+#if ECBM_STATS_EN
+	memcpy(stats_buf, &ecbm->stats, sizeof(EcbmStats));
+	return ECBM_OK;
+#else
+	memset(stats_buf, 0, sizeof(EcbmStats));
+	return ECBM_ERR_NO_SIG;
+#endif
+}
+
+int ecbm_peer_stats_snapshot(const Ecbm* ecbm, uint8_t addr, EcbmCounters* stats_buf) {
+#if ECBM_STATS_EN
+	size_t i;
+	for (i = 0; i < ECBM_MAX_PEERS; i++) {
+		if (addr != 0 && ecbm->peers[i].addr == addr) {
+			memcpy(stats_buf, &ecbm->peers[i].stats, sizeof(EcbmCounters));
+			return ECBM_OK;
+		}
+	}
+	return ECBM_ERR_INC_ARG;
+#else
+	memset(stats_buf, 0, sizeof(EcbmCounters));
+	return ECBM_ERR_NO_SIG;
+#endif
+}
+
+void ecbm_stats_reset(Ecbm* ecbm) {
+#if ECBM_STATS_EN
+	size_t i;
+	memset(&ecbm->stats, 0, sizeof(ecbm->stats));
+	for (i = 0; i < ECBM_MAX_PEERS; i++) {
+		memset(&ecbm->peers[i].stats, 0, sizeof(ecbm->peers[i].stats));
+	}
+#endif
+}
+
+size_t ecbm_hist_bucket(uint32_t value_us) {
+	uint32_t msb;
+	if (value_us < (1u << ECBM_HIST_SUB_BITS)) {
+		return value_us;
+	}
+	msb = _ecbm_msb(value_us);
+	return ((msb - ECBM_HIST_SUB_BITS + 1) << ECBM_HIST_SUB_BITS) + ((value_us >> (msb - ECBM_HIST_SUB_BITS)) & ((1u << ECBM_HIST_SUB_BITS) - 1));
+}
+
+/* * * Lowest value that falls into the bucket
+ * * */
+uint32_t ecbm_hist_bucket_value(size_t bucket) {
+	size_t major = bucket >> ECBM_HIST_SUB_BITS;
+	uint32_t sub = (uint32_t)(bucket & ((1u << ECBM_HIST_SUB_BITS) - 1));
+	if (major == 0) {
+		return sub;
+	}
+	return ((1u << ECBM_HIST_SUB_BITS) + sub) << (major - 1);
+}
+
+uint32_t ecbm_hist_percentile(const EcbmHist* hist, uint16_t permille) {
+	uint64_t rank;
+	uint64_t acc = 0;
+	size_t i;
+	if (hist->count == 0) {
+		return 0;
+	}
+	rank = ((uint64_t)hist->count * permille + 999) / 1000;
+	if (rank == 0) {
+		rank = 1;
+	}
+	for (i = 0; i < ECBM_HIST_BUCKETS; i++) {
+		acc += hist->buckets[i];
+		if (acc >= rank) {
+			if (i + 1 < ECBM_HIST_BUCKETS && ecbm_hist_bucket_value(i + 1) - 1 < hist->max_us) {
+				return ecbm_hist_bucket_value(i + 1) - 1;
+			}
+			return hist->max_us;
+		}
+	}
+	return hist->max_us;
+}
+
+void ecbm_set_baud_cb(Ecbm* ecbm, int (*set_baud)(size_t id, uint32_t baud), uint32_t baud) {
+	ecbm->set_baud = set_baud;
+	ecbm->baud = baud;
+}
+
+uint32_t ecbm_get_baud(const Ecbm* ecbm) {
+	return ecbm->baud;
+}
+
+/* * * Host side rate change, devices are not asked; for devices back at default rate after reset
+ * * */
+int ecbm_set_baud(Ecbm* ecbm, uint32_t baud) {
+	if (ecbm->set_baud == NULL) {
+		return ECBM_ERR_INC_ARG;
+	}
+	if (baud == ecbm->baud) {
+		return ECBM_OK;
+	}
+	if (ecbm->set_baud(ecbm->id, baud) < 0) {
+		return ECBM_ERR_INTERNAL;
+	}
+	ecbm->baud = baud;
+	return ECBM_OK;
+}
+
+/* * * Read baud rates supported by device, return count
+ * * */
+int ecbm_read_bauds(Ecbm* ecbm, uint8_t addr, uint32_t* bauds_buf, size_t nmax) {
+	uint8_t buf[ECBM_MAX_BAUDS * 4];
+	int rc;
+	int i;
+	rc = ecbm_read(ecbm, addr, ECBM_SIG_BAUD, buf, sizeof(buf));
+	if (rc < 0) {
+		return rc;
+	}
+	if (rc % 4 != 0) {
+		return ECBM_ERR_INTEGRITY;
+	}
+	rc /= 4;
+	if ((size_t)rc > nmax) {
+		rc = (int)nmax;
+	}
+	for (i = 0; i < rc; i++) {
+		bauds_buf[i] = stdser_g32(&buf[i * 4]);
+	}
+	return rc;
+}
+
+/* * * Device answers at current rate and then switches, it goes back to
+ * previous rate when no frame arrives at new one for ECBM_BAUD_CONFIRM_MS.
+ * On failed confirmation host returns to previous rate too, waits for device
+ * to revert and checks the link again
+ * * */
+int ecbm_switch_baud(Ecbm* ecbm, uint8_t addr, uint32_t baud) {
+	uint8_t buf[4];
+	uint32_t prev_baud;
+	EcbmDeviceInfo info;
+	int rc;
+	if (ecbm->set_baud == NULL) {
+		return ECBM_ERR_INC_ARG;
+	}
+	if (baud == ecbm->baud) {
+		return ECBM_OK;
+	}
+	prev_baud = ecbm->baud;
+	stdser_s32(baud, buf);
+	rc = ecbm_write(ecbm, addr, ECBM_SIG_BAUD, buf, 4);
+	if (rc < 0) {
+		return rc;
+	}
+	if (ecbm->set_baud(ecbm->id, baud) < 0) {
+		rc = ECBM_ERR_INTERNAL;
+	}
+	else {
+		ecbm->baud = baud;
+		ecbm->sleep_ms(ECBM_BAUD_SETTLE_MS);
+		// Round trip times depend on rate
+		ecbm_reset_rtt(ecbm, addr);
+		rc = ecbm_read_info(ecbm, addr, &info);
+		if (rc == ECBM_OK) {
+			return ECBM_OK;
+		}
+	}
+	ecbm->set_baud(ecbm->id, prev_baud);
+	ecbm->baud = prev_baud;
+	ecbm_reset_rtt(ecbm, addr);
+	ecbm->sleep_ms(ECBM_BAUD_CONFIRM_MS);
+	if (ecbm_read_info(ecbm, addr, &info) < 0) {
+		return ECBM_ERR_TIMEOUT;
+	}
+	return rc;
+}
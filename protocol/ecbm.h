@@ -11,9 +11,21 @@ extern "C" {
 #include <stdint.h>
 
 #define ECBM_DEBUG_EN			0
+#define ECBM_STATS_EN			1
 #define ECBM_DEF_TIMEOUT_MS		250
 #define ECBM_ENC_FILL_BYTE		0x5A
 #define ECBM_MAX_ENC_SESSIONS	8
+#define ECBM_MAX_PEERS			8
+#define ECBM_RTO_FLOOR_MS		20
+#define ECBM_RTO_CEIL_MS		5000
+#define ECBM_STATS_MAX_SIG		32
+#define ECBM_HIST_SUB_BITS		3
+#define ECBM_HIST_BUCKETS		((32 - ECBM_HIST_SUB_BITS + 1) << ECBM_HIST_SUB_BITS)
+#define ECBM_MAX_BAUDS			16
+#define ECBM_BAUD_CONFIRM_MS	1000
+#define ECBM_BAUD_SETTLE_MS		10
+#define ECBM_MAX_BLOCK_CRCS		64
+#define ECBM_MAX_FRAME			4096	// frame bytes before 7 bit encoding, framer7b buffer limit
 
 #define ECBM_OK				0
 #define _ECBM_ERRB_APP		-1
@@ -55,6 +67,38 @@ extern "C" {
 #define ECBM_SIG_BOOT_WRITE		20
 #define ECBM_SIG_BOOT_FW_INFO	22
 #define ECBM_SIG_AKEY			24
+#define ECBM_SIG_BAUD			26
+#define ECBM_SIG_BOOT_BLOCK_CRC	28
+#define ECBM_SIG_BOOT_PROGRESS	30
+
+/* * * BOOT_BEGIN flags, sent after test phrase together with image size
+ * (decompressed) and checksum.
+ * LZSS: blocks are lzss stream (see lzss.h) and must be written in order,
+ * a block at already written offset is acknowledged without programming.
+ * KEEP: installed image is not erased, only written blocks are reprogrammed
+ * (read-modify-write of flash pages), BOOT_END verifies the whole image.
+ * RESUME: device keeps highest contiguous written offset of the image with
+ * this checksum across resets (ECBM_SIG_BOOT_PROGRESS), and begin of the
+ * same image does not erase what is already written.
+ * SPARSE: host skips regions left erased (0xFF), they are part of the image
+ * and its checksum; blocks still come in ascending order
+ * * */
+#define ECBM_BOOT_FLAG_LZSS		0x01
+#define ECBM_BOOT_FLAG_KEEP		0x02
+#define ECBM_BOOT_FLAG_RESUME	0x04
+#define ECBM_BOOT_FLAG_SPARSE	0x08
+
+#define ECBM_TYP_WRITE			0
+#define ECBM_TYP_READ			1
+#define ECBM_TYP_ENCS			4
+#define ECBM_TYP_ERR			8
+
+#define ECBM_SIGCLS_NONE		-1
+#define ECBM_SIGCLS_READ		0
+#define ECBM_SIGCLS_WRITE		1
+#define ECBM_SIGCLS_FLASH		2
+#define ECBM_SIGCLS_VERIFY		3
+#define ECBM_SIGCLS_CNT			4
 
 typedef struct EcbmDeviceInfo {
 	char name[32];
@@ -66,14 +110,87 @@ typedef struct EcbmEncSession {
 	uint8_t key[16];
 } EcbmEncSession;
 
+/* * * Smoothed round trip estimation (RFC 6298), times in microseconds
+ * nsamples == 0 means that class has not been measured yet and the
+ * caller supplied timeout is used as is
+ * * */
+typedef struct EcbmRtt {
+	uint32_t srtt_us;
+	uint32_t rttvar_us;
+	uint32_t nsamples;
+	uint8_t backoff;
+} EcbmRtt;
+
+typedef struct EcbmCounters {
+	uint32_t frames_tx;
+	uint32_t frames_rx;
+	uint64_t bytes_tx;
+	uint64_t bytes_rx;
+	uint32_t integrity_errs;
+	uint32_t timeouts;
+	uint32_t resyncs;
+	uint32_t dev_errs;
+	int16_t last_dev_err;
+} EcbmCounters;
+
+/* * * Log-linear (HDR style) latency histogram in microseconds
+ * values below 2^ECBM_HIST_SUB_BITS have own bucket, above that every power
+ * of two is split into 2^ECBM_HIST_SUB_BITS buckets (12.5% resolution)
+ * * */
+typedef struct EcbmHist {
+	uint32_t count;
+	uint32_t max_us;
+	uint64_t sum_us;
+	uint32_t buckets[ECBM_HIST_BUCKETS];
+} EcbmHist;
+
+/* * * latency[ECBM_STATS_MAX_SIG] is shared by all sigs above the limit
+ * * */
+typedef struct EcbmStats {
+	EcbmCounters bus;
+	uint32_t dev_err_codes[256];
+	EcbmHist latency[ECBM_STATS_MAX_SIG + 1];
+} EcbmStats;
+
+typedef struct EcbmPeer {
+	uint8_t addr;
+	EcbmRtt rtt[ECBM_SIGCLS_CNT];
+#if ECBM_STATS_EN
+	EcbmCounters stats;
+#endif
+} EcbmPeer;
+
+/* * * Decoded frame as seen on the wire, for offline tools
+ * sig is valid for requests only, err for error answers only
+ * * */
+typedef struct EcbmFrameInfo {
+	uint8_t addr;
+	uint8_t is_req;
+	uint8_t typ;
+	uint8_t crc_ok;
+	uint16_t sig;
+	int16_t err;
+	const uint8_t* payload;
+	size_t npayload;
+} EcbmFrameInfo;
+
 typedef struct Ecbm {
 	size_t id;
 	int (*write)(size_t id, const uint8_t* data, size_t ndata);
 	int (*read)(size_t id, uint8_t* buf, size_t bufsize);
 	void (*sleep_ms)(uint32_t ms);
+	uint32_t (*clock_us)(void);
+	int (*set_baud)(size_t id, uint32_t baud);
+	uint32_t baud;
 	Framer7b framer;
 	uint16_t timeout_ms;
+	uint16_t rto_floor_ms;
+	uint16_t rto_ceil_ms;
 	EcbmEncSession enc_sessions[ECBM_MAX_ENC_SESSIONS];
+	EcbmPeer peers[ECBM_MAX_PEERS];
+#if ECBM_STATS_EN
+	EcbmStats stats;
+#endif
 } Ecbm;
 
 void ecbm_init(
@@ -86,27 +203,54 @@ void ecbm_init(
 
 int ecbm_write(Ecbm* ecbm, uint8_t addr, uint16_t sig, const uint8_t* data, size_t ndata);
 int ecbm_read(Ecbm* ecbm, uint8_t addr, uint16_t sig, uint8_t* buf, size_t bufsize);
+int ecbm_read_ex(Ecbm* ecbm, uint8_t addr, uint16_t sig, const uint8_t* req, size_t nreq, uint8_t* buf, size_t bufsize);
 int ecbm_read_info(Ecbm* ecbm, uint8_t addr, EcbmDeviceInfo* info_buf);
+int ecbm_probe(Ecbm* ecbm, uint8_t addr, uint16_t timeout_ms);
 int ecbm_pick(Ecbm* ecbm, uint8_t addr);
 void ecbm_reset(Ecbm* ecbm, uint8_t addr);
 void ecbm_reset_bus(Ecbm* ecbm);
 void ecbm_set_timeout(Ecbm* ecbm, uint16_t timeout_ms);
 uint16_t ecbm_get_timeout(const Ecbm* ecbm);
+void ecbm_set_clock(Ecbm* ecbm, uint32_t (*clock_us)(void));
+void ecbm_set_rto_limits(Ecbm* ecbm, uint16_t floor_ms, uint16_t ceil_ms);
+int ecbm_sig_class(uint16_t sig);
+const char* ecbm_sig_name(uint16_t sig);
+int ecbm_parse_frame(uint8_t* data, size_t ndata, const uint8_t key[16], EcbmFrameInfo* info);
+int ecbm_frame_is_encs(const EcbmFrameInfo* info);
+int ecbm_make_answer(Framer7b* framer, uint8_t addr, uint8_t typ, const uint8_t* data, size_t ndata, const uint8_t key[16]);
+uint16_t ecbm_get_rto(Ecbm* ecbm, uint8_t addr, int sig_class);
+const EcbmRtt* ecbm_get_rtt(Ecbm* ecbm, uint8_t addr, int sig_class);
+void ecbm_reset_rtt(Ecbm* ecbm, uint8_t addr);
+void ecbm_reset_rtt_class(Ecbm* ecbm, uint8_t addr, int sig_class);
+
+int ecbm_stats_snapshot(const Ecbm* ecbm, EcbmStats* stats_buf);
+int ecbm_peer_stats_snapshot(const Ecbm* ecbm, uint8_t addr, EcbmCounters* stats_buf);
+void ecbm_stats_reset(Ecbm* ecbm);
+size_t ecbm_hist_bucket(uint32_t value_us);
+uint32_t ecbm_hist_bucket_value(size_t bucket);
+uint32_t ecbm_hist_percentile(const EcbmHist* hist, uint16_t permille);
 
 int ecbm_begin_upload_firmware(Ecbm* ecbm, uint8_t addr, const EcbmDeviceInfo* fw_info, const uint8_t test_phrase[16], uint16_t timeout_ms);
+int ecbm_begin_upload_firmware_ex(Ecbm* ecbm, uint8_t addr, const EcbmDeviceInfo* fw_info, const uint8_t test_phrase[16], uint8_t flags, uint32_t raw_size, uint32_t checksum, uint16_t timeout_ms);
 int ecbm_write_firmware_block(Ecbm* ecbm, uint8_t addr, const uint8_t* data, size_t ndata, size_t offset, uint16_t timeout_ms);
 int ecbm_end_upload_firmware(Ecbm* ecbm, uint8_t addr, uint32_t checksum, size_t fw_len, uint16_t timeout_ms);
 int ecbm_firmware_checksum(Ecbm* ecbm, uint8_t addr, uint32_t* checksum_buf);
+int ecbm_read_boot_progress(Ecbm* ecbm, uint8_t addr, uint32_t checksum, uint32_t* offset_buf);
+int ecbm_read_block_crcs(Ecbm* ecbm, uint8_t addr, uint16_t block_size, uint32_t first, uint16_t count, uint32_t* crcs_buf);
 int ecbm_firmware_info(Ecbm* ecbm, uint8_t addr, EcbmDeviceInfo* info_buf);
 
-void ecbm_set_timeout(Ecbm* ecbm, uint16_t timeout_ms);
-
 int ecbm_begin_enc_session(Ecbm* ecbm, uint8_t addr, const uint8_t base_key[16]);
 int ecbm_close_enc_session(Ecbm* ecbm, uint8_t addr);
 int ecbm_close_all_enc_session(Ecbm* ecbm);
 uint8_t* ecbm_get_session_key(Ecbm* ecbm, uint8_t addr);
 int ecbm_set_new_auth_key(Ecbm* ecbm, uint8_t addr, const uint8_t new_key[16]);
 
+void ecbm_set_baud_cb(Ecbm* ecbm, int (*set_baud)(size_t id, uint32_t baud), uint32_t baud);
+uint32_t ecbm_get_baud(const Ecbm* ecbm);
+int ecbm_set_baud(Ecbm* ecbm, uint32_t baud);
+int ecbm_read_bauds(Ecbm* ecbm, uint8_t addr, uint32_t* bauds_buf, size_t nmax);
+int ecbm_switch_baud(Ecbm* ecbm, uint8_t addr, uint32_t baud);
+
 #ifdef __cplusplus
 }
 #endif
@@ -43,6 +43,11 @@ static int _framer7b_decode(uint8_t* data, size_t ndata) {
 	return (int)nrData;
 }
 
+void framer7b_init(Framer7b* framer) {
+	framer->bufsize = FRAMER7B_BUFSIZE;
+	framer7b_reset(framer);
+}
+
 void framer7b_reset(Framer7b* framer) {
 	framer->bufptr = 0;
 	framer->state = _FRAMER7B_STATE_WAIT;
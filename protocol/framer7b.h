@@ -23,6 +23,7 @@ int framer7b_make(Framer7b* framer, size_t ndata);
 uint8_t* framer7b_get_write_buf(Framer7b* framer);
 uint8_t* framer7b_get_read_buf(Framer7b* framer);
 uint8_t* framer7b_get_send_buf(Framer7b* framer);
+void framer7b_init(Framer7b* framer);
 void framer7b_reset(Framer7b* framer);
 
 #ifdef __cplusplus
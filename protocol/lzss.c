@@ -0,0 +1,178 @@
+#include "lzss.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define _LZSS_HASH_BITS		12
+#define _LZSS_MAX_CHAIN		64
+#define _LZSS_WINDOW_MASK	(LZSS_WINDOW - 1)
+
+static uint32_t _lzss_hash(const uint8_t* p) {
+	uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+	return (v * 2654435761u) >> (32 - _LZSS_HASH_BITS);
+}
+
+static void _lzss_insert(int32_t* head, int32_t* prev, const uint8_t* in, size_t nin, size_t pos) {
+	uint32_t h;
+	if (pos + LZSS_MIN_LEN > nin) {
+		return;
+	}
+	h = _lzss_hash(&in[pos]);
+	prev[pos & _LZSS_WINDOW_MASK] = head[h];
+	head[h] = (int32_t)pos;
+}
+
+/* * * Worst case output size, every byte as literal
+ * * */
+size_t lzss_bound(size_t nin) {
+	return nin + nin / 8 + 1;
+}
+
+/* * * Return compressed size or error code
+ * * */
+int lzss_encode(const uint8_t* in, size_t nin, uint8_t* out, size_t nout) {
+	int32_t* head;
+	int32_t* prev;
+	size_t ip = 0;
+	size_t op = 0;
+	size_t flag_pos = 0;
+	uint8_t nitems = 8;
+	size_t i;
+	head = malloc(sizeof(int32_t) << _LZSS_HASH_BITS);
+	prev = malloc(sizeof(int32_t) * LZSS_WINDOW);
+	if (head == NULL || prev == NULL) {
+		free(head);
+		free(prev);
+		return LZSS_ERR_NO_MEM;
+	}
+	for (i = 0; i < ((size_t)1 << _LZSS_HASH_BITS); i++) {
+		head[i] = -1;
+	}
+	while (ip < nin) {
+		size_t best_len = 0;
+		size_t best_dist = 0;
+		if (nitems == 8) {
+			if (op >= nout) {
+				break;
+			}
+			flag_pos = op;
+			out[op++] = 0;
+			nitems = 0;
+		}
+		if (ip + LZSS_MIN_LEN <= nin) {
+			size_t max_len = nin - ip < LZSS_MAX_LEN ? nin - ip : LZSS_MAX_LEN;
+			int32_t cand = head[_lzss_hash(&in[ip])];
+			int steps = 0;
+			while (cand >= 0 && ip - (size_t)cand <= LZSS_WINDOW && steps++ < _LZSS_MAX_CHAIN) {
+				size_t len = 0;
+				while (len < max_len && in[cand + len] == in[ip + len]) {
+					len++;
+				}
+				if (len > best_len) {
+					best_len = len;
+					best_dist = ip - (size_t)cand;
+					if (len == max_len) {
+						break;
+					}
+				}
+				cand = prev[cand & _LZSS_WINDOW_MASK];
+			}
+		}
+		if (best_len >= LZSS_MIN_LEN) {
+			uint16_t token = (uint16_t)(((best_dist - 1) << LZSS_LEN_BITS) | (best_len - LZSS_MIN_LEN));
+			if (op + 2 > nout) {
+				break;
+			}
+			out[op++] = (uint8_t)(token >> 8);
+			out[op++] = (uint8_t)token;
+			for (i = 0; i < best_len; i++) {
+				_lzss_insert(head, prev, in, nin, ip + i);
+			}
+			ip += best_len;
+		}
+		else {
+			if (op >= nout) {
+				break;
+			}
+			out[flag_pos] |= (uint8_t)(1 << nitems);
+			out[op++] = in[ip];
+			_lzss_insert(head, prev, in, nin, ip);
+			ip++;
+		}
+		nitems++;
+	}
+	free(head);
+	free(prev);
+	if (ip < nin) {
+		return LZSS_ERR_OVERFLOW;
+	}
+	return (int)op;
+}
+
+void lzss_decoder_init(LzssDecoder* dec) {
+	dec->nout = 0;
+	dec->flags = 0;
+	dec->nitems = 0;
+	dec->hold = 0;
+	dec->has_hold = 0;
+}
+
+/* * * Decode next chunk of stream, return count of bytes written to out.
+ * Output stops at nout, so padding after end of stream is dropped when
+ * nout is the rest of known decompressed size
+ * * */
+int lzss_decode_push(LzssDecoder* dec, const uint8_t* in, size_t nin, uint8_t* out, size_t nout) {
+	size_t n = 0;
+	size_t i;
+	for (i = 0; i < nin && n < nout; i++) {
+		uint8_t b = in[i];
+		if (dec->nitems == 0) {
+			dec->flags = b;
+			dec->nitems = 8;
+		}
+		else if (dec->flags & 1) {
+			dec->window[dec->nout & _LZSS_WINDOW_MASK] = b;
+			dec->nout++;
+			out[n++] = b;
+			dec->flags >>= 1;
+			dec->nitems--;
+		}
+		else if (!dec->has_hold) {
+			dec->hold = b;
+			dec->has_hold = 1;
+		}
+		else {
+			uint16_t token = (uint16_t)((dec->hold << 8) | b);
+			size_t dist = (size_t)(token >> LZSS_LEN_BITS) + 1;
+			size_t len = (size_t)(token & ((1 << LZSS_LEN_BITS) - 1)) + LZSS_MIN_LEN;
+			if (dist > dec->nout) {
+				return LZSS_ERR_DATA;
+			}
+			while (len-- > 0 && n < nout) {
+				uint8_t c = dec->window[(dec->nout - dist) & _LZSS_WINDOW_MASK];
+				dec->window[dec->nout & _LZSS_WINDOW_MASK] = c;
+				dec->nout++;
+				out[n++] = c;
+			}
+			dec->has_hold = 0;
+			dec->flags >>= 1;
+			dec->nitems--;
+		}
+	}
+	return (int)n;
+}
+
+/* * * Decode whole stream, heap allocated decoder
+ * * */
+int lzss_decode(const uint8_t* in, size_t nin, uint8_t* out, size_t nout) {
+	int rc;
+	LzssDecoder* dec = malloc(sizeof(LzssDecoder));
+	if (dec == NULL) {
+		return LZSS_ERR_NO_MEM;
+	}
+	lzss_decoder_init(dec);
+	rc = lzss_decode_push(dec, in, nin, out, nout);
+	free(dec);
+	return rc;
+}
@@ -0,0 +1,45 @@
+#ifndef LZSS
+#define LZSS
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* * * LZSS with 1 KB window, decoder needs about 1 KB of RAM and decodes
+ * stream by arbitrary chunks, so it fits bootloader flashing block by block.
+ * Stream is groups of flag byte (LSB first, 1 - literal, 0 - reference) and
+ * 8 items, reference is 16 bit big endian: (distance - 1) << 6 | (length - 3)
+ * * */
+#define LZSS_WINDOW_BITS	10
+#define LZSS_LEN_BITS		6
+#define LZSS_WINDOW			(1 << LZSS_WINDOW_BITS)
+#define LZSS_MIN_LEN		3
+#define LZSS_MAX_LEN		((1 << LZSS_LEN_BITS) - 1 + LZSS_MIN_LEN)
+
+#define LZSS_ERR_OVERFLOW	-1
+#define LZSS_ERR_NO_MEM		-2
+#define LZSS_ERR_DATA		-3
+
+typedef struct LzssDecoder {
+	uint8_t window[LZSS_WINDOW];
+	size_t nout;
+	uint8_t flags;
+	uint8_t nitems;
+	uint8_t hold;
+	uint8_t has_hold;
+} LzssDecoder;
+
+size_t lzss_bound(size_t nin);
+int lzss_encode(const uint8_t* in, size_t nin, uint8_t* out, size_t nout);
+void lzss_decoder_init(LzssDecoder* dec);
+int lzss_decode_push(LzssDecoder* dec, const uint8_t* in, size_t nin, uint8_t* out, size_t nout);
+int lzss_decode(const uint8_t* in, size_t nin, uint8_t* out, size_t nout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // !LZSS
@@ -19,6 +19,45 @@ static void _raiden_encode_block(const uint32_t key[4], const uint32_t data[2],
 }
 
 
+static void _raiden_subkeys(const uint32_t key[4], uint32_t subkeys[16]) {
+	uint32_t k[4] = { key[0],key[1],key[2],key[3] };
+	int i;
+
+	for (i = 0; i < 16; i++) subkeys[i] = k[i % 4] = ((k[0] + k[1]) + ((k[2] + k[3]) ^ (k[0] << (k[2] & 0x1F))));
+}
+
+/* * *
+ * RAIDEN_LANES keys encode same block side by side, lane i of b0/b1 belongs to key i.
+ * GCC and Clang get vector types, other compilers a loop they may vectorize.
+ * * */
+#if defined(__GNUC__)
+typedef uint32_t _raiden_lanes_t __attribute__((vector_size(RAIDEN_LANES * 4)));
+#define _RAIDEN_LANE(v, i)	((v)[i])
+
+static void _raiden_encode_lanes_block(const _raiden_lanes_t subkeys[16], _raiden_lanes_t* b0, _raiden_lanes_t* b1) {
+	int i;
+
+	for (i = 0; i < 16; i++)
+	{
+		*b0 += ((subkeys[i] + *b1) << 9) ^ ((subkeys[i] - *b1) ^ ((subkeys[i] + *b1) >> 14));
+		*b1 += ((subkeys[i] + *b0) << 9) ^ ((subkeys[i] - *b0) ^ ((subkeys[i] + *b0) >> 14));
+	}
+}
+#else
+typedef struct { uint32_t v[RAIDEN_LANES]; } _raiden_lanes_t;
+#define _RAIDEN_LANE(v, i)	((v).v[i])
+
+static void _raiden_encode_lanes_block(const _raiden_lanes_t subkeys[16], _raiden_lanes_t* b0, _raiden_lanes_t* b1) {
+	int i, l;
+
+	for (i = 0; i < 16; i++)
+	{
+		for (l = 0; l < RAIDEN_LANES; l++) b0->v[l] += ((subkeys[i].v[l] + b1->v[l]) << 9) ^ ((subkeys[i].v[l] - b1->v[l]) ^ ((subkeys[i].v[l] + b1->v[l]) >> 14));
+		for (l = 0; l < RAIDEN_LANES; l++) b1->v[l] += ((subkeys[i].v[l] + b0->v[l]) << 9) ^ ((subkeys[i].v[l] - b0->v[l]) ^ ((subkeys[i].v[l] + b0->v[l]) >> 14));
+	}
+}
+#endif
+
 static void _raiden_decode_block(const uint32_t key[4], const uint32_t data[2], uint32_t result[2])
 {
 	uint32_t b0 = data[0], b1 = data[1], k[4] = { key[0],key[1],key[2],key[3] }, subkeys[16];
@@ -65,4 +104,33 @@ void raiden_decode_buf(const uint8_t key[16], uint8_t* data, size_t ndata) {
 		_raiden_decode_block((uint32_t*)key, (uint32_t*)&data[i], (uint32_t*)buf);
 		memcpy(&data[i], buf, 8);
 	}
-}
\ No newline at end of file
+}
+
+void raiden_encode_lanes(const uint8_t* keys, size_t nkeys, const uint8_t* data, uint8_t* bufs, size_t ndata) {
+	_raiden_lanes_t subkeys[16], b0, b1;
+	uint32_t key[4], lane_subkeys[16], block[2];
+	size_t first, i;
+	int l, r;
+
+	for (first = 0; first < nkeys; first += RAIDEN_LANES) {
+		// Lanes past last key repeat it and are not stored
+		for (l = 0; l < RAIDEN_LANES; l++) {
+			memcpy(key, &keys[(first + l < nkeys ? first + l : nkeys - 1) * 16], 16);
+			_raiden_subkeys(key, lane_subkeys);
+			for (r = 0; r < 16; r++) _RAIDEN_LANE(subkeys[r], l) = lane_subkeys[r];
+		}
+		for (i = 0; i < ndata; i += 8) {
+			memcpy(block, &data[i], 8);
+			for (l = 0; l < RAIDEN_LANES; l++) {
+				_RAIDEN_LANE(b0, l) = block[0];
+				_RAIDEN_LANE(b1, l) = block[1];
+			}
+			_raiden_encode_lanes_block(subkeys, &b0, &b1);
+			for (l = 0; l < RAIDEN_LANES && first + l < nkeys; l++) {
+				block[0] = _RAIDEN_LANE(b0, l);
+				block[1] = _RAIDEN_LANE(b1, l);
+				memcpy(&bufs[(first + l) * ndata + i], block, 8);
+			}
+		}
+	}
+}
@@ -8,10 +8,14 @@ extern "C" {
 #include <stdint.h>
 #include <stdlib.h>
 
+#define RAIDEN_LANES	8
+
 void raiden_encode(const uint8_t key[16], const uint8_t* data, uint8_t* buf, size_t ndata);
 void raiden_decode(const uint8_t key[16], const uint8_t* data, uint8_t* buf, size_t ndata);
 void raiden_encode_buf(const uint8_t key[16], uint8_t* data, size_t ndata);
 void raiden_decode_buf(const uint8_t key[16], uint8_t* data, size_t ndata);
+// Encodes data under nkeys keys (16 bytes each, in a row), result of key i goes to bufs + i * ndata
+void raiden_encode_lanes(const uint8_t* keys, size_t nkeys, const uint8_t* data, uint8_t* bufs, size_t ndata);
 
 #ifdef __cplusplus
 }
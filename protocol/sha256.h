@@ -0,0 +1,28 @@
+#ifndef SHA256
+#define SHA256
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define SHA256_SIZE		32
+
+typedef struct Sha256 {
+	uint32_t state[8];
+	uint64_t nbytes;
+	uint8_t buf[64];
+	size_t nbuf;
+} Sha256;
+
+void sha256_init(Sha256* ctx);
+void sha256_update(Sha256* ctx, const uint8_t* data, size_t ndata);
+void sha256_final(Sha256* ctx, uint8_t digest[SHA256_SIZE]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // !SHA256
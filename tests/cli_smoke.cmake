@@ -0,0 +1,53 @@
+# Command line smoke test: encrypt an image, verify it and upload it to the emulated bootloader.
+# cmake -DFWU=<firmware_utils> -DWORK_DIR=<dir> -P cli_smoke.cmake
+
+set(KEY 00112233445566778899AABBCCDDEEFF)
+
+function(fwu)
+	cmake_parse_arguments(ARG "FAIL" "INPUT;EXPECT" "" ${ARGN})
+	set(input_args)
+	if (ARG_INPUT)
+		file(WRITE ${WORK_DIR}/input.txt "${ARG_INPUT}\n")
+		set(input_args INPUT_FILE ${WORK_DIR}/input.txt)
+	endif()
+	execute_process(COMMAND ${FWU} ${ARG_UNPARSED_ARGUMENTS} WORKING_DIRECTORY ${WORK_DIR} ${input_args}
+		RESULT_VARIABLE rc OUTPUT_VARIABLE out ERROR_VARIABLE out)
+	if (ARG_FAIL AND rc EQUAL 0)
+		message(FATAL_ERROR "firmware_utils ${ARG_UNPARSED_ARGUMENTS}: expected to fail\n${out}")
+	elseif (NOT ARG_FAIL AND NOT rc EQUAL 0)
+		message(FATAL_ERROR "firmware_utils ${ARG_UNPARSED_ARGUMENTS}: exit code ${rc}\n${out}")
+	endif()
+	if (ARG_EXPECT)
+		string(FIND "${out}" "${ARG_EXPECT}" found)
+		if (found EQUAL -1)
+			message(FATAL_ERROR "firmware_utils ${ARG_UNPARSED_ARGUMENTS}: no '${ARG_EXPECT}' in output\n${out}")
+		endif()
+	endif()
+endfunction()
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+# Image of 10 KB text, multiple of the cipher block
+string(REPEAT "firmware image line 0123456789 abcdefghijklmnopqrstuvwxyz\n" 160 image)
+file(WRITE ${WORK_DIR}/fw.bin "${image}")
+
+fwu(encrypt fw.bin smoke 1.2.3 ${KEY} 0123456789abcdef EXPECT "file was be written")
+fwu(verify fw.bin.enc --key ${KEY} EXPECT "1 of 1 verified")
+# Verify is a release gate, wrong key and damaged file must fail the command
+fwu(verify fw.bin.enc --key FFEEDDCCBBAA99887766554433221100 FAIL EXPECT "0 of 1 verified")
+fwu(verify fw.bin --key ${KEY} FAIL EXPECT "0 of 1 verified")
+file(WRITE ${WORK_DIR}/manifest.json "[{\"file\": \"fw.bin\", \"out\": \"batch.enc\", \"name\": \"smoke\", \"version\": \"1.2.3\", \"key\": \"${KEY}\", \"test_phrase\": \"0123456789abcdef\"},
+	{\"file\": \"missing.bin\", \"name\": \"smoke\", \"version\": \"1.2.3\", \"key\": \"${KEY}\", \"test_phrase\": \"0123456789abcdef\"}]")
+fwu(encrypt_batch manifest.json FAIL EXPECT "1 of 2 encrypted")
+fwu(upload fw.bin.enc 1234 --emulate --fw-key ${KEY} --journal ${WORK_DIR}/journal INPUT y EXPECT "upload and verify complete")
+# Fleet on one bus: upload at negotiated rate must leave the port usable for next jobs
+file(WRITE ${WORK_DIR}/jobs.json "{ \"defaults\": { \"pincode\": 1234 }, \"jobs\": [
+	{ \"port\": 1, \"addr\": 1, \"cmd\": \"upload\", \"file\": \"fw.bin.enc\", \"uart_baud\": 921600 },
+	{ \"port\": 1, \"addr\": 1, \"cmd\": \"info\", \"priority\": -1 },
+	{ \"port\": 1, \"addr\": 2, \"cmd\": \"upload\", \"file\": \"fw.bin.enc\", \"priority\": -2 },
+	{ \"port\": 1, \"addr\": 3, \"cmd\": \"info\", \"priority\": -3 } ] }")
+fwu(run jobs.json --emulate --pincode 1234 --fw-key ${KEY} EXPECT "4 ok, 0 skipped, 0 failed")
+# Device with another firmware key rejects the image
+fwu(upload fw.bin.enc 1234 --emulate --fw-key FFEEDDCCBBAA99887766554433221100 INPUT y FAIL)
+fwu(encrypt fw.bin smoke 1.2.3 ${KEY} 0123456789abcdef --compress EXPECT "file was be written")
+fwu(upload fw.bin.enc 1234 --emulate --fw-key ${KEY} --journal ${WORK_DIR}/journal INPUT y EXPECT "upload and verify complete")
@@ -0,0 +1,453 @@
+#include "../protocol/crc32.h"
+#include "../protocol/framer7b.h"
+#include "../protocol/lzss.h"
+#include "../protocol/raiden.h"
+#include "../protocol/ecbm.h"
+#include "../protocol/BlockTuner.hpp"
+#include "../protocol/BootProt.hpp"
+#include "../protocol/EcbmEmu.hpp"
+#include "../protocol/FirmwareContainer.hpp"
+#include "../protocol/RetryPolicy.hpp"
+#include "../protocol/UploadJournal.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* Protocol regression tests, one CTest case per test: protocol_tests <name>
+ */
+
+#define CHECK(cond)		do { if (!(cond)) { throw runtime_error(string(__FILE__) + ":" + to_string(__LINE__) + ": " + #cond); } } while (0)
+
+static const array<uint8_t, 16> _key = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF };
+static const array<uint8_t, 16> _auth_key = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+
+static vector<uint8_t> random_bytes(size_t n, uint32_t seed) {
+	minstd_rand rng(seed);
+	vector<uint8_t> data(n);
+	for (auto& v : data) {
+		v = (uint8_t)rng();
+	}
+	return data;
+}
+
+// Compressible image: repeated records with a counter
+static vector<uint8_t> image_bytes(size_t n) {
+	vector<uint8_t> data(n);
+	for (size_t i = 0; i < n; i++) {
+		data[i] = (uint8_t)(i % 64 < 48 ? i % 13 : i / 64);
+	}
+	return data;
+}
+
+// Image as upload_firmware takes it
+struct EmuImage {
+	FirmwareInfo info;
+	vector<uint8_t> payload;		// encrypted
+	array<uint8_t, 16> phrase;		// encrypted
+};
+
+static EmuImage make_image(const vector<uint8_t>& image, bool compress = false) {
+	EmuImage fw;
+	fw.info.name = "test";
+	fw.info.version = { 1, 0, 0 };
+	fw.info.checksum = crc32(image.data(), image.size());
+	fw.payload = image;
+	if (compress) {
+		fw.payload.resize(lzss_bound(image.size()));
+		int n = lzss_encode(image.data(), image.size(), fw.payload.data(), fw.payload.size());
+		CHECK(n > 0);
+		fw.payload.resize(n);
+		fw.payload.resize((fw.payload.size() + 7) / 8 * 8, 0);
+		fw.info.codec = FirmwareCodec::Lzss;
+		fw.info.raw_size = image.size();
+	}
+	raiden_encode_buf(_key.data(), fw.payload.data(), fw.payload.size());
+	memcpy(fw.phrase.data(), "0123456789abcdef", 16);
+	raiden_encode_buf(_key.data(), fw.phrase.data(), fw.phrase.size());
+	return fw;
+}
+
+// Instant bootloader at address 1 that decrypts with _key
+static EcbmEmuConfig emu_config() {
+	EcbmEmuConfig config;
+	config.auth_key = _auth_key;
+	config.fw_key = _key;
+	config.baud = 0;
+	return config;
+}
+
+static void test_crc32() {
+	const char* check = "123456789";
+	auto crc = crc32((const uint8_t*)check, 9);
+	// Bootloader crc: poly 0x04C11DB7 shifted right, init 0, no final xor
+	CHECK(crc == 0x0328B978);
+	auto data = random_bytes(1000, 1);
+	// Table must match the bitwise reference for every byte
+	uint32_t ref = 0;
+	for (auto v : data) {
+		ref = crc32_dync(ref, v);
+	}
+	auto whole = crc32(data.data(), data.size());
+	auto part = crc32(data.data(), 333);
+	CHECK(whole == ref);
+	CHECK(crc32_update(part, &data[333], data.size() - 333) == whole);
+}
+
+static void test_framer7b() {
+	Framer7b tx;
+	Framer7b rx;
+	framer7b_init(&tx);
+	framer7b_init(&rx);
+	for (size_t n : { (size_t)1, (size_t)7, (size_t)8, (size_t)255, (size_t)ECBM_MAX_FRAME }) {
+		auto data = random_bytes(n, (uint32_t)n);
+		memcpy(framer7b_get_write_buf(&tx), data.data(), n);
+		int nframe = framer7b_make(&tx, n);
+		CHECK(nframe > 0);
+		int rc = 0;
+		const uint8_t* frame = framer7b_get_send_buf(&tx);
+		for (int i = 0; i < nframe; i++) {
+			rc = framer7b_push(&rx, frame[i]);
+			CHECK(rc >= 0);
+			if (i + 1 < nframe) {
+				CHECK(rc == 0);
+			}
+		}
+		CHECK(rc == (int)n);
+		CHECK(memcmp(framer7b_get_read_buf(&rx), data.data(), n) == 0);
+	}
+	CHECK(framer7b_make(&tx, ECBM_MAX_FRAME + 8) < 0);
+}
+
+static void test_lzss() {
+	for (auto data : { image_bytes(10000), random_bytes(3000, 2), vector<uint8_t>(5000, 0xFF) }) {
+		vector<uint8_t> packed(lzss_bound(data.size()));
+		int npacked = lzss_encode(data.data(), data.size(), packed.data(), packed.size());
+		CHECK(npacked > 0);
+		vector<uint8_t> out(data.size());
+		CHECK(lzss_decode(packed.data(), npacked, out.data(), out.size()) == (int)data.size());
+		CHECK(out == data);
+		// Decoder takes the stream by arbitrary chunks, like bootloader blocks
+		LzssDecoder dec;
+		lzss_decoder_init(&dec);
+		vector<uint8_t> chunked;
+		vector<uint8_t> buf(data.size());
+		for (int ptr = 0; ptr < npacked; ptr += 37) {
+			int rc = lzss_decode_push(&dec, &packed[ptr], min(37, npacked - ptr), buf.data(), buf.size());
+			CHECK(rc >= 0);
+			chunked.insert(chunked.end(), buf.begin(), buf.begin() + rc);
+		}
+		CHECK(chunked == data);
+	}
+}
+
+static void test_raiden_lanes() {
+	for (size_t nkeys : { (size_t)1, (size_t)RAIDEN_LANES, (size_t)RAIDEN_LANES + 3 }) {
+		auto keys = random_bytes(16 * nkeys, (uint32_t)nkeys);
+		auto data = random_bytes(4096, 3);
+		vector<uint8_t> bufs(nkeys * data.size());
+		raiden_encode_lanes(keys.data(), nkeys, data.data(), bufs.data(), data.size());
+		for (size_t i = 0; i < nkeys; i++) {
+			vector<uint8_t> one(data.size());
+			raiden_encode(&keys[16 * i], data.data(), one.data(), data.size());
+			CHECK(memcmp(&bufs[i * data.size()], one.data(), one.size()) == 0);
+			raiden_decode_buf(&keys[16 * i], one.data(), one.size());
+			CHECK(one == data);
+		}
+	}
+}
+
+static void test_container_v2() {
+	auto payload = random_bytes(3 * FWC_CHUNK_SIZE + 1000, 4);
+	FirmwareFile meta;
+	meta.name = "test";
+	meta.version = { 1, 2, 3 };
+	meta.checksum = 0x12345678;
+	meta.test_phrase = vector<uint8_t>(16, 'a');
+	for (int version : { 1, 2 }) {
+		stringstream out;
+		FirmwareContainerWriter writer(out, meta, payload.size(), version);
+		for (size_t ptr = 0; ptr < payload.size(); ptr += 10000) {
+			writer.write(span<const uint8_t>(&payload[ptr], min<size_t>(10000, payload.size() - ptr)));
+		}
+		writer.finish();
+		auto bytes = out.str();
+		vector<uint8_t> file(bytes.begin(), bytes.end());
+		CHECK(firmware_container_version(file) == version);
+		auto fw = read_firmware(file);
+		CHECK(fw.name == "test" && fw.checksum == 0x12345678 && fw.version == meta.version);
+		CHECK(fw.data.size() == payload.size() && memcmp(fw.data.data(), payload.data(), payload.size()) == 0);
+		if (version == 2) {
+			// Flipped payload byte is caught by chunk crc table
+			file[file.size() - 10] ^= 1;
+			bool thrown = false;
+			try {
+				read_firmware(file);
+			}
+			catch (const runtime_error&) {
+				thrown = true;
+			}
+			CHECK(thrown);
+		}
+	}
+}
+
+static void test_retry_policy() {
+	RetryPolicy policy(RetryConfig{ .max_retries = 2, .backoff_base_ms = 1, .backoff_max_ms = 2 });
+	CHECK(policy.decide(ECBM_ERR_INTEGRITY, 1).action == RetryAction::Resend);
+	CHECK(policy.decide(ECBM_ERR_TIMEOUT, 2).action == RetryAction::Backoff);
+	CHECK(policy.decide(ECBM_ERR_TIMEOUT, 3).action == RetryAction::Fail);
+	CHECK(policy.decide(ECBM_ERR_INTERNAL, 1).action == RetryAction::Fail);
+	CHECK(policy.decide(ECBM_ERR_BOOT_INC_KEY, 1).action == RetryAction::Fail);
+	// Equal jitter: delay is in [step / 2, step], the first step is base
+	RetryPolicy exact(RetryConfig{ .max_retries = 20, .backoff_base_ms = 100, .backoff_max_ms = 1000 });
+	for (int i = 0; i < 20; i++) {
+		auto first = exact.decide(ECBM_ERR_TIMEOUT, 1);
+		CHECK(first.delay_ms >= 50 && first.delay_ms <= 100);
+	}
+	// Base shifted past 32 bits stays at the cap
+	RetryPolicy big(RetryConfig{ .max_retries = 20, .backoff_base_ms = 100000, .backoff_max_ms = 1000000 });
+	for (int attempt = 1; attempt <= 20; attempt++) {
+		auto decision = big.decide(ECBM_ERR_TIMEOUT, attempt);
+		CHECK(decision.delay_ms >= min<uint32_t>(100000u << min(attempt - 1, 4), 1000000) / 2);
+		CHECK(decision.delay_ms <= 1000000);
+	}
+}
+
+static void test_block_tuner() {
+	BlockTuner tuner(BlockTunerConfig{ .initial = 256, .min = 64, .max = 1000, .window = 16 });
+	CHECK(tuner.size() == 256);
+	// Error of a window just begun is no rate, the size holds
+	CHECK(!tuner.on_error());
+	CHECK(tuner.size() == 256);
+	// The first window always improves on nothing
+	for (int i = 0; i < 14; i++) {
+		CHECK(!tuner.on_block(256));
+	}
+	CHECK(tuner.on_block(256));
+	CHECK(tuner.size() == 512);
+	// Errors beyond the rate over a full window halve the size
+	for (int i = 0; i < 14; i++) {
+		tuner.on_block(512);
+	}
+	CHECK(!tuner.on_error());
+	CHECK(tuner.on_error());
+	CHECK(tuner.size() == 256);
+	for (int i = 0; i < 16; i++) {
+		tuner.on_block(256);
+	}
+	CHECK(tuner.size() == 512);
+	// Second strike at 512 makes it the device limit
+	for (int i = 0; i < 14; i++) {
+		tuner.on_block(512);
+	}
+	tuner.on_error();
+	tuner.on_error();
+	CHECK(tuner.size() == 256);
+	for (int i = 0; i < 16; i++) {
+		tuner.on_block(256);
+	}
+	CHECK(tuner.size() == 256);
+	auto curve = tuner.curve();
+	CHECK(!curve.empty());
+	for (const auto& s : curve) {
+		CHECK(s.size % 8 == 0);
+	}
+	// Limits are aligned to the cipher block
+	BlockTuner odd(BlockTunerConfig{ .initial = 100, .min = 30, .max = 1001 });
+	CHECK(odd.size() == 96);
+}
+
+// Encrypted image through emulated bootloader, flash must hold the plaintext.
+// Without tuning given the BootProt default is used
+static void emu_upload(bool compress, optional<optional<BlockTunerConfig>> tuning = nullopt) {
+	auto image = image_bytes(20000);
+	EcbmEmu emu(emu_config());
+	Ecbm ecbm;
+	emu.attach(&ecbm);
+	auto fw = make_image(image, compress);
+	BootProt dev(&ecbm, 1, _auth_key);
+	size_t max_block = BOOTPROT_BLOCK_SIZE;
+	if (tuning.has_value()) {
+		dev.set_block_tuning(*tuning);
+		max_block = tuning->has_value() ? (*tuning)->max : BOOTPROT_BLOCK_SIZE;
+	}
+	auto report = dev.upload_firmware(fw.info, fw.phrase, fw.payload);
+	CHECK(report.complete);
+	CHECK(report.bytes == fw.payload.size());
+	CHECK(report.block_size <= max_block);
+	const auto& flash = emu.device(1)->flash();
+	CHECK(memcmp(flash.data(), image.data(), image.size()) == 0);
+	auto installed = dev.get_firmware_info();
+	CHECK(installed.checksum == fw.info.checksum && installed.name == "test");
+}
+
+// Plaintext crcs per upload block, what the encrypt command stores for delta upload
+static void add_block_crcs(EmuImage& fw, const vector<uint8_t>& image) {
+	fw.info.crc_block = BOOTPROT_BLOCK_SIZE;
+	for (size_t ptr = 0; ptr < image.size(); ptr += BOOTPROT_BLOCK_SIZE) {
+		fw.info.block_crcs.push_back(crc32(&image[ptr], min<size_t>(BOOTPROT_BLOCK_SIZE, image.size() - ptr)));
+	}
+}
+
+// Second upload sends only blocks that differ from the installed image
+static void test_emu_upload_delta() {
+	auto image = image_bytes(80 * BOOTPROT_BLOCK_SIZE);
+	EcbmEmu emu(emu_config());
+	Ecbm ecbm;
+	emu.attach(&ecbm);
+	BootProt dev(&ecbm, 1, _auth_key);
+	auto fw = make_image(image);
+	add_block_crcs(fw, image);
+	CHECK(dev.upload_firmware(fw.info, fw.phrase, fw.payload).blocks == 80);
+
+	auto next = image;
+	for (size_t block : { 3, 4, 40 }) {
+		next[block * BOOTPROT_BLOCK_SIZE + block] ^= 0x5A;
+	}
+	auto fw_next = make_image(next);
+	add_block_crcs(fw_next, next);
+	auto report = dev.upload_firmware(fw_next.info, fw_next.phrase, fw_next.payload);
+	CHECK(report.complete);
+	CHECK(report.blocks == 3);
+	CHECK(report.skipped == next.size() - 3 * BOOTPROT_BLOCK_SIZE);
+	const auto& flash = emu.device(1)->flash();
+	CHECK(memcmp(flash.data(), next.data(), next.size()) == 0);
+	CHECK(dev.get_firmware_info().checksum == fw_next.info.checksum);
+
+	// Without delta every block goes again
+	dev.set_delta(false);
+	CHECK(dev.upload_firmware(fw_next.info, fw_next.phrase, fw_next.payload).blocks == 80);
+}
+
+// Upload cut by device reset continues from the offset committed by the device
+static void test_emu_upload_resume() {
+	auto image = image_bytes(80 * BOOTPROT_BLOCK_SIZE);
+	auto config = emu_config();
+	config.reset_at = 50 * BOOTPROT_BLOCK_SIZE;
+	EcbmEmu emu(config);
+	Ecbm ecbm;
+	emu.attach(&ecbm);
+	auto fw = make_image(image);
+	{
+		BootProt dev(&ecbm, 1, _auth_key);
+		dev.set_retry_policy(RetryPolicy(RetryConfig{ .max_retries = 0 }));
+		bool thrown = false;
+		try {
+			dev.upload_firmware(fw.info, fw.phrase, fw.payload);
+		}
+		catch (const runtime_error&) {
+			thrown = true;
+		}
+		CHECK(thrown);
+		CHECK(!dev.last_upload_report().complete);
+	}
+	// Journal may only hold the device offset back
+	auto path = (filesystem::temp_directory_path() / "fwu_emu_upload_resume.journal").string();
+	filesystem::remove(path);
+	UploadJournal journal(path);
+	journal.set("test", 40 * BOOTPROT_BLOCK_SIZE + 8);
+	BootProt dev(&ecbm, 1, _auth_key);
+	dev.set_resume(true);
+	dev.set_journal(&journal, "test");
+	auto report = dev.upload_firmware(fw.info, fw.phrase, fw.payload);
+	CHECK(report.complete);
+	CHECK(report.resumed_from == 40 * BOOTPROT_BLOCK_SIZE);
+	CHECK(report.bytes == image.size() - report.resumed_from);
+	const auto& flash = emu.device(1)->flash();
+	CHECK(memcmp(flash.data(), image.data(), image.size()) == 0);
+	CHECK(!journal.get("test").has_value());
+	filesystem::remove(path);
+}
+
+// Filler regions of erased value are left to the erase at begin when sparse upload is on
+static void emu_upload_sparse(bool sparse) {
+	auto image = image_bytes(80 * BOOTPROT_BLOCK_SIZE);
+	fill(&image[2600], &image[7600], BOOTPROT_ERASED_BYTE);
+	EcbmEmu emu(emu_config());
+	Ecbm ecbm;
+	emu.attach(&ecbm);
+	auto fw = make_image(image);
+	fw.info.filler_regions = { { 2600, 5000 } };
+	BootProt dev(&ecbm, 1, _auth_key);
+	dev.set_sparse(sparse);
+	auto report = dev.upload_firmware(fw.info, fw.phrase, fw.payload);
+	CHECK(report.complete);
+	CHECK(report.skipped == (sparse ? 5000 : 0));
+	CHECK(report.bytes == image.size() - report.skipped);
+	const auto& flash = emu.device(1)->flash();
+	CHECK(memcmp(flash.data(), image.data(), image.size()) == 0);
+}
+
+// Bootloader is recognized after reset also when it refuses checksum of a blank image
+static void test_emu_boot_entry() {
+	auto config = emu_config();
+	config.start_app = true;
+	config.checksum_needs_app = true;
+	config.boot_ms = 20;
+	EcbmEmu emu(config);
+	Ecbm ecbm;
+	emu.attach(&ecbm);
+	// Blank device: found in bootloader, then reset on demand
+	BootProt { &ecbm, 1, _auth_key };
+	BootProt dev(&ecbm, 1, _auth_key, BootEntryConfig{ .ready_ms = 500, .skip_reset = false });
+	auto image = image_bytes(4096);
+	auto fw = make_image(image);
+	CHECK(dev.upload_firmware(fw.info, fw.phrase, fw.payload).complete);
+	// App runs now and is reset into bootloader
+	BootProt next(&ecbm, 1, _auth_key, BootEntryConfig{ .ready_ms = 500 });
+	CHECK(next.get_firmware_info().checksum == fw.info.checksum);
+}
+
+int main(int argc, char** argv) {
+	const map<string, function<void()>> tests = {
+		{ "crc32", test_crc32 },
+		{ "framer7b", test_framer7b },
+		{ "raiden_lanes", test_raiden_lanes },
+		{ "container_v2", test_container_v2 },
+		{ "retry_policy", test_retry_policy },
+		{ "block_tuner", test_block_tuner },
+		{ "lzss", test_lzss },
+		{ "emu_upload", [] { emu_upload(false); } },
+		{ "emu_upload_lzss", [] { emu_upload(true); } },
+		{ "emu_upload_fixed", [] { emu_upload(false, optional<BlockTunerConfig>()); } },
+		{ "emu_upload_tuned", [] { emu_upload(false, BlockTunerConfig{ .max = 2048, .window = 4 }); } },
+		{ "emu_upload_delta", test_emu_upload_delta },
+		{ "emu_upload_resume", test_emu_upload_resume },
+		{ "emu_upload_sparse", [] { emu_upload_sparse(true); } },
+		{ "emu_upload_no_sparse", [] { emu_upload_sparse(false); } },
+		{ "emu_boot_entry", test_emu_boot_entry }
+	};
+	if (argc > 1 && tests.count(argv[1]) == 0) {
+		cout << "unknown test '" << argv[1] << "'" << endl;
+		return 1;
+	}
+	int failed = 0;
+	for (const auto& [name, test] : tests) {
+		if (argc > 1 && name != argv[1]) {
+			continue;
+		}
+		try {
+			test();
+			cout << name << ": ok" << endl;
+		}
+		catch (const exception& e) {
+			cout << name << ": FAILED " << e.what() << endl;
+			failed++;
+		}
+	}
+	return failed == 0 ? 0 : 1;
+}